@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "batch.h"
+
+/*
+ * Batch mode (-x).
+ *
+ * Runs the jobs of a job file in the namespace that has been set up once for
+ * all of them, up to a given number at a time. A job is one line:
+ *
+ *     [-C <dir>] [NAME=value]... program [args]...
+ *
+ * Words are separated by spaces and tabs and can be quoted with '' and "",
+ * and a backslash escapes the next character. There's no shell: the program
+ * is started with execvp(), in <dir> if it's set and with NAME=value added to
+ * the environment. Empty lines and lines that start with # are skipped.
+ *
+ * Jobs are read only when there's a free slot, so a job list can be streamed
+ * to stdin. Their stdin is /dev/null, their stdout and stderr are shared.
+ * Jobs that fail are listed in the summary, which goes to stderr when all of
+ * them have finished.
+ */
+
+struct job {
+    pid_t pid;          /* 0 if the slot is free. */
+    size_t line;
+    char *text;         /* The line as it was read, for the summary. */
+};
+
+struct batch {
+    FILE *f;
+    char *buf;
+    size_t bufsize;
+    size_t line;
+    int devnull;
+    sigset_t oldmask;
+    struct job *slots;
+    int nslots;
+    int running;
+    unsigned total;
+    unsigned failed;
+    struct arena arena;
+    struct strarray failures;
+};
+
+/* Splits s into words in place. Returns the number of words, or -1 if a
+ * quote is not closed. words must have room for strlen(s)/2+2 pointers. */
+static int split_words(char *s, char **words)
+{
+    int n = 0;
+    char *out;
+    bool more;
+
+    for (;;) {
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (*s == '\0')
+            break;
+
+        words[n++] = out = s;
+        while (*s != '\0' && *s != ' ' && *s != '\t') {
+            if (*s == '\'') {
+                s++;
+                while (*s != '\0' && *s != '\'')
+                    *out++ = *s++;
+                if (*s == '\0')
+                    return -1;
+                s++;
+            } else if (*s == '"') {
+                s++;
+                while (*s != '\0' && *s != '"') {
+                    if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+                        s++;
+                    *out++ = *s++;
+                }
+                if (*s == '\0')
+                    return -1;
+                s++;
+            } else {
+                if (*s == '\\' && s[1] != '\0')
+                    s++;
+                *out++ = *s++;
+            }
+        }
+
+        /* out may point at the separator, so look at it first. */
+        more = *s != '\0';
+        *out = '\0';
+        if (more)
+            s++;
+    }
+
+    words[n] = NULL;
+    return n;
+}
+
+static bool is_assignment(const char *s)
+{
+    if (*s != '_' && !(*s >= 'A' && *s <= 'Z') && !(*s >= 'a' && *s <= 'z'))
+        return false;
+    for (s++; *s != '='; s++) {
+        if (*s != '_' && !(*s >= 'A' && *s <= 'Z') && !(*s >= 'a' && *s <= 'z')
+                && !(*s >= '0' && *s <= '9'))
+            return false;
+    }
+    return true;
+}
+
+static void batch_fail(struct batch *b, size_t line, const char *reason,
+                       const char *text)
+{
+    size_t len = strlen(reason) + strlen(text) + 48;
+    char *s = arena_alloc(&b->arena, len);
+
+    snprintf(s, len, "line %zu: %s: %s", line, reason, text);
+    strarray_append(&b->failures, s);
+    b->failed++;
+}
+
+/* Failures are recorded as they happen and listed by line. */
+static int failure_cmp(const void *a, const void *b)
+{
+    unsigned long la = strtoul(*(char *const *)a + strlen("line "), NULL, 10);
+    unsigned long lb = strtoul(*(char *const *)b + strlen("line "), NULL, 10);
+    return (la > lb) - (la < lb);
+}
+
+/* Starts the program of a job in the child. Never returns. */
+static void job_exec(struct batch *b, size_t line, char **words, int env,
+                     int prog, const char *dir)
+{
+    sigprocmask(SIG_SETMASK, &b->oldmask, NULL);
+
+    if (dup2(b->devnull, STDIN_FILENO) == -1)
+        _exit(127);
+
+    if (dir && chdir(dir) == -1) {
+        ERROR("error: job at line %zu: chdir(%s): %s.\n", line, dir, strerror(errno));
+        _exit(127);
+    }
+
+    for (int i = env; i < prog; i++)
+        putenv(words[i]);
+
+    execvp(words[prog], words + prog);
+    ERROR("error: job at line %zu: execvp(%s): %s.\n", line, words[prog],
+          strerror(errno));
+    _exit(errno == ENOENT ? 127 : 126);
+}
+
+/* Reads the next job and starts it in a free slot. Returns false when there
+ * are no more jobs. */
+static bool batch_start(struct batch *b)
+{
+    ssize_t len;
+
+    while ((len = getline(&b->buf, &b->bufsize, b->f)) != -1) {
+        char *s = b->buf;
+        char **words = NULL;
+        char *text = NULL;
+        char *dir = NULL;
+        int n, env = 0, prog;
+        struct job *job = NULL;
+        pid_t pid;
+
+        b->line++;
+        if (len > 0 && s[len-1] == '\n')
+            s[--len] = '\0';
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (*s == '\0' || *s == '#')
+            continue;
+
+        b->total++;
+        text = strdup(s);
+        words = malloc((strlen(s) / 2 + 2) * sizeof(char *));
+        if (!text || !words) {
+            batch_fail(b, b->line, strerror(ENOMEM), s);
+            goto next;
+        }
+
+        n = split_words(s, words);
+        if (n == -1) {
+            batch_fail(b, b->line, "unterminated quote", text);
+            goto next;
+        }
+
+        if (n >= 2 && strcmp(words[0], "-C") == 0) {
+            dir = words[1];
+            env = 2;
+        }
+        for (prog = env; prog < n && is_assignment(words[prog]); prog++);
+        if (prog == n) {
+            batch_fail(b, b->line, "no program", text);
+            goto next;
+        }
+
+        for (int i = 0; i < b->nslots; i++) {
+            if (b->slots[i].pid == 0) {
+                job = &b->slots[i];
+                break;
+            }
+        }
+
+        pid = fork();
+        if (pid == -1) {
+            batch_fail(b, b->line, strerror(errno), text);
+            goto next;
+        }
+        if (pid == 0)
+            job_exec(b, b->line, words, env, prog, dir);
+
+        DEBUG("job at line %zu: pid %d\n", b->line, pid);
+        job->pid = pid;
+        job->line = b->line;
+        job->text = text;
+        b->running++;
+        free(words);
+        return true;
+
+next:
+        free(text);
+        free(words);
+    }
+
+    if (ferror(b->f))
+        ERROR("error: failed to read jobs: %s.\n", strerror(errno));
+    return false;
+}
+
+/* Collects the exit statuses of finished jobs. Other children, like the
+ * server, are reaped and ignored. */
+static void batch_reap(struct batch *b)
+{
+    pid_t pid;
+    int status;
+    char reason[48];
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < b->nslots; i++) {
+            struct job *job = &b->slots[i];
+            if (job->pid != pid)
+                continue;
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+                snprintf(reason, sizeof(reason), "exit status %d", WEXITSTATUS(status));
+                batch_fail(b, job->line, reason, job->text);
+            } else if (WIFSIGNALED(status)) {
+                snprintf(reason, sizeof(reason), "killed by signal %d", WTERMSIG(status));
+                batch_fail(b, job->line, reason, job->text);
+            }
+
+            free(job->text);
+            job->text = NULL;
+            job->pid = 0;
+            b->running--;
+            break;
+        }
+    }
+}
+
+/* Runs the jobs from path ("-" is stdin), up to jobs at a time. Returns 0 if
+ * all of them have succeeded, 1 if some have failed, and 128+signal if the
+ * batch has been interrupted. */
+int batch_run(const char *path, int jobs)
+{
+    struct batch b = {0};
+    sigset_t mask;
+    siginfo_t si;
+    int sig = 0;
+    bool eof = false;
+    int exit_code = 1;
+
+    b.devnull = -1;
+    b.nslots = jobs;
+    strarray_init(&b.failures, &b.arena);
+
+    /* Signals are handled here between jobs. On SIGTERM and SIGHUP, the
+     * running jobs get the same signal, while SIGINT from the terminal
+     * reaches them anyway. In both cases no more jobs are started. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, &b.oldmask);
+
+    b.f = strcmp(path, "-") == 0 ? stdin : fopen(path, "re");
+    if (!b.f)
+        ERROR_EXIT("error: failed to open %s: %s.\n", path, strerror(errno));
+
+    b.devnull = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    if (b.devnull == -1)
+        ERROR_EXIT("error: failed to open /dev/null: %s.\n", strerror(errno));
+
+    b.slots = calloc(jobs, sizeof(struct job));
+    if (!b.slots)
+        ERROR_EXIT("calloc: %s\n", strerror(errno));
+
+    for (;;) {
+        while (!sig && !eof && b.running < b.nslots) {
+            if (!batch_start(&b))
+                eof = true;
+        }
+        if (b.running == 0)
+            break;
+
+        if (sigwaitinfo(&mask, &si) == -1) {
+            if (errno == EINTR)
+                continue;
+            ERROR_EXIT("sigwaitinfo: %s\n", strerror(errno));
+        }
+
+        if (si.si_signo == SIGCHLD) {
+            batch_reap(&b);
+        } else if (!sig) {
+            sig = si.si_signo;
+            DEBUG("got signal %d, waiting for %d jobs\n", sig, b.running);
+            for (int i = 0; i < b.nslots && sig != SIGINT; i++) {
+                if (b.slots[i].pid != 0)
+                    kill(b.slots[i].pid, sig);
+            }
+        }
+    }
+
+    ERROR("batch: %u jobs, %u failed%s\n", b.total, b.failed,
+          b.failed ? ":" : ".");
+    qsort(b.failures.list, b.failures.end, sizeof(char *), failure_cmp);
+    for (size_t i = 0; i < b.failures.end; i++)
+        ERROR("    %s\n", b.failures.list[i]);
+    if (sig)
+        ERROR("batch: interrupted by signal %d.\n", sig);
+
+    exit_code = sig ? 128 + sig : b.failed ? 1 : 0;
+
+end:
+    if (b.f && b.f != stdin)
+        fclose(b.f);
+    if (b.devnull != -1)
+        close(b.devnull);
+    if (b.slots) {
+        for (int i = 0; i < b.nslots; i++)
+            free(b.slots[i].text);
+        free(b.slots);
+    }
+    free(b.buf);
+    arena_free(&b.arena);
+    sigprocmask(SIG_SETMASK, &b.oldmask, NULL);
+    return exit_code;
+}
@@ -0,0 +1,6 @@
+#ifndef VOIDNSRUN_BATCH_H
+#define VOIDNSRUN_BATCH_H
+
+int batch_run(const char *path, int jobs);
+
+#endif //VOIDNSRUN_BATCH_H
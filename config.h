@@ -3,16 +3,71 @@
 
 #define PROG_VERSION "1.3.2"
 
-#define USER_LISTS_MAX 50
-
 #define CONTAINER_DIR_VAR "VOIDNSRUN_DIR"
 #define UNDO_BIN_VAR "VOIDNSUNDO_BIN"
+#define TRACE_VAR "VOIDNSRUN_TRACE"
+#define SPAWN_VAR "VOIDNSUNDO_SPAWN"
 #define VOIDNSUNDO_NAME "voidnsundo"
 #define OLDROOT "/oldroot"
 
 /* This path has not been made configurable and is hardcoded
  * here for security purposes. If you want to change it, change it
- * here and recompile and reinstall both utilities. */
-#define SOCK_PATH "/run/voidnsrun/sock"
+ * here and recompile and reinstall both utilities.
+ *
+ * Each namespace gets a private tmpfs here, and its socket is
+ * SOCK_DIR/<namespace inode>/sock. */
+#define SOCK_DIR "/run/voidnsrun"
+
+/* Named sessions are registered here, in the host mount namespace. */
+#define SESSION_DIR "/run/voidnsrun/sessions"
+#define SESSION_NAME_MAX 64
+
+/* A session is torn down after it has had no processes for this many
+ * seconds. The session holder checks for that every SESSION_POLL_INTERVAL
+ * seconds. */
+#define SESSION_IDLE_TIMEOUT 300
+#define SESSION_POLL_INTERVAL 5
+
+/* Launch profiles, one per file, and the cache of their compiled plan.
+ * Both must be owned by root. */
+#define PROFILE_DIR "/etc/voidnsrun/profiles"
+#define CACHE_DIR "/var/cache/voidnsrun"
+#define PLAN_CACHE CACHE_DIR "/profiles.plan"
+
+/* --auto-undo caches its scans here, the SHIM_CACHE_MAX most recent ones, and
+ * puts the shims in SHIM_DIR, which is only there in the namespace. */
+#define SHIM_CACHE_DIR CACHE_DIR "/shims"
+#define SHIM_CACHE_MAX 32
+#define SHIM_DIR SOCK_DIR "/bin"
+
+/* With --prefetch-libs, the libraries of PROGRAM are looked up and read
+ * ahead by this many threads. */
+#define LIBPREFETCH_THREADS 4
+
+/* With --minimal, the namespace only has the root filesystem, these paths
+ * with the mounts under them, and what voidnsrun mounts. */
+#define MINIMAL_KEEP {"/dev", "/proc", "/sys", "/run", "/tmp", "/home", "/root"}
+
+/* The container's ld.so cache is mounted at LD_CACHE. It's considered stale
+ * when one of LD_CACHE_DIRS in the container has changed after it. */
+#define LD_CACHE "/etc/ld.so.cache"
+#define LD_CACHE_DIRS {"/usr/lib", "/usr/lib64", "/usr/lib32", "/usr/local/lib"}
+
+/* --check indexes the libraries in LD_CACHE_DIRS of each container and
+ * caches the index here, the LIBINDEX_CACHE_MAX most recent ones. */
+#define LIBINDEX_DIR CACHE_DIR "/libs"
+#define LIBINDEX_CACHE_MAX 16
+
+/* Batch mode (-x) runs at most this many jobs at a time. */
+#define BATCH_JOBS_MAX 1024
+
+/* The launch broker, voidnsrund, reads its pools from BROKER_CONF and has a
+ * socket for each of them in BROKER_DIR. It builds namespaces with
+ * BROKER_VOIDNSRUN, unless the config says otherwise, and waits for
+ * BROKER_RETRY seconds after a failed build. */
+#define BROKER_CONF "/etc/voidnsrun/voidnsrund.conf"
+#define BROKER_DIR "/run/voidnsrund"
+#define BROKER_VOIDNSRUN "/usr/local/bin/voidnsrun"
+#define BROKER_RETRY 5
 
 #endif //VOIDNSRUN_CONFIG_H
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "elfinfo.h"
+
+/*
+ * Just enough of ELF to follow the dependencies of programs and libraries:
+ * the header, the program headers and the dynamic section. Only files of the
+ * native byte order are read. The file is mapped, so only the pages with
+ * these parts are read from the disk, however large it is.
+ */
+
+struct segment {
+    uint32_t type;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t filesz;
+};
+
+struct image {
+    const unsigned char *p;
+    size_t size;
+    bool is64;
+    struct segment *segs;
+    size_t nsegs;
+};
+
+static bool in_file(const struct image *im, uint64_t off, uint64_t len)
+{
+    return off <= im->size && len <= im->size - off;
+}
+
+/* Translates a virtual address to a file offset through the PT_LOAD
+ * segments. Returns false if it's not backed by the file. */
+static bool vaddr_offset(const struct image *im, uint64_t vaddr, uint64_t *off)
+{
+    for (size_t i = 0; i < im->nsegs; i++) {
+        const struct segment *s = &im->segs[i];
+        if (s->type == PT_LOAD && vaddr >= s->vaddr && vaddr - s->vaddr < s->filesz) {
+            *off = vaddr - s->vaddr + s->offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_segments(struct image *im, uint64_t phoff, size_t phentsize,
+                          size_t phnum)
+{
+    if (phentsize != (im->is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr))
+            || !in_file(im, phoff, (uint64_t)phentsize * phnum))
+        return false;
+
+    im->segs = malloc(sizeof(struct segment) * (phnum + 1));
+    if (im->segs == NULL)
+        return false;
+
+    for (size_t i = 0; i < phnum; i++) {
+        const unsigned char *ph = im->p + phoff + i * phentsize;
+        struct segment *s = &im->segs[i];
+        if (im->is64) {
+            Elf64_Phdr h;
+            memcpy(&h, ph, sizeof(h));
+            s->type = h.p_type;
+            s->offset = h.p_offset;
+            s->vaddr = h.p_vaddr;
+            s->filesz = h.p_filesz;
+        } else {
+            Elf32_Phdr h;
+            memcpy(&h, ph, sizeof(h));
+            s->type = h.p_type;
+            s->offset = h.p_offset;
+            s->vaddr = h.p_vaddr;
+            s->filesz = h.p_filesz;
+        }
+    }
+    im->nsegs = phnum;
+    return true;
+}
+
+/* Copies the string at off in the file, which must end before limit. */
+static char *copy_string(const struct image *im, uint64_t off, uint64_t limit,
+                         struct arena *arena)
+{
+    const char *s, *nul;
+    char *copy;
+
+    if (limit > im->size)
+        limit = im->size;
+    if (off >= limit)
+        return NULL;
+
+    s = (const char *)im->p + off;
+    nul = memchr(s, '\0', limit - off);
+    if (nul == NULL)
+        return NULL;
+
+    copy = arena_alloc(arena, nul - s + 1);
+    memcpy(copy, s, nul - s + 1);
+    return copy;
+}
+
+static bool read_dynamic(const struct image *im, const struct segment *dyn,
+                         struct elf_info *info, struct arena *arena)
+{
+    size_t entsize = im->is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    uint64_t strtab = 0, strsz = 0, stroff = 0;
+    int pass;
+
+    if (!in_file(im, dyn->offset, dyn->filesz))
+        return false;
+
+    /* The string table has to be found first, wherever it is in the
+     * section, so the entries are walked twice. */
+    for (pass = 0; pass < 2; pass++) {
+        for (uint64_t off = 0; off + entsize <= dyn->filesz; off += entsize) {
+            const unsigned char *d = im->p + dyn->offset + off;
+            int64_t tag;
+            uint64_t val;
+            char *s;
+
+            if (im->is64) {
+                Elf64_Dyn e;
+                memcpy(&e, d, sizeof(e));
+                tag = e.d_tag;
+                val = e.d_un.d_val;
+            } else {
+                Elf32_Dyn e;
+                memcpy(&e, d, sizeof(e));
+                tag = e.d_tag;
+                val = e.d_un.d_val;
+            }
+            if (tag == DT_NULL)
+                break;
+
+            if (pass == 0) {
+                if (tag == DT_STRTAB)
+                    strtab = val;
+                else if (tag == DT_STRSZ)
+                    strsz = val;
+                continue;
+            }
+
+            if (tag != DT_NEEDED && tag != DT_SONAME && tag != DT_RUNPATH
+                    && tag != DT_RPATH)
+                continue;
+            if (val >= strsz)
+                return false;
+            s = copy_string(im, stroff + val, stroff + strsz, arena);
+            if (s == NULL)
+                return false;
+
+            if (tag == DT_NEEDED)
+                strarray_append(&info->needed, s);
+            else if (tag == DT_SONAME)
+                info->soname = s;
+            else if (tag == DT_RUNPATH)
+                info->runpath = s;
+            else
+                info->rpath = s;
+        }
+
+        if (pass == 0 && (strtab == 0 || !vaddr_offset(im, strtab, &stroff)))
+            return false;
+    }
+
+    /* DT_RPATH is ignored by the loader if there's DT_RUNPATH. */
+    if (info->runpath != NULL)
+        info->rpath = NULL;
+    return true;
+}
+
+/* Reads the ELF file fd. Strings in info are allocated from arena. Returns
+ * false with errno set to ENOEXEC if it's not an ELF file this can read. */
+bool elf_read(int fd, struct elf_info *info, struct arena *arena)
+{
+    static const uint16_t one = 1;
+    unsigned char native = *(const unsigned char *)&one ? ELFDATA2LSB : ELFDATA2MSB;
+    struct image im = {0};
+    struct stat st;
+    uint64_t phoff;
+    size_t phentsize, phnum;
+    void *p;
+    bool ok = false;
+
+    memset(info, 0, sizeof(*info));
+    strarray_init(&info->needed, arena);
+
+    if (fstat(fd, &st) == -1)
+        return false;
+    if (!S_ISREG(st.st_mode) || (uint64_t)st.st_size < sizeof(Elf32_Ehdr)) {
+        errno = ENOEXEC;
+        return false;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    im.p = p;
+    im.size = st.st_size;
+
+    if (memcmp(im.p, ELFMAG, SELFMAG) != 0 || im.p[EI_DATA] != native
+            || (im.p[EI_CLASS] != ELFCLASS32 && im.p[EI_CLASS] != ELFCLASS64))
+        goto end;
+    im.is64 = im.p[EI_CLASS] == ELFCLASS64;
+    info->class = im.p[EI_CLASS];
+
+    if (im.is64) {
+        Elf64_Ehdr h;
+        if (!in_file(&im, 0, sizeof(h)))
+            goto end;
+        memcpy(&h, im.p, sizeof(h));
+        info->type = h.e_type;
+        info->machine = h.e_machine;
+        phoff = h.e_phoff;
+        phentsize = h.e_phentsize;
+        phnum = h.e_phnum;
+    } else {
+        Elf32_Ehdr h;
+        memcpy(&h, im.p, sizeof(h));
+        info->type = h.e_type;
+        info->machine = h.e_machine;
+        phoff = h.e_phoff;
+        phentsize = h.e_phentsize;
+        phnum = h.e_phnum;
+    }
+
+    if (phnum > 0 && !read_segments(&im, phoff, phentsize, phnum))
+        goto end;
+
+    for (size_t i = 0; i < im.nsegs; i++) {
+        const struct segment *s = &im.segs[i];
+        if (s->type == PT_INTERP && in_file(&im, s->offset, s->filesz)) {
+            info->interp = copy_string(&im, s->offset, s->offset + s->filesz, arena);
+        } else if (s->type == PT_DYNAMIC) {
+            if (!read_dynamic(&im, s, info, arena))
+                goto end;
+        }
+    }
+    ok = true;
+
+end:
+    free(im.segs);
+    munmap(p, st.st_size);
+    if (!ok)
+        errno = ENOEXEC;
+    return ok;
+}
+
+/* Appends runpath to buf, with $ORIGIN replaced by origin, the directory of
+ * the file it comes from. */
+void elf_expand_origin(char *buf, size_t size, const char *runpath,
+                       const char *origin)
+{
+    size_t n = strlen(buf);
+
+    while (*runpath != '\0' && n + 1 < size) {
+        size_t len = 0;
+        if (strncmp(runpath, "$ORIGIN", 7) == 0)
+            len = 7;
+        else if (strncmp(runpath, "${ORIGIN}", 9) == 0)
+            len = 9;
+
+        if (len > 0) {
+            n += snprintf(buf + n, size - n, "%s", origin);
+            runpath += len;
+        } else
+            buf[n++] = *runpath++;
+    }
+    buf[n < size ? n : size - 1] = '\0';
+}
+
+/* Appends the ':' separated list s to buf. */
+static void path_append(char *buf, size_t size, const char *s)
+{
+    size_t n = strlen(buf);
+
+    if (*s == '\0' || n + 1 >= size)
+        return;
+    snprintf(buf + n, size - n, "%s%s", n > 0 ? ":" : "", s);
+}
+
+/* Puts to buf where the loader looks for the DT_NEEDED entries of an object
+ * with these rpath and runpath (see elf_info), whose directory is origin, in
+ * the loader's order:
+ *
+ *   - DT_RPATH of the object and of the objects that loaded it, up to the
+ *     executable, if the object has no DT_RUNPATH;
+ *   - LD_LIBRARY_PATH;
+ *   - DT_RUNPATH of the object, which doesn't apply to anything else;
+ *   - the default directories.
+ *
+ * inherited is the DT_RPATH chain of the objects that loaded this one, and
+ * the chain to pass on to its own dependencies is put to chain. */
+void elf_search_path(char *buf, size_t size, char *chain, size_t chain_size,
+                     const char *rpath, const char *runpath,
+                     const char *origin, const char *inherited,
+                     const char *lib_path, const char *defaults)
+{
+    char expanded[PATH_MAX * 2];
+
+    chain[0] = '\0';
+    if (rpath != NULL)
+        elf_expand_origin(chain, chain_size, rpath, origin);
+    path_append(chain, chain_size, inherited);
+
+    buf[0] = '\0';
+    if (runpath == NULL)
+        path_append(buf, size, chain);
+    path_append(buf, size, lib_path);
+    if (runpath != NULL) {
+        expanded[0] = '\0';
+        elf_expand_origin(expanded, sizeof(expanded), runpath, origin);
+        path_append(buf, size, expanded);
+    }
+    path_append(buf, size, defaults);
+}
@@ -0,0 +1,28 @@
+#ifndef VOIDNSRUN_ELFINFO_H
+#define VOIDNSRUN_ELFINFO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+struct elf_info {
+    unsigned char class;    /* ELFCLASS32 or ELFCLASS64. */
+    uint16_t machine;
+    uint16_t type;          /* ET_EXEC, ET_DYN and such. */
+    char *interp;           /* PT_INTERP, or NULL. */
+    char *soname;           /* DT_SONAME, or NULL. */
+    char *rpath;            /* DT_RPATH, unless there's DT_RUNPATH, or NULL. */
+    char *runpath;          /* DT_RUNPATH, or NULL. */
+    struct strarray needed; /* DT_NEEDED entries. */
+};
+
+bool elf_read(int fd, struct elf_info *info, struct arena *arena);
+void elf_expand_origin(char *buf, size_t size, const char *runpath,
+                       const char *origin);
+void elf_search_path(char *buf, size_t size, char *chain, size_t chain_size,
+                     const char *rpath, const char *runpath,
+                     const char *origin, const char *inherited,
+                     const char *lib_path, const char *defaults);
+
+#endif //VOIDNSRUN_ELFINFO_H
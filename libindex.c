@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "mountapi.h"
+#include "trace.h"
+#include "elfinfo.h"
+#include "libindex.h"
+
+/*
+ * Library index (--check).
+ *
+ * Every shared library in LD_CACHE_DIRS of the container is indexed by its
+ * file name, with its soname, class, machine, mtime and DT_NEEDED entries, so
+ * the dependencies of a program can be resolved without opening any of the
+ * libraries. The container is the user's choice, so its libraries are read
+ * with the user's credentials, and the index is cached in LIBINDEX_DIR, one
+ * file per user and container, and used right from the mmap()'ed file. When
+ * some of the directories have changed since (their mtime, or what they are),
+ * only those are scanned again, the rest is copied from the old index.
+ */
+
+struct builder {
+    struct vec dirs;
+    struct vec libs;
+    struct vec lists;
+    struct vec strings;
+};
+
+static uint32_t add_string(struct builder *b, const char *s)
+{
+    uint32_t off = b->strings.len;
+    do {
+        vec_push(&b->strings, s);
+    } while (*s++ != '\0');
+    return off;
+}
+
+static void dir_stat(int fd, struct libindex_dir *d)
+{
+    struct stat st;
+
+    memset(d, 0, sizeof(*d));
+    if (fd != -1 && fstat(fd, &st) == 0) {
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        d->mtime_sec = st.st_mtim.tv_sec;
+        d->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+static bool dir_same(const struct libindex_dir *a, const struct libindex_dir *b)
+{
+    return a->dev == b->dev && a->ino == b->ino
+        && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static void add_lib(struct builder *b, uint32_t dir, const char *name,
+                    const struct elf_info *info, const struct stat *st)
+{
+    struct libindex_lib lib = {0};
+
+    lib.name = add_string(b, name);
+    lib.soname = info->soname ? add_string(b, info->soname) : LIBINDEX_NONE;
+    lib.rpath = info->rpath ? add_string(b, info->rpath) : LIBINDEX_NONE;
+    lib.runpath = info->runpath ? add_string(b, info->runpath) : LIBINDEX_NONE;
+    lib.dir = dir;
+    lib.machine = info->machine;
+    lib.class = info->class;
+    lib.mtime_sec = st->st_mtim.tv_sec;
+    lib.mtime_nsec = st->st_mtim.tv_nsec;
+    lib.needed = b->lists.len;
+    lib.nneeded = info->needed.end;
+    for (size_t i = 0; i < info->needed.end; i++) {
+        uint32_t s = add_string(b, info->needed.list[i]);
+        vec_push(&b->lists, &s);
+    }
+    vec_push(&b->libs, &lib);
+}
+
+/* Indexes the shared libraries of a directory. Symlinks are followed within
+ * the container, so every name a library is known by gets an entry. */
+static void scan_dir(struct builder *b, int root_fd, const char *path,
+                     int fd, uint32_t dir)
+{
+    char file[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+    int dup_fd, lib_fd;
+
+    dup_fd = dup(fd);
+    d = dup_fd != -1 ? fdopendir(dup_fd) : NULL;
+    if (d == NULL) {
+        ERROR("error: failed to read %s: %s.\n", path, strerror(errno));
+        if (dup_fd != -1)
+            close(dup_fd);
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        struct arena arena = {0};
+        struct elf_info info;
+        struct stat st;
+
+        if (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+            continue;
+        if (strstr(de->d_name, ".so") == NULL)
+            continue;
+
+        snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+        lib_fd = open_in_root(root_fd, file, O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+        if (lib_fd == -1)
+            continue;
+
+        if (fstat(lib_fd, &st) == 0 && S_ISREG(st.st_mode)
+                && elf_read(lib_fd, &info, &arena) && info.type == ET_DYN)
+            add_lib(b, dir, de->d_name, &info, &st);
+
+        close(lib_fd);
+        arena_free(&arena);
+    }
+    closedir(d);
+}
+
+/* Copies the libraries of an unchanged directory from the old index. */
+static void copy_dir(struct builder *b, const struct libindex *old,
+                     const struct libindex_dir *old_dir, uint32_t dir)
+{
+    const struct libindex_header *hdr = (const struct libindex_header *)old->base;
+    const struct libindex_lib *libs = (const struct libindex_lib *)(old->base + hdr->libs);
+    const uint32_t *lists = (const uint32_t *)(old->base + hdr->lists);
+    const char *strings = old->base + hdr->strings;
+
+    for (uint32_t i = old_dir->first; i < old_dir->first + old_dir->nlibs; i++) {
+        struct libindex_lib lib = libs[i];
+
+        lib.name = add_string(b, strings + libs[i].name);
+        if (lib.soname != LIBINDEX_NONE)
+            lib.soname = add_string(b, strings + libs[i].soname);
+        if (lib.rpath != LIBINDEX_NONE)
+            lib.rpath = add_string(b, strings + libs[i].rpath);
+        if (lib.runpath != LIBINDEX_NONE)
+            lib.runpath = add_string(b, strings + libs[i].runpath);
+        lib.dir = dir;
+        lib.needed = b->lists.len;
+        for (uint32_t j = 0; j < lib.nneeded; j++) {
+            uint32_t s = add_string(b, strings + lists[libs[i].needed + j]);
+            vec_push(&b->lists, &s);
+        }
+        vec_push(&b->libs, &lib);
+    }
+}
+
+/* Lays the builder's contents out in a single buffer, for the container at
+ * root. Returns NULL if it's too large for 32-bit offsets, or if there's no
+ * memory for it. */
+static char *build_index(struct builder *b, uint64_t key, const char *root,
+                         size_t *size)
+{
+    struct libindex_header hdr = {0};
+    struct libindex_slot *slots;
+    uint64_t off = sizeof(hdr);
+    char *buf;
+
+    /* Keep the hash table at most half full. */
+    hdr.nslots = 8;
+    while (hdr.nslots < b->libs.len * 2)
+        hdr.nslots *= 2;
+
+    memcpy(hdr.magic, LIBINDEX_MAGIC, sizeof(LIBINDEX_MAGIC));
+    hdr.version = LIBINDEX_VERSION;
+    hdr.key = key;
+
+    hdr.dirs = off;
+    hdr.ndirs = b->dirs.len;
+    off += b->dirs.len * sizeof(struct libindex_dir);
+    hdr.libs = off;
+    hdr.nlibs = b->libs.len;
+    off += b->libs.len * sizeof(struct libindex_lib);
+    hdr.slots = off;
+    off += (uint64_t)hdr.nslots * sizeof(struct libindex_slot);
+    hdr.lists = off;
+    hdr.nlists = b->lists.len;
+    off += b->lists.len * sizeof(uint32_t);
+    hdr.strings = off;
+    hdr.strings_size = b->strings.len;
+    off += b->strings.len;
+    if (off > UINT32_MAX) {
+        ERROR("error: the library index of %s is too large.\n", root);
+        return NULL;
+    }
+    hdr.size = off;
+
+    buf = calloc(1, off);
+    if (buf == NULL) {
+        ERROR("error: out of memory.\n");
+        return NULL;
+    }
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + hdr.dirs, b->dirs.data, b->dirs.len * sizeof(struct libindex_dir));
+    memcpy(buf + hdr.libs, b->libs.data, b->libs.len * sizeof(struct libindex_lib));
+    memcpy(buf + hdr.lists, b->lists.data, b->lists.len * sizeof(uint32_t));
+    memcpy(buf + hdr.strings, b->strings.data, b->strings.len);
+
+    slots = (struct libindex_slot *)(buf + hdr.slots);
+    for (size_t i = 0; i < hdr.nslots; i++)
+        slots[i].lib = LIBINDEX_NONE;
+
+    for (size_t i = 0; i < b->libs.len; i++) {
+        struct libindex_lib *lib = &VEC_AT(&b->libs, struct libindex_lib, i);
+        uint64_t hash = fnv1a_str(FNV1A_INIT, b->strings.data + lib->name);
+        size_t j = hash & (hdr.nslots - 1);
+
+        while (slots[j].lib != LIBINDEX_NONE)
+            j = (j + 1) & (hdr.nslots - 1);
+        slots[j].hash = hash;
+        slots[j].name = lib->name;
+        slots[j].lib = i;
+    }
+
+    *size = off;
+    return buf;
+}
+
+static void cache_path(char *buf, size_t size, uint64_t key)
+{
+    snprintf(buf, size, "%s/%016llx", LIBINDEX_DIR, (unsigned long long)key);
+}
+
+/* Writes the index atomically, and removes the oldest ones. Failures are not
+ * fatal. */
+static void write_cache(uint64_t key, const char *buf, size_t size)
+{
+    char path[128], tmp[PATH_MAX];
+    int fd;
+
+    if ((mkdir(CACHE_DIR, 0700) == -1 && errno != EEXIST)
+            || (mkdir(LIBINDEX_DIR, 0700) == -1 && errno != EEXIST)) {
+        DEBUG("%s: mkdir(%s): %s\n", __func__, LIBINDEX_DIR, strerror(errno));
+        return;
+    }
+
+    cache_path(path, sizeof(path), key);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        DEBUG("%s: open(%s): %s\n", __func__, tmp, strerror(errno));
+        return;
+    }
+
+    if (write(fd, buf, size) != (ssize_t)size || rename(tmp, path) == -1) {
+        DEBUG("%s: failed to write %s: %s\n", __func__, path, strerror(errno));
+        unlink(tmp);
+    }
+    close(fd);
+    cache_trim(LIBINDEX_DIR, LIBINDEX_CACHE_MAX);
+}
+
+/* Bounds of a table within the index. */
+static bool table_ok(size_t size, uint32_t off, uint32_t n, size_t elem)
+{
+    return off <= size && n <= (size - off) / elem;
+}
+
+/* Checks that the cached index is intact, so that lookups can trust its
+ * offsets. Whether it's up to date is up to the caller. */
+static bool cache_valid(const char *buf, size_t size, uint64_t key)
+{
+    const struct libindex_header *hdr = (const struct libindex_header *)buf;
+    const struct libindex_dir *dirs;
+    const struct libindex_lib *libs;
+    const struct libindex_slot *slots;
+    const uint32_t *lists;
+
+    if (size < sizeof(*hdr)
+            || memcmp(hdr->magic, LIBINDEX_MAGIC, sizeof(LIBINDEX_MAGIC)) != 0
+            || hdr->version != LIBINDEX_VERSION
+            || hdr->size != size
+            || hdr->key != key
+            || !table_ok(size, hdr->dirs, hdr->ndirs, sizeof(struct libindex_dir))
+            || !table_ok(size, hdr->libs, hdr->nlibs, sizeof(struct libindex_lib))
+            || !table_ok(size, hdr->slots, hdr->nslots, sizeof(struct libindex_slot))
+            || !table_ok(size, hdr->lists, hdr->nlists, sizeof(uint32_t))
+            || !table_ok(size, hdr->strings, hdr->strings_size, 1)
+            || hdr->strings_size == 0
+            || buf[hdr->strings + hdr->strings_size - 1] != '\0'
+            || hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0)
+        return false;
+
+    dirs = (const struct libindex_dir *)(buf + hdr->dirs);
+    for (uint32_t i = 0; i < hdr->ndirs; i++) {
+        if (dirs[i].path >= hdr->strings_size
+                || dirs[i].first > hdr->nlibs
+                || dirs[i].nlibs > hdr->nlibs - dirs[i].first)
+            return false;
+    }
+
+    libs = (const struct libindex_lib *)(buf + hdr->libs);
+    lists = (const uint32_t *)(buf + hdr->lists);
+    for (uint32_t i = 0; i < hdr->nlibs; i++) {
+        if (libs[i].name >= hdr->strings_size
+                || (libs[i].soname != LIBINDEX_NONE && libs[i].soname >= hdr->strings_size)
+                || (libs[i].rpath != LIBINDEX_NONE && libs[i].rpath >= hdr->strings_size)
+                || (libs[i].runpath != LIBINDEX_NONE && libs[i].runpath >= hdr->strings_size)
+                || libs[i].dir >= hdr->ndirs
+                || libs[i].needed > hdr->nlists
+                || libs[i].nneeded > hdr->nlists - libs[i].needed)
+            return false;
+    }
+    for (uint32_t i = 0; i < hdr->nlists; i++) {
+        if (lists[i] >= hdr->strings_size)
+            return false;
+    }
+
+    slots = (const struct libindex_slot *)(buf + hdr->slots);
+    for (uint32_t i = 0; i < hdr->nslots; i++) {
+        if (slots[i].lib != LIBINDEX_NONE
+                && (slots[i].lib >= hdr->nlibs || slots[i].name >= hdr->strings_size))
+            return false;
+    }
+    return true;
+}
+
+/* Maps the cached index, if it's there and intact. */
+static bool load_cache(uint64_t key, struct libindex *index)
+{
+    char path[128];
+    struct stat st;
+    void *buf;
+    int fd;
+
+    cache_path(path, sizeof(path), key);
+    fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) == -1 || st.st_uid != 0 || (st.st_mode & 022) != 0
+            || (size_t)st.st_size < sizeof(struct libindex_header)) {
+        close(fd);
+        return false;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return false;
+
+    if (!cache_valid(buf, st.st_size, key)) {
+        munmap(buf, st.st_size);
+        return false;
+    }
+
+    index->base = buf;
+    index->size = st.st_size;
+    index->mapped = true;
+    return true;
+}
+
+static void free_index(struct libindex *index)
+{
+    if (index->base == NULL)
+        return;
+    if (index->mapped)
+        munmap((void *)index->base, index->size);
+    else
+        free((void *)index->base);
+    index->base = NULL;
+}
+
+/* Loads the index of the libraries of the container at root, and brings it up
+ * to date, if needed. Called as root, the cache is the only thing that's
+ * accessed as root. */
+bool libindex_load(const char *root, struct libindex *index)
+{
+    static const char *paths[] = LD_CACHE_DIRS;
+    struct builder b = {
+        VEC(struct libindex_dir), VEC(struct libindex_lib), VEC(uint32_t), VEC(char)
+    };
+    struct libindex_dir stats[ARRAY_SIZE(paths)];
+    int fds[ARRAY_SIZE(paths)];
+    struct libindex old = {0};
+    const struct libindex_header *hdr = NULL;
+    const struct libindex_dir *old_dirs = NULL;
+    char real[PATH_MAX] = "";
+    uint64_t key = FNV1A_INIT, t = trace_now();
+    size_t size, scanned = 0;
+    uid_t uid = getuid();
+    int root_fd = -1;
+    bool cached, ok = false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(paths); i++)
+        fds[i] = -1;
+
+    if (!fs_as_user(true)) {
+        ERROR("error: failed to switch to your credentials: %s.\n", strerror(errno));
+        goto end;
+    }
+
+    if (realpath(root, real) == NULL) {
+        ERROR("error: failed to resolve %s: %s.\n", root, strerror(errno));
+        goto end;
+    }
+    key = fnv1a(key, &uid, sizeof(uid));
+    key = fnv1a_str(key, real);
+
+    root_fd = open(real, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (root_fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", real, strerror(errno));
+        goto end;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
+        fds[i] = open_in_root(root_fd, paths[i], O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        dir_stat(fds[i], &stats[i]);
+    }
+
+    fs_as_user(false);
+    cached = load_cache(key, &old);
+    fs_as_user(true);
+    if (cached) {
+        hdr = (const struct libindex_header *)old.base;
+        old_dirs = (const struct libindex_dir *)(old.base + hdr->dirs);
+        if (hdr->ndirs != ARRAY_SIZE(paths))
+            old_dirs = NULL;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
+        struct libindex_dir d = stats[i];
+        bool dup = false;
+
+        /* Like /usr/lib64, which is a symlink to lib. */
+        for (size_t j = 0; j < i && d.ino != 0; j++)
+            dup = dup || (stats[j].dev == d.dev && stats[j].ino == d.ino);
+
+        d.path = add_string(&b, paths[i]);
+        d.first = b.libs.len;
+        if (fds[i] != -1 && !dup) {
+            if (old_dirs != NULL && dir_same(&old_dirs[i], &stats[i])
+                    && strcmp(old.base + hdr->strings + old_dirs[i].path, paths[i]) == 0) {
+                copy_dir(&b, &old, &old_dirs[i], i);
+            } else {
+                DEBUG("%s: scanning %s%s\n", __func__, real, paths[i]);
+                scan_dir(&b, root_fd, paths[i], fds[i], i);
+                scanned++;
+            }
+        }
+        d.nlibs = b.libs.len - d.first;
+        vec_push(&b.dirs, &d);
+    }
+
+    if (old.base != NULL && scanned == 0) {
+        DEBUG("%s: using the cached index\n", __func__);
+        *index = old;
+        old.base = NULL;
+        ok = true;
+        goto end;
+    }
+
+    index->base = build_index(&b, key, real, &size);
+    if (index->base == NULL)
+        goto end;
+    index->size = size;
+    index->mapped = false;
+    DEBUG("%s: %zu libraries, %zu directories scanned\n", __func__, b.libs.len, scanned);
+    fs_as_user(false);
+    write_cache(key, index->base, size);
+    ok = true;
+
+end:
+    fs_as_user(false);
+    trace_phase("libindex", t, real);
+    free_index(&old);
+    for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    free(b.dirs.data);
+    free(b.libs.data);
+    free(b.lists.data);
+    free(b.strings.data);
+    if (root_fd != -1)
+        close(root_fd);
+    return ok;
+}
+
+/* Finds the library that the loader would pick from the index: the first one
+ * with this name, class and machine in the order of the directories. */
+static const struct libindex_lib *lookup(const struct libindex *index,
+                                         const char *name, unsigned char class,
+                                         uint16_t machine)
+{
+    const struct libindex_header *hdr = (const struct libindex_header *)index->base;
+    const struct libindex_slot *slots = (const struct libindex_slot *)(index->base + hdr->slots);
+    const struct libindex_lib *libs = (const struct libindex_lib *)(index->base + hdr->libs);
+    const char *strings = index->base + hdr->strings;
+    uint64_t hash = fnv1a_str(FNV1A_INIT, name);
+    uint32_t best = LIBINDEX_NONE;
+
+    for (size_t j = hash & (hdr->nslots - 1); slots[j].lib != LIBINDEX_NONE;
+            j = (j + 1) & (hdr->nslots - 1)) {
+        const struct libindex_lib *lib = &libs[slots[j].lib];
+        if (slots[j].hash == hash && strcmp(strings + slots[j].name, name) == 0
+                && lib->class == class && lib->machine == machine
+                && slots[j].lib < best)
+            best = slots[j].lib;
+    }
+    return best != LIBINDEX_NONE ? &libs[best] : NULL;
+}
+
+/* A library to resolve. */
+struct need {
+    const char *name;
+    const char *by;         /* Path of the file that needs it. */
+    const char *dirs;       /* Searched before the index, separated by ':'. */
+    const char *rpath;      /* DT_RPATH of the files that need it. */
+    unsigned char class;
+    uint16_t machine;
+};
+
+struct check {
+    struct arena arena;
+    struct name_set seen;
+    struct vec queue;
+    const char *lib_path;
+    unsigned found;
+    unsigned missing;
+};
+
+static char *check_string(struct check *c, const char *s)
+{
+    return arena_concat(&c->arena, s, "");
+}
+
+/* Queues what a file needs. origin is its directory, inherited is the
+ * DT_RPATH of the files that need it. */
+static void check_add(struct check *c, const char *by, const char *origin,
+                      const char *rpath, const char *runpath,
+                      const char *inherited, unsigned char class,
+                      uint16_t machine, char *const *needed, size_t nneeded)
+{
+    char dirs[PATH_MAX * 4];
+    char chain[PATH_MAX * 2];
+
+    /* The index stands for the default directories. */
+    elf_search_path(dirs, sizeof(dirs), chain, sizeof(chain), rpath, runpath,
+                    origin, inherited, c->lib_path, "");
+
+    for (size_t i = 0; i < nneeded; i++) {
+        struct need n = {needed[i], by, NULL, NULL, class, machine};
+
+        if (name_set_has(&c->seen, needed[i]))
+            continue;
+
+        n.name = check_string(c, needed[i]);
+        n.by = check_string(c, by);
+        n.dirs = check_string(c, dirs);
+        n.rpath = check_string(c, chain);
+        name_set_add(&c->seen, n.name);
+        vec_push(&c->queue, &n);
+    }
+}
+
+/* Looks for a library in the directories of a need, which are not indexed.
+ * Returns true if it's found, and queues what it needs. */
+static bool check_dirs(struct check *c, const struct need *n)
+{
+    const char *dir = n->dirs;
+    char path[PATH_MAX];
+
+    while (*dir != '\0') {
+        size_t len = strcspn(dir, ":");
+        struct arena arena = {0};
+        struct elf_info info;
+        bool found = false;
+        int fd;
+
+        snprintf(path, sizeof(path), "%.*s/%s", (int)len, dir, n->name);
+        fd = len > 0 ? open(path, O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC) : -1;
+        if (fd != -1 && elf_read(fd, &info, &arena)
+                && info.class == n->class && info.machine == n->machine) {
+            char *slash = strrchr(path, '/');
+            *slash = '\0';
+            check_add(c, path, path, info.rpath, info.runpath, n->rpath,
+                      info.class, info.machine, info.needed.list, info.needed.end);
+            found = true;
+        }
+        if (fd != -1)
+            close(fd);
+        arena_free(&arena);
+        if (found)
+            return true;
+
+        dir += len;
+        if (*dir == ':')
+            dir++;
+    }
+    return false;
+}
+
+/* Resolves all the libraries that prog needs, with the index for the default
+ * directories, and prints those that are missing. Returns 0 if there are
+ * none, 1 otherwise. */
+int libindex_check(const struct libindex *index, const char *prog)
+{
+    const struct libindex_header *hdr = (const struct libindex_header *)index->base;
+    const struct libindex_dir *dirs = (const struct libindex_dir *)(index->base + hdr->dirs);
+    const uint32_t *lists = (const uint32_t *)(index->base + hdr->lists);
+    const char *strings = index->base + hdr->strings;
+    struct check c = {{0}, {0}, VEC(struct need), NULL, 0, 0};
+    struct elf_info info;
+    char path[PATH_MAX], origin[PATH_MAX], lib_path[PATH_MAX];
+    const char *env = getenv("LD_LIBRARY_PATH");
+    char *slash;
+    uint64_t t = trace_now();
+    int exit_code = 1;
+    int fd;
+
+    c.lib_path = env ? env : "";
+
+    if (!find_in_path(prog, path, sizeof(path))) {
+        ERROR("error: %s not found.\n", prog);
+        return 127;
+    }
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", path, strerror(errno));
+        return 1;
+    }
+    if (!elf_read(fd, &info, &c.arena)) {
+        ERROR("error: %s is not an ELF program.\n", path);
+        goto end;
+    }
+
+    if (info.interp != NULL) {
+        if (access(info.interp, F_OK) == 0) {
+            c.found++;
+        } else {
+            printf("%s (interpreter of %s)\n", info.interp, path);
+            c.missing++;
+        }
+    }
+
+    snprintf(origin, sizeof(origin), "%s", path);
+    slash = strrchr(origin, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    check_add(&c, path, slash ? origin : ".", info.rpath, info.runpath, "",
+              info.class, info.machine, info.needed.list, info.needed.end);
+
+    /* The queue grows as libraries are found. */
+    for (size_t i = 0; i < c.queue.len; i++) {
+        struct need n = VEC_AT(&c.queue, struct need, i);
+        const struct libindex_lib *lib;
+
+        if (strchr(n.name, '/') != NULL) {
+            if (access(n.name, F_OK) == 0) {
+                c.found++;
+                continue;
+            }
+        } else if (check_dirs(&c, &n)) {
+            c.found++;
+            continue;
+        } else if ((lib = lookup(index, n.name, n.class, n.machine)) != NULL) {
+            const char *dir = strings + dirs[lib->dir].path;
+            char **needed = arena_alloc(&c.arena, sizeof(char *) * (lib->nneeded + 1));
+            for (uint32_t j = 0; j < lib->nneeded; j++)
+                needed[j] = (char *)strings + lists[lib->needed + j];
+            snprintf(lib_path, sizeof(lib_path), "%s/%s", dir, strings + lib->name);
+            check_add(&c, lib_path, dir,
+                      lib->rpath != LIBINDEX_NONE ? strings + lib->rpath : NULL,
+                      lib->runpath != LIBINDEX_NONE ? strings + lib->runpath : NULL,
+                      n.rpath, lib->class, lib->machine, needed, lib->nneeded);
+            c.found++;
+            continue;
+        }
+
+        printf("%s (needed by %s)\n", n.name, n.by);
+        c.missing++;
+    }
+
+    if (c.missing)
+        printf("%s: %u of %u libraries not found.\n", path, c.missing,
+               c.missing + c.found);
+    else
+        printf("%s: all %u libraries found.\n", path, c.found);
+    exit_code = c.missing ? 1 : 0;
+
+end:
+    trace_phase("check", t, path);
+    close(fd);
+    free(c.queue.data);
+    name_set_free(&c.seen);
+    arena_free(&c.arena);
+    return exit_code;
+}
@@ -0,0 +1,81 @@
+#ifndef VOIDNSRUN_LIBINDEX_H
+#define VOIDNSRUN_LIBINDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * The index of the shared libraries in the library directories of a
+ * container. Like the profile plan, it's a single flat buffer, which is the
+ * very same thing as the cache file. All offsets are relative to the
+ * beginning of the buffer, strings are referenced by offsets into the string
+ * table.
+ */
+
+#define LIBINDEX_MAGIC "VNSLIBS"
+#define LIBINDEX_VERSION 2
+#define LIBINDEX_NONE UINT32_MAX
+
+struct libindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint64_t key;
+
+    uint32_t dirs, ndirs;
+    uint32_t libs, nlibs;
+    uint32_t slots, nslots;
+    uint32_t lists, nlists;
+    uint32_t strings, strings_size;
+};
+
+/* A library directory, as it was when it was scanned. A directory that
+ * doesn't exist has zero dev and ino. Its libraries are nlibs entries of the
+ * libs table, starting at first. */
+struct libindex_dir {
+    uint32_t path;
+    uint32_t first, nlibs;
+    uint32_t pad;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+/* A shared library, under its file name in the directory, which is what
+ * DT_NEEDED entries refer to. needed is the index of the first entry in the
+ * lists table, which holds string offsets. */
+struct libindex_lib {
+    uint32_t name;
+    uint32_t soname;        /* LIBINDEX_NONE if there's none. */
+    uint32_t rpath;         /* LIBINDEX_NONE if there's none, as in elf_info. */
+    uint32_t runpath;       /* LIBINDEX_NONE if there's none. */
+    uint32_t dir;
+    uint32_t needed, nneeded;
+    uint16_t machine;
+    uint8_t class;
+    uint8_t pad;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+/* A hash table of file names, with linear probing. Every library has its own
+ * slot, even if there are others with the same name. nslots is a power of
+ * two. */
+struct libindex_slot {
+    uint64_t hash;
+    uint32_t name;
+    uint32_t lib;
+};
+
+struct libindex {
+    const char *base;
+    size_t size;
+    bool mapped;
+};
+
+bool libindex_load(const char *root, struct libindex *index);
+int libindex_check(const struct libindex *index, const char *prog);
+
+#endif //VOIDNSRUN_LIBINDEX_H
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "trace.h"
+#include "elfinfo.h"
+#include "libprefetch.h"
+
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+/*
+ * Library prefetch (--prefetch-libs).
+ *
+ * On a cold start, a big program spends most of its time waiting for the
+ * pages of its libraries, which the loader faults in one after another.
+ * Instead, right before the exec, a background process follows the program's
+ * ELF dependencies (PT_INTERP and DT_NEEDED, recursively) the way the loader
+ * would find them, and asks the kernel to read each file ahead with
+ * posix_fadvise(POSIX_FADV_WILLNEED). The exec doesn't wait for it, so the
+ * loader finds the pages in the page cache or already on their way.
+ *
+ * Looking the libraries up and reading their headers still blocks on the
+ * disk, so a few threads share the work. Libraries are searched in the
+ * loader's order (see elf_search_path()), with LD_CACHE_DIRS for the default
+ * directories and without the ld.so cache, which only makes the lookup faster
+ * and doesn't change its result for them. Files of another class or machine
+ * are skipped, like the loader does.
+ */
+
+struct lib {
+    char *name;             /* As in DT_NEEDED, or a path. */
+    char *dirs;             /* Where to look for it, separated by ':'. */
+    char *rpath;            /* DT_RPATH of the objects that need it. */
+    unsigned char class;    /* 0 if any will do. */
+    uint16_t machine;
+};
+
+struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct arena arena;
+    struct name_set seen;   /* Names and paths queued so far. */
+    struct lib *queue;
+    size_t head, end, size;
+    int busy;               /* Threads working on a library. */
+    const char *lib_path;   /* LD_LIBRARY_PATH, or "". */
+    char *defaults;         /* LD_CACHE_DIRS, separated by ':'. */
+    unsigned files;
+};
+
+/* Queues a library, unless it's been queued already. Called with the lock
+ * held. */
+static void walk_add(struct walk *w, const char *name, const char *dirs,
+                     const char *rpath, unsigned char class, uint16_t machine)
+{
+    struct lib *lib;
+
+    if (name_set_has(&w->seen, name))
+        return;
+
+    if (w->end == w->size) {
+        size_t size = w->size ? w->size * 2 : 64;
+        struct lib *queue = realloc(w->queue, size * sizeof(struct lib));
+        if (queue == NULL)
+            return;
+        w->queue = queue;
+        w->size = size;
+    }
+
+    lib = &w->queue[w->end++];
+    lib->name = arena_concat(&w->arena, name, "");
+    lib->dirs = arena_concat(&w->arena, dirs, "");
+    lib->rpath = arena_concat(&w->arena, rpath, "");
+    lib->class = class;
+    lib->machine = machine;
+    name_set_add(&w->seen, lib->name);
+    pthread_cond_signal(&w->cond);
+}
+
+/* Opens the library, searching its directories if needed, and checks that
+ * it's ELF of the right kind. Its path is put to path. */
+static int lib_open(const struct lib *lib, struct elf_info *info,
+                    struct arena *arena, char *path, size_t size)
+{
+    const char *dir = lib->dirs;
+    int fd;
+
+    if (strchr(lib->name, '/') != NULL) {
+        snprintf(path, size, "%s", lib->name);
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd != -1 && !elf_read(fd, info, arena))
+            DEBUG("%s: %s is not ELF\n", __func__, path);
+        return fd;
+    }
+
+    while (*dir != '\0') {
+        size_t len = strcspn(dir, ":");
+        if (len > 0) {
+            snprintf(path, size, "%.*s/%s", (int)len, dir, lib->name);
+            fd = open(path, O_RDONLY|O_CLOEXEC);
+            if (fd != -1) {
+                if (elf_read(fd, info, arena) && info->class == lib->class
+                        && info->machine == lib->machine)
+                    return fd;
+                close(fd);
+            }
+        }
+        dir += len;
+        if (*dir == ':')
+            dir++;
+    }
+    return -1;
+}
+
+/* Prefetches one library and queues what it needs. */
+static void walk_lib(struct walk *w, const struct lib *lib)
+{
+    struct arena arena = {0};
+    struct elf_info info;
+    char path[PATH_MAX];
+    char dirs[PATH_MAX * 4];
+    char rpath[PATH_MAX * 2];
+    char *slash;
+    int fd;
+
+    fd = lib_open(lib, &info, &arena, path, sizeof(path));
+    if (fd == -1) {
+        DEBUG("%s: %s not found\n", __func__, lib->name);
+        goto end;
+    }
+
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) != 0)
+        DEBUG("%s: posix_fadvise(%s) failed\n", __func__, path);
+    close(fd);
+
+    /* Scripts and such are prefetched, but not followed. */
+    if (info.class == 0)
+        goto end;
+
+    slash = strrchr(path, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    elf_search_path(dirs, sizeof(dirs), rpath, sizeof(rpath), info.rpath,
+                    info.runpath, slash ? path : ".", lib->rpath, w->lib_path,
+                    w->defaults);
+
+    pthread_mutex_lock(&w->lock);
+    w->files++;
+    if (info.interp != NULL)
+        walk_add(w, info.interp, "", "", 0, 0);
+    for (size_t i = 0; i < info.needed.end; i++)
+        walk_add(w, info.needed.list[i], dirs, rpath, info.class, info.machine);
+    pthread_mutex_unlock(&w->lock);
+
+end:
+    arena_free(&arena);
+}
+
+static void *walk_thread(void *arg)
+{
+    struct walk *w = arg;
+    struct lib lib;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->head == w->end && w->busy > 0)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->head == w->end)
+            break;
+
+        lib = w->queue[w->head++];
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        walk_lib(w, &lib);
+
+        pthread_mutex_lock(&w->lock);
+        w->busy--;
+        if (w->busy == 0 && w->head == w->end)
+            pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void walk_run(const char *path)
+{
+    static const char *defaults[] = LD_CACHE_DIRS;
+    struct walk w = {0};
+    pthread_t threads[LIBPREFETCH_THREADS];
+    int nthreads = 0;
+    uint64_t t = trace_now();
+    const char *lib_path = getenv("LD_LIBRARY_PATH");
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.lib_path = lib_path ? lib_path : "";
+    w.defaults = "";
+    for (size_t i = 0; i < ARRAY_SIZE(defaults); i++)
+        w.defaults = arena_concat(&w.arena,
+                                  arena_concat(&w.arena, w.defaults, i ? ":" : ""),
+                                  defaults[i]);
+
+    walk_add(&w, path, "", "", 0, 0);
+
+    for (int i = 0; i < LIBPREFETCH_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, walk_thread, &w) != 0)
+            break;
+        nthreads++;
+    }
+    if (nthreads == 0)
+        walk_thread(&w);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    DEBUG("%s: %u files prefetched for %s\n", __func__, w.files, path);
+    trace_phase("prefetch_libs", t, path);
+
+    free(w.queue);
+    name_set_free(&w.seen);
+    arena_free(&w.arena);
+}
+
+/* Starts prefetching the libraries of prog in the background and returns
+ * right away. The prefetching process is detached, so that the program
+ * doesn't get it as a child after the exec. */
+void libprefetch_start(const char *prog)
+{
+    char path[PATH_MAX];
+    pid_t pid;
+    int fd;
+
+    if (!find_in_path(prog, path, sizeof(path))) {
+        DEBUG("%s: %s not found in PATH\n", __func__, prog);
+        return;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        ERROR("fork: %s\n", strerror(errno));
+        return;
+    }
+
+    if (pid == 0) {
+        if (fork() != 0)
+            _exit(0);
+
+        /* This process outlives the exec, so it must not hold the
+         * namespace fds and the socket, or anything else but the trace. */
+        fd = trace_fileno();
+        if (fd > 3)
+            syscall(__NR_close_range, 3, fd - 1, 0);
+        syscall(__NR_close_range, fd >= 3 ? fd + 1 : 3, ~0U, 0);
+
+        /* Don't keep the program's pipes open. */
+        fd = open("/dev/null", O_RDWR|O_CLOEXEC);
+        if (fd != -1) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            if (!g_verbose && !trace_enabled())
+                dup2(fd, STDERR_FILENO);
+            if (fd > STDERR_FILENO)
+                close(fd);
+        }
+
+        walk_run(path);
+        _exit(0);
+    }
+
+    waitpid(pid, NULL, 0);
+}
@@ -0,0 +1,6 @@
+#ifndef VOIDNSRUN_LIBPREFETCH_H
+#define VOIDNSRUN_LIBPREFETCH_H
+
+void libprefetch_start(const char *prog);
+
+#endif //VOIDNSRUN_LIBPREFETCH_H
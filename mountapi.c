@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "mountapi.h"
+
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#ifndef __NR_openat2
+#define __NR_openat2 437
+#endif
+
+int sys_openat2(int dfd, const char *path, struct open_how *how, size_t size)
+{
+    return syscall(__NR_openat2, dfd, path, how, size);
+}
+
+int sys_open_tree(int dfd, const char *path, unsigned int flags)
+{
+    return syscall(__NR_open_tree, dfd, path, flags);
+}
+
+int sys_move_mount(int from_dfd, const char *from_path,
+                   int to_dfd, const char *to_path, unsigned int flags)
+{
+    return syscall(__NR_move_mount, from_dfd, from_path, to_dfd, to_path, flags);
+}
+
+int sys_mount_setattr(int dfd, const char *path, unsigned int flags,
+                      struct mount_attr *attr, size_t size)
+{
+    return syscall(__NR_mount_setattr, dfd, path, flags, attr, size);
+}
+
+/* Makes a detached recursive copy of the mount tree at path, the same thing
+ * that mount(MS_BIND|MS_REC) would attach. The copy is made private, so that
+ * mounts made on it later don't propagate anywhere.
+ *
+ * Returns -1 with errno set to ENOSYS if the kernel doesn't support it. */
+int clone_tree(int dfd, const char *path)
+{
+    struct mount_attr attr = {0};
+    unsigned int flags = OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC|AT_RECURSIVE;
+    int fd;
+
+    if (path[0] == '\0')
+        flags |= AT_EMPTY_PATH;
+
+    fd = sys_open_tree(dfd, path, flags);
+    if (fd == -1)
+        return -1;
+
+    /* Not being able to change propagation is not a reason to fail, the
+     * mount() path doesn't do it either. mount_setattr() only appeared in
+     * Linux 5.12. */
+    attr.propagation = MS_PRIVATE;
+    sys_mount_setattr(fd, "", AT_EMPTY_PATH|AT_RECURSIVE, &attr, sizeof(attr));
+
+    return fd;
+}
+
+int attach_tree(int tree_fd, int to_dfd, const char *to_path)
+{
+    unsigned int flags = MOVE_MOUNT_F_EMPTY_PATH;
+    if (to_path[0] == '\0')
+        flags |= MOVE_MOUNT_T_EMPTY_PATH;
+    return sys_move_mount(tree_fd, "", to_dfd, to_path, flags);
+}
+
+/* Opens path with O_PATH, so that it can be checked with fstat() or statx()
+ * and then mounted by fd, without resolving it again. resolve is a set of
+ * RESOLVE_* flags for openat2() (Linux 5.6+). On older kernels, it falls back
+ * to openat(), which can't enforce them. */
+int open_path(int dfd, const char *path, uint64_t resolve)
+{
+    static bool no_openat2 = false;
+    struct open_how how = {0};
+    int fd;
+
+    if (!no_openat2) {
+        how.flags = O_PATH|O_CLOEXEC;
+        how.resolve = resolve;
+        fd = sys_openat2(dfd, path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS)
+            return fd;
+        no_openat2 = true;
+    }
+
+    return openat(dfd, path, O_PATH|O_CLOEXEC);
+}
+
+/* Opens a path of the container as the namespace would see it, with absolute
+ * symlinks resolved within the container. path is absolute. */
+int open_in_root(int root_fd, const char *path, int flags)
+{
+    struct open_how how = {0};
+    int fd;
+
+    how.flags = flags;
+    how.resolve = RESOLVE_IN_ROOT|RESOLVE_NO_MAGICLINKS;
+    fd = sys_openat2(root_fd, path, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS)
+        fd = openat(root_fd, path + 1, flags);
+    return fd;
+}
+
+/* Bind mounts what src_fd points to onto what target_fd points to. mount()
+ * follows the /proc/self/fd magic links, so neither path is resolved again. */
+int bind_fd(int src_fd, int target_fd, bool recursive)
+{
+    char src[32], target[32];
+    unsigned long flags = MS_BIND;
+
+    if (recursive)
+        flags |= MS_REC;
+
+    snprintf(src, sizeof(src), "/proc/self/fd/%d", src_fd);
+    snprintf(target, sizeof(target), "/proc/self/fd/%d", target_fd);
+    return mount(src, target, NULL, flags, NULL);
+}
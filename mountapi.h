@@ -0,0 +1,66 @@
+#ifndef VOIDNSRUN_MOUNTAPI_H
+#define VOIDNSRUN_MOUNTAPI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+
+/* Wrappers and constants for the new mount API (Linux 5.2+, mount_setattr()
+ * since 5.12). Not every libc has them, so they are defined here. */
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOVE_MOUNT_T_EMPTY_PATH
+#define MOVE_MOUNT_T_EMPTY_PATH 0x00000040
+#endif
+
+#ifndef MOUNT_ATTR_SIZE_VER0
+struct mount_attr {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+};
+#define MOUNT_ATTR_SIZE_VER0 32
+#endif
+
+#ifndef RESOLVE_BENEATH
+struct open_how {
+    uint64_t flags;
+    uint64_t mode;
+    uint64_t resolve;
+};
+#define RESOLVE_NO_XDEV       0x01
+#define RESOLVE_NO_MAGICLINKS 0x02
+#define RESOLVE_NO_SYMLINKS   0x04
+#define RESOLVE_BENEATH       0x08
+#define RESOLVE_IN_ROOT       0x10
+#endif
+
+int sys_openat2(int dfd, const char *path, struct open_how *how, size_t size);
+int sys_open_tree(int dfd, const char *path, unsigned int flags);
+int sys_move_mount(int from_dfd, const char *from_path,
+                   int to_dfd, const char *to_path, unsigned int flags);
+int sys_mount_setattr(int dfd, const char *path, unsigned int flags,
+                      struct mount_attr *attr, size_t size);
+
+int clone_tree(int dfd, const char *path);
+int attach_tree(int tree_fd, int to_dfd, const char *to_path);
+
+int open_path(int dfd, const char *path, uint64_t resolve);
+int open_in_root(int root_fd, const char *path, int flags);
+int bind_fd(int src_fd, int target_fd, bool recursive);
+
+#endif //VOIDNSRUN_MOUNTAPI_H
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "macros.h"
+#include "spawn.h"
+#include "origin.h"
+
+/*
+ * Serverless mode.
+ *
+ * Instead of a server child holding the original namespace's fd, voidnsrun
+ * records a process that lives in the original namespace anyway (init, or
+ * whoever launched voidnsrun) in a file next to where the socket would be:
+ *
+ *     <pid> <starttime> <namespace dev> <namespace inode>
+ *
+ * voidnsundo then enters the namespace of that process with setns() on its
+ * pidfd. The file is in a root-only directory of a tmpfs that only exists in
+ * this namespace, so just like the socket, it can only be used by the setuid
+ * voidnsundo. The start time protects against pid reuse and the namespace is
+ * checked once more after setns(), in case the process has moved to another
+ * one.
+ */
+
+static bool ns_id(int fd, const char *path, dev_t *dev, ino_t *ino)
+{
+    struct stat st;
+    if (fstatat(fd, path, &st, AT_EMPTY_PATH) == -1)
+        return false;
+    *dev = st.st_dev;
+    *ino = st.st_ino;
+    return true;
+}
+
+/* Finds a process in the namespace of nsfd and records it at path. */
+bool origin_record(const char *path, int nsfd)
+{
+    pid_t candidates[] = {1, getppid()};
+    unsigned long long starttime;
+    char ns_path[32], buf[128];
+    dev_t dev, pdev;
+    ino_t ino, pino;
+    int fd, len;
+    bool ok;
+
+    if (!ns_id(nsfd, "", &dev, &ino))
+        return false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(candidates); i++) {
+        pid_t pid = candidates[i];
+
+        snprintf(ns_path, sizeof(ns_path), "/proc/%d/ns/mnt", (int)pid);
+        if (!ns_id(AT_FDCWD, ns_path, &pdev, &pino) || pdev != dev || pino != ino
+                || !proc_starttime(pid, &starttime))
+            continue;
+
+        DEBUG("%s: origin is %d\n", __func__, (int)pid);
+        fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+        if (fd == -1) {
+            ERROR("error: failed to create %s: %s.\n", path, strerror(errno));
+            return false;
+        }
+        len = snprintf(buf, sizeof(buf), "%d %llu %llu %llu\n", (int)pid,
+                       starttime, (unsigned long long)dev, (unsigned long long)ino);
+        ok = write(fd, buf, len) == len;
+        close(fd);
+        return ok;
+    }
+
+    ERROR("error: no process to return to the original namespace through.\n");
+    return false;
+}
+
+/* Enters the namespace recorded at path. Returns 0 on success, or -1 (with
+ * errno set to ENOENT if there's no such file, i.e. there's a server). */
+int origin_enter(const char *path)
+{
+    unsigned long long starttime, now_starttime, dev, ino;
+    char buf[128];
+    struct stat st;
+    dev_t ns_dev;
+    ino_t ns_ino;
+    ssize_t len;
+    int fd, pid;
+
+    fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != 0
+            || (st.st_mode & 022) != 0) {
+        close(fd);
+        ERROR("error: %s must be owned by root.\n", path);
+        errno = EPERM;
+        return -1;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        goto invalid;
+    buf[len] = '\0';
+    if (sscanf(buf, "%d %llu %llu %llu", &pid, &starttime, &dev, &ino) != 4)
+        goto invalid;
+
+    /* Once there's a pidfd, the pid can't be reused, so if the start time is
+     * right now, it's the right process. */
+    fd = sys_pidfd_open(pid, 0);
+    if (!proc_starttime(pid, &now_starttime) || now_starttime != starttime) {
+        ERROR("error: process %d that held the original namespace is gone.\n", pid);
+        if (fd != -1)
+            close(fd);
+        errno = ESRCH;
+        return -1;
+    }
+
+    /* setns() takes pidfds since Linux 5.8. */
+    if (fd == -1 || setns(fd, CLONE_NEWNS) == -1) {
+        if (fd != -1 && errno != EINVAL)
+            goto setns_failed;
+        if (fd != -1)
+            close(fd);
+
+        DEBUG("%s: pidfd setns is not supported, using /proc\n", __func__);
+        fd = ns_open_pid(pid, starttime);
+        if (fd == -1 || setns(fd, CLONE_NEWNS) == -1)
+            goto setns_failed;
+    }
+    close(fd);
+
+    if (!ns_id(AT_FDCWD, "/proc/self/ns/mnt", &ns_dev, &ns_ino)
+            || ns_dev != dev || ns_ino != ino) {
+        ERROR("error: process %d is not in the original namespace anymore.\n", pid);
+        errno = ESRCH;
+        return -1;
+    }
+    return 0;
+
+setns_failed:
+    ERROR("setns: %s.\n", strerror(errno));
+    if (fd != -1)
+        close(fd);
+    return -1;
+
+invalid:
+    ERROR("error: %s is invalid.\n", path);
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,9 @@
+#ifndef VOIDNSRUN_ORIGIN_H
+#define VOIDNSRUN_ORIGIN_H
+
+#include <stdbool.h>
+
+bool origin_record(const char *path, int nsfd);
+int origin_enter(const char *path);
+
+#endif //VOIDNSRUN_ORIGIN_H
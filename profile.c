@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "session.h"
+#include "profile.h"
+
+/*
+ * Launch profiles.
+ *
+ * A profile is a file in PROFILE_DIR, named after the profile, with one
+ * directive per line:
+ *
+ *     # Comment.
+ *     match <command>...   Use this profile for these commands (basenames).
+ *     root <path>          Container path, unless -r is given.
+ *     mount <path>         Same as -m.
+ *     require <path>       Like mount, but mounted right after /usr, and
+ *                          a failure is fatal even with ignore-missing or -i.
+ *     undo <path>          Same as -u.
+ *     dir <path>           Same as -d.
+ *     ignore-missing       Same as -i.
+ *
+ * All profiles are validated and compiled into one plan, which is cached in
+ * PLAN_CACHE. The cache is used as long as PROFILE_DIR and the files in it
+ * have the same mtimes, sizes and inodes as they had when it was written.
+ *
+ * There are also built-in profiles. A file with the same name overrides
+ * a built-in profile.
+ */
+
+static const char *builtin_profiles[][2] = {
+    {"xbps",
+     "# Package management needs the container's /var and /etc, too.\n"
+     "match xbps-install xbps-remove xbps-reconfigure xbps-query xbps-pkgdb\n"
+     "require /var\n"
+     "require /etc\n"},
+};
+
+struct builder {
+    struct vec sources;
+    struct vec profiles;
+    struct vec matches;   /* struct plan_slot, before hashing. */
+    struct vec lists;
+    struct vec strings;
+    bool errors;
+};
+
+static uint32_t add_string(struct builder *b, const char *s)
+{
+    uint32_t off = b->strings.len;
+    do {
+        vec_push(&b->strings, s);
+    } while (*s++ != '\0');
+    return off;
+}
+
+static bool has_profile(struct builder *b, const char *name)
+{
+    for (size_t i = 0; i < b->profiles.len; i++) {
+        struct plan_profile *p = &VEC_AT(&b->profiles, struct plan_profile, i);
+        if (!strcmp(b->strings.data + p->name, name))
+            return true;
+    }
+    return false;
+}
+
+/* Path arguments must be absolute and normalized enough not to contain
+ * "..", so that a profile can't point outside of the container. */
+static bool valid_path(const char *s)
+{
+    if (s[0] != '/' || strlen(s) >= PATH_MAX)
+        return false;
+    for (const char *p = s; (p = strstr(p, "/..")) != NULL; p += 3) {
+        if (p[3] == '/' || p[3] == '\0')
+            return false;
+    }
+    return true;
+}
+
+/* Parses the text of a profile and adds it to the plan. */
+static bool compile_profile(struct builder *b, const char *name,
+                            const char *origin, char *text)
+{
+    struct plan_profile profile = {0};
+    struct vec mounts = VEC(uint32_t);
+    struct vec required = VEC(uint32_t);
+    struct vec undos = VEC(uint32_t);
+    struct vec dirs = VEC(uint32_t);
+    struct vec matches = VEC(uint32_t);
+    char *line, *save = NULL;
+    int lineno = 0;
+    bool ok = true;
+
+    profile.name = add_string(b, name);
+    profile.root = PLAN_NONE;
+
+    for (line = strtok_r(text, "\n", &save); line != NULL;
+            line = strtok_r(NULL, "\n", &save)) {
+        char *directive, *arg, *save2 = NULL;
+        lineno++;
+
+        directive = strtok_r(line, " \t", &save2);
+        if (directive == NULL || directive[0] == '#')
+            continue;
+        arg = strtok_r(NULL, " \t", &save2);
+
+        if (!strcmp(directive, "ignore-missing") && arg == NULL) {
+            profile.flags |= PROFILE_IGNORE_MISSING;
+            continue;
+        }
+
+        if (!strcmp(directive, "match") && arg != NULL) {
+            for (; arg != NULL; arg = strtok_r(NULL, " \t", &save2)) {
+                uint32_t off = add_string(b, arg);
+                vec_push(&matches, &off);
+            }
+            continue;
+        }
+
+        struct vec *list = NULL;
+        if (!strcmp(directive, "mount"))
+            list = &mounts;
+        else if (!strcmp(directive, "require"))
+            list = &required;
+        else if (!strcmp(directive, "undo"))
+            list = &undos;
+        else if (!strcmp(directive, "dir"))
+            list = &dirs;
+        else if (strcmp(directive, "root") != 0)
+            goto invalid;
+
+        if (arg == NULL || strtok_r(NULL, " \t", &save2) != NULL)
+            goto invalid;
+        if (!valid_path(arg) || (list == &dirs && !startswith(arg, "/usr/"))) {
+            ERROR("error: %s:%d: invalid path %s.\n", origin, lineno, arg);
+            ok = false;
+            continue;
+        }
+
+        uint32_t off = add_string(b, arg);
+        if (list != NULL)
+            vec_push(list, &off);
+        else
+            profile.root = off;
+        continue;
+
+invalid:
+        ERROR("error: %s:%d: invalid directive %s.\n", origin, lineno, directive);
+        ok = false;
+    }
+
+    if (ok) {
+        struct vec *lists[] = {&mounts, &required, &undos, &dirs};
+        uint32_t *starts[] = {&profile.mounts, &profile.required, &profile.undos,
+                              &profile.dirs};
+        uint32_t *counts[] = {&profile.nmounts, &profile.nrequired, &profile.nundos,
+                              &profile.ndirs};
+
+        for (size_t i = 0; i < ARRAY_SIZE(lists); i++) {
+            *starts[i] = b->lists.len;
+            *counts[i] = lists[i]->len;
+            for (size_t j = 0; j < lists[i]->len; j++)
+                vec_push(&b->lists, &VEC_AT(lists[i], uint32_t, j));
+        }
+
+        for (size_t i = 0; i < matches.len; i++) {
+            struct plan_slot slot = {
+                .name = VEC_AT(&matches, uint32_t, i),
+                .profile = b->profiles.len,
+            };
+            vec_push(&b->matches, &slot);
+        }
+
+        vec_push(&b->profiles, &profile);
+    } else {
+        b->errors = true;
+    }
+
+    free(mounts.data);
+    free(required.data);
+    free(undos.data);
+    free(dirs.data);
+    free(matches.data);
+    return ok;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Compiles the profiles of PROFILE_DIR (if dirfd is not -1). */
+static void compile_dir(struct builder *b, int dirfd)
+{
+    struct vec names = VEC(char *);
+    struct dirent *de;
+    DIR *dir;
+    int fd;
+
+    if ((fd = dup(dirfd)) == -1 || (dir = fdopendir(fd)) == NULL) {
+        ERROR("error: failed to read %s: %s.\n", PROFILE_DIR, strerror(errno));
+        b->errors = true;
+        return;
+    }
+
+    /* Sort them, so that the plan doesn't depend on readdir() order. */
+    while ((de = readdir(dir)) != NULL) {
+        if (session_name_valid(de->d_name)) {
+            char *name = strdup(de->d_name);
+            if (name == NULL) {
+                ERROR("error: out of memory.\n");
+                b->errors = true;
+                continue;
+            }
+            vec_push(&names, &name);
+        }
+    }
+    closedir(dir);
+    qsort(names.data, names.len, sizeof(char *), cmp_names);
+
+    for (size_t i = 0; i < names.len; i++) {
+        char *name = VEC_AT(&names, char *, i);
+        char origin[PATH_MAX];
+        char *text = NULL;
+        struct stat st;
+        struct plan_source src = {0};
+
+        snprintf(origin, sizeof(origin), "%s/%s", PROFILE_DIR, name);
+        fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            DEBUG("%s: skipping %s\n", __func__, origin);
+            goto next;
+        }
+
+        /* Profiles are as powerful as command line options of a setuid
+         * program, so only root may write them. */
+        if (st.st_uid != 0 || (st.st_mode & 022) != 0) {
+            ERROR("error: %s must be owned by root and not writable by others.\n",
+                  origin);
+            b->errors = true;
+            goto next;
+        }
+
+        text = malloc(st.st_size + 1);
+        if (text == NULL || read(fd, text, st.st_size) != st.st_size) {
+            ERROR("error: failed to read %s.\n", origin);
+            b->errors = true;
+            goto next;
+        }
+        text[st.st_size] = '\0';
+
+        src.name = add_string(b, name);
+        src.ino = st.st_ino;
+        src.size = st.st_size;
+        src.mtime_sec = st.st_mtim.tv_sec;
+        src.mtime_nsec = st.st_mtim.tv_nsec;
+        vec_push(&b->sources, &src);
+
+        compile_profile(b, name, origin, text);
+
+next:
+        if (fd != -1)
+            close(fd);
+        free(text);
+        free(name);
+    }
+
+    free(names.data);
+}
+
+static uint64_t builtin_hash(void)
+{
+    uint64_t hash = FNV1A_INIT;
+    for (size_t i = 0; i < ARRAY_SIZE(builtin_profiles); i++) {
+        hash = fnv1a_str(hash, builtin_profiles[i][0]);
+        hash = fnv1a_str(hash, builtin_profiles[i][1]);
+    }
+    return hash;
+}
+
+/* Lays the builder's contents out in a single buffer. */
+static char *build_plan(struct builder *b, const struct stat *dir_st, size_t *size)
+{
+    struct plan_header hdr = {0};
+    struct plan_slot *slots;
+    size_t off = sizeof(hdr);
+    char *buf;
+
+    /* Keep the hash table at most half full. */
+    hdr.nslots = 8;
+    while (hdr.nslots < b->matches.len * 2)
+        hdr.nslots *= 2;
+
+    memcpy(hdr.magic, PLAN_MAGIC, sizeof(PLAN_MAGIC));
+    hdr.version = PLAN_VERSION;
+    hdr.builtin_hash = builtin_hash();
+    if (dir_st != NULL) {
+        hdr.dir_mtime_sec = dir_st->st_mtim.tv_sec;
+        hdr.dir_mtime_nsec = dir_st->st_mtim.tv_nsec;
+    }
+
+    hdr.sources = off;
+    hdr.nsources = b->sources.len;
+    off += b->sources.len * sizeof(struct plan_source);
+    hdr.profiles = off;
+    hdr.nprofiles = b->profiles.len;
+    off += b->profiles.len * sizeof(struct plan_profile);
+    hdr.slots = off;
+    off += hdr.nslots * sizeof(struct plan_slot);
+    hdr.lists = off;
+    hdr.nlists = b->lists.len;
+    off += b->lists.len * sizeof(uint32_t);
+    hdr.strings = off;
+    hdr.strings_size = b->strings.len;
+    off += b->strings.len;
+    hdr.size = off;
+
+    /* The plan is always usable, there's no way to fail. */
+    buf = calloc(1, off);
+    if (buf == NULL)
+        out_of_memory();
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + hdr.sources, b->sources.data, b->sources.len * sizeof(struct plan_source));
+    memcpy(buf + hdr.profiles, b->profiles.data, b->profiles.len * sizeof(struct plan_profile));
+    memcpy(buf + hdr.lists, b->lists.data, b->lists.len * sizeof(uint32_t));
+    memcpy(buf + hdr.strings, b->strings.data, b->strings.len);
+
+    slots = (struct plan_slot *)(buf + hdr.slots);
+    for (size_t i = 0; i < hdr.nslots; i++)
+        slots[i].profile = PLAN_NONE;
+
+    /* The first profile that matches a command wins, and files come before
+     * the built-in profiles. */
+    for (size_t i = 0; i < b->matches.len; i++) {
+        struct plan_slot *m = &VEC_AT(&b->matches, struct plan_slot, i);
+        const char *name = b->strings.data + m->name;
+        uint64_t hash = fnv1a_str(FNV1A_INIT, name);
+        size_t j = hash & (hdr.nslots - 1);
+
+        while (slots[j].profile != PLAN_NONE
+                && strcmp(buf + hdr.strings + slots[j].name, name) != 0)
+            j = (j + 1) & (hdr.nslots - 1);
+        if (slots[j].profile != PLAN_NONE)
+            continue;
+
+        slots[j].hash = hash;
+        slots[j].name = m->name;
+        slots[j].profile = m->profile;
+    }
+
+    *size = off;
+    return buf;
+}
+
+/* Writes the plan to PLAN_CACHE atomically. Failures are not fatal, the plan
+ * will just be compiled again next time. */
+static void write_cache(const char *buf, size_t size)
+{
+    char tmp[PATH_MAX];
+    int fd;
+
+    if (mkdir(CACHE_DIR, 0700) == -1 && errno != EEXIST) {
+        DEBUG("%s: mkdir(%s): %s\n", __func__, CACHE_DIR, strerror(errno));
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", PLAN_CACHE, (int)getpid());
+    fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        DEBUG("%s: open(%s): %s\n", __func__, tmp, strerror(errno));
+        return;
+    }
+
+    if (write(fd, buf, size) != (ssize_t)size || rename(tmp, PLAN_CACHE) == -1) {
+        DEBUG("%s: failed to write %s: %s\n", __func__, PLAN_CACHE, strerror(errno));
+        unlink(tmp);
+    }
+    close(fd);
+}
+
+/* Bounds of a table within the plan. */
+static bool table_ok(size_t size, uint32_t off, uint32_t n, size_t elem)
+{
+    return off <= size && n <= (size - off) / elem;
+}
+
+/* Checks that the cached plan is intact and up to date. */
+static bool cache_valid(const char *buf, size_t size, int dirfd,
+                        const struct stat *dir_st)
+{
+    const struct plan_header *hdr = (const struct plan_header *)buf;
+    const struct plan_source *sources;
+    struct stat st;
+
+    if (size < sizeof(*hdr)
+            || memcmp(hdr->magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) != 0
+            || hdr->version != PLAN_VERSION
+            || hdr->size != size
+            || !table_ok(size, hdr->sources, hdr->nsources, sizeof(struct plan_source))
+            || !table_ok(size, hdr->profiles, hdr->nprofiles, sizeof(struct plan_profile))
+            || !table_ok(size, hdr->slots, hdr->nslots, sizeof(struct plan_slot))
+            || !table_ok(size, hdr->lists, hdr->nlists, sizeof(uint32_t))
+            || !table_ok(size, hdr->strings, hdr->strings_size, 1)
+            || hdr->strings_size == 0
+            || buf[hdr->strings + hdr->strings_size - 1] != '\0'
+            || hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0)
+        return false;
+
+    if (hdr->builtin_hash != builtin_hash()
+            || hdr->dir_mtime_sec != dir_st->st_mtim.tv_sec
+            || hdr->dir_mtime_nsec != dir_st->st_mtim.tv_nsec)
+        return false;
+
+    sources = (const struct plan_source *)(buf + hdr->sources);
+    for (uint32_t i = 0; i < hdr->nsources; i++) {
+        if (sources[i].name >= hdr->strings_size)
+            return false;
+        if (fstatat(dirfd, buf + hdr->strings + sources[i].name, &st, AT_SYMLINK_NOFOLLOW) == -1
+                || (uint64_t)st.st_ino != sources[i].ino
+                || (uint64_t)st.st_size != sources[i].size
+                || st.st_mtim.tv_sec != sources[i].mtime_sec
+                || st.st_mtim.tv_nsec != sources[i].mtime_nsec)
+            return false;
+    }
+
+    return true;
+}
+
+/* Maps the cached plan, if it's there and up to date. */
+static bool load_cache(struct plan *plan, int dirfd, const struct stat *dir_st)
+{
+    struct stat st;
+    void *buf;
+    int fd;
+
+    fd = open(PLAN_CACHE, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) == -1 || st.st_uid != 0 || (st.st_mode & 022) != 0
+            || (size_t)st.st_size < sizeof(struct plan_header)) {
+        close(fd);
+        return false;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return false;
+
+    if (!cache_valid(buf, st.st_size, dirfd, dir_st)) {
+        munmap(buf, st.st_size);
+        return false;
+    }
+
+    plan->base = buf;
+    plan->size = st.st_size;
+    plan->mapped = true;
+    return true;
+}
+
+/* Loads the plan of all profiles. Returns false if some profiles are broken,
+ * but the plan is usable anyway: it has the rest of them. */
+bool profile_load(struct plan *plan)
+{
+    struct builder b = {
+        VEC(struct plan_source), VEC(struct plan_profile), VEC(struct plan_slot),
+        VEC(uint32_t), VEC(char), false
+    };
+    struct stat dir_st;
+    size_t size;
+    int dirfd;
+
+    dirfd = open(PROFILE_DIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (dirfd != -1) {
+        if (fstat(dirfd, &dir_st) == -1 || dir_st.st_uid != 0
+                || (dir_st.st_mode & 022) != 0) {
+            ERROR("error: %s must be owned by root and not writable by others.\n",
+                  PROFILE_DIR);
+            close(dirfd);
+            dirfd = -1;
+            b.errors = true;
+        } else if (load_cache(plan, dirfd, &dir_st)) {
+            DEBUG("%s: using %s\n", __func__, PLAN_CACHE);
+            close(dirfd);
+            return true;
+        }
+    }
+
+    if (dirfd != -1)
+        compile_dir(&b, dirfd);
+
+    for (size_t i = 0; i < ARRAY_SIZE(builtin_profiles); i++) {
+        const char *name = builtin_profiles[i][0];
+        if (has_profile(&b, name))
+            continue;
+        char *text = strdup(builtin_profiles[i][1]);
+        if (text == NULL) {
+            ERROR("error: out of memory.\n");
+            b.errors = true;
+            continue;
+        }
+        compile_profile(&b, name, "built-in", text);
+        free(text);
+    }
+
+    plan->base = build_plan(&b, dirfd != -1 ? &dir_st : NULL, &size);
+    plan->size = size;
+    plan->mapped = false;
+
+    /* Only cache good plans, so that errors are reported until fixed.
+     * Without PROFILE_DIR, there's nothing worth caching. */
+    if (dirfd != -1 && !b.errors) {
+        DEBUG("%s: writing %s\n", __func__, PLAN_CACHE);
+        write_cache(plan->base, size);
+    }
+
+    if (dirfd != -1)
+        close(dirfd);
+    free(b.sources.data);
+    free(b.profiles.data);
+    free(b.matches.data);
+    free(b.lists.data);
+    free(b.strings.data);
+    return !b.errors;
+}
+
+#define PLAN_HDR(plan) ((const struct plan_header *)(plan)->base)
+
+static const char *plan_str(const struct plan *plan, uint32_t off)
+{
+    const struct plan_header *hdr = PLAN_HDR(plan);
+    return off < hdr->strings_size ? plan->base + hdr->strings + off : NULL;
+}
+
+static const struct plan_profile *plan_profile(const struct plan *plan, int i)
+{
+    const struct plan_header *hdr = PLAN_HDR(plan);
+    if (i < 0 || (uint32_t)i >= hdr->nprofiles)
+        return NULL;
+    return (const struct plan_profile *)(plan->base + hdr->profiles) + i;
+}
+
+int profile_find(const struct plan *plan, const char *name)
+{
+    const struct plan_header *hdr = PLAN_HDR(plan);
+    for (uint32_t i = 0; i < hdr->nprofiles; i++) {
+        const char *s = plan_str(plan, plan_profile(plan, i)->name);
+        if (s != NULL && !strcmp(s, name))
+            return i;
+    }
+    return -1;
+}
+
+/* Finds the profile for a command by its basename. */
+int profile_match(const struct plan *plan, const char *command)
+{
+    const struct plan_header *hdr = PLAN_HDR(plan);
+    const struct plan_slot *slots = (const struct plan_slot *)(plan->base + hdr->slots);
+    const char *name = strrchr(command, '/');
+    uint64_t hash;
+
+    name = name ? name + 1 : command;
+    hash = fnv1a_str(FNV1A_INIT, name);
+    for (uint32_t i = 0, j = hash & (hdr->nslots - 1); i < hdr->nslots;
+            i++, j = (j + 1) & (hdr->nslots - 1)) {
+        if (slots[j].profile == PLAN_NONE)
+            return -1;
+        if (slots[j].hash == hash) {
+            const char *s = plan_str(plan, slots[j].name);
+            if (s != NULL && !strcmp(s, name))
+                return slots[j].profile;
+        }
+    }
+    return -1;
+}
+
+const char *profile_name(const struct plan *plan, int profile)
+{
+    const struct plan_profile *p = plan_profile(plan, profile);
+    return p ? plan_str(plan, p->name) : NULL;
+}
+
+static bool apply_list(const struct plan *plan, uint32_t start, uint32_t n,
+                       struct strarray *a)
+{
+    const struct plan_header *hdr = PLAN_HDR(plan);
+    const uint32_t *lists = (const uint32_t *)(plan->base + hdr->lists);
+
+    if (start > hdr->nlists || n > hdr->nlists - start)
+        return false;
+    for (uint32_t i = start; i < start + n; i++) {
+        const char *s = plan_str(plan, lists[i]);
+        if (s == NULL)
+            return false;
+        strarray_append(a, (char *)s);
+    }
+    return true;
+}
+
+/* Adds the profile's mounts to the lists. The container path is only set if
+ * it hasn't been set yet. */
+bool profile_apply(const struct plan *plan, int profile,
+                   struct strarray *mounts,
+                   struct strarray *required,
+                   struct strarray *undos,
+                   struct strarray *dirs,
+                   bool *ignore_missing,
+                   char **root)
+{
+    const struct plan_profile *p = plan_profile(plan, profile);
+
+    if (p == NULL
+            || !apply_list(plan, p->mounts, p->nmounts, mounts)
+            || !apply_list(plan, p->required, p->nrequired, required)
+            || !apply_list(plan, p->undos, p->nundos, undos)
+            || !apply_list(plan, p->dirs, p->ndirs, dirs))
+        return false;
+
+    if (p->flags & PROFILE_IGNORE_MISSING)
+        *ignore_missing = true;
+    if (*root == NULL && p->root != PLAN_NONE) {
+        *root = (char *)plan_str(plan, p->root);
+        if (*root == NULL)
+            return false;
+    }
+    return true;
+}
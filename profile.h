@@ -0,0 +1,87 @@
+#ifndef VOIDNSRUN_PROFILE_H
+#define VOIDNSRUN_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "utils.h"
+
+/*
+ * The compiled plan of all launch profiles. It's a single flat buffer, which
+ * is the very same thing as the cache file, so a cached plan is used right
+ * from the mmap()'ed file. All offsets are relative to the beginning of the
+ * buffer, strings are referenced by offsets into the string table.
+ */
+
+#define PLAN_MAGIC "VNSPLAN"
+#define PLAN_VERSION 2
+#define PLAN_NONE UINT32_MAX
+
+#define PROFILE_IGNORE_MISSING 0x1
+
+struct plan_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+
+    /* What the plan was compiled from. */
+    uint64_t builtin_hash;
+    int64_t dir_mtime_sec;
+    int64_t dir_mtime_nsec;
+    uint32_t sources, nsources;
+
+    uint32_t profiles, nprofiles;
+    uint32_t slots, nslots;
+    uint32_t lists, nlists;
+    uint32_t strings, strings_size;
+};
+
+/* A profile file, as it was at compile time. */
+struct plan_source {
+    uint32_t name;
+    uint32_t pad;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+/* mounts, required, undos and dirs are indexes of the first entry in the
+ * lists table, which holds string offsets. */
+struct plan_profile {
+    uint32_t name;
+    uint32_t root;
+    uint32_t flags;
+    uint32_t mounts, nmounts;
+    uint32_t required, nrequired;
+    uint32_t undos, nundos;
+    uint32_t dirs, ndirs;
+};
+
+/* A hash table of command names for matching, with linear probing. nslots
+ * is a power of two. */
+struct plan_slot {
+    uint64_t hash;
+    uint32_t name;
+    uint32_t profile;
+};
+
+struct plan {
+    const char *base;
+    size_t size;
+    bool mapped;
+};
+
+bool profile_load(struct plan *plan);
+int profile_find(const struct plan *plan, const char *name);
+int profile_match(const struct plan *plan, const char *command);
+const char *profile_name(const struct plan *plan, int profile);
+bool profile_apply(const struct plan *plan, int profile,
+                   struct strarray *mounts,
+                   struct strarray *required,
+                   struct strarray *undos,
+                   struct strarray *dirs,
+                   bool *ignore_missing,
+                   char **root);
+
+#endif //VOIDNSRUN_PROFILE_H
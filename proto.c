@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "proto.h"
+
+/* Returns the number of bytes sent, or -1. */
+ssize_t proto_send(int sock, uint32_t type, int32_t value,
+                   const void *data, size_t len,
+                   const int *fds, int nfds)
+{
+    struct proto_hdr hdr = {.version = PROTO_VERSION, .type = type, .value = value};
+    struct msghdr msg = {0};
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * PROTO_MAX_FDS)];
+        struct cmsghdr align;
+    } ctrl;
+
+    if (nfds < 0 || nfds > PROTO_MAX_FDS || len > PROTO_MSG_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+
+    if (nfds > 0) {
+        memset(&ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    /* The other side may be gone already, don't die of SIGPIPE. */
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/* Like strerror(), but explains EPROTO, which means the other side is of
+ * another version. */
+const char *proto_strerror(int err)
+{
+    if (err == EPROTO)
+        return "protocol version mismatch, voidnsrun and voidnsundo must be of the same version";
+    return strerror(err);
+}
+
+/* Receives a message. Returns the payload length, or -1. Received fds are
+ * stored in fds (which must have room for PROTO_MAX_FDS) and are close-on-exec.
+ * A message that doesn't fit fails with EMSGSIZE, a message of another
+ * version with EPROTO. A closed connection fails with ECONNRESET. */
+ssize_t proto_recv(int sock, struct proto_hdr *hdr,
+                   void *data, size_t size,
+                   int *fds, int *nfds, int flags)
+{
+    struct msghdr msg = {0};
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * PROTO_MAX_FDS)];
+        struct cmsghdr align;
+    } ctrl;
+    ssize_t n;
+
+    *nfds = 0;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(*hdr);
+    iov[1].iov_base = data;
+    iov[1].iov_len = size;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size > 0 ? 2 : 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    n = recvmsg(sock, &msg, flags|MSG_CMSG_CLOEXEC);
+    if (n == -1)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds + *nfds, CMSG_DATA(cmsg), sizeof(int) * count);
+        *nfds += count;
+    }
+
+    if (n == 0) {
+        errno = ECONNRESET;
+        goto fail;
+    }
+    /* The version comes first, so it can be checked before the rest of the
+     * header, whose layout may be different. */
+    if ((size_t)n >= sizeof(hdr->version) && hdr->version != PROTO_VERSION) {
+        errno = EPROTO;
+        goto fail;
+    }
+    if ((msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) || (size_t)n < sizeof(*hdr)) {
+        errno = EMSGSIZE;
+        goto fail;
+    }
+
+    return n - sizeof(*hdr);
+
+fail:
+    for (int i = 0; i < *nfds; i++)
+        close(fds[i]);
+    *nfds = 0;
+    return -1;
+}
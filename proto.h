@@ -0,0 +1,59 @@
+#ifndef VOIDNSRUN_PROTO_H
+#define VOIDNSRUN_PROTO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Messages exchanged over SOCK_PATH. The socket is SOCK_SEQPACKET, so every
+ * message arrives whole, together with its fds. A client sends one request,
+ * the server replies to it.
+ *
+ * Every message starts with PROTO_VERSION. voidnsrun and voidnsundo may come
+ * from different builds (a session started before an upgrade), and a message
+ * of another version is refused with EPROTO instead of being misread.
+ */
+#define PROTO_VERSION 2
+
+enum {
+    PROTO_NSFD  = 'N',  /* Request: send me the namespace fd.
+                           Reply: the same type, with the fd attached, and
+                           then the extras flagged in value, in the order of
+                           the PROTO_NSFD_* flags. */
+    PROTO_SPAWN = 'S',  /* Request: run a program in the original namespace.
+                           See spawn.h for the payload. */
+    PROTO_PID   = 'P',  /* Reply to PROTO_SPAWN: value is the pid, a pidfd is
+                           attached if the kernel supports it. */
+    PROTO_EXIT  = 'X',  /* Sent when the spawned program has exited: value is
+                           its wait status. */
+    PROTO_ERROR = 'E',  /* The request has failed: value is errno. */
+    PROTO_STATS = 'I',  /* Request: send me the server's counters. Root only.
+                           Reply: the same type, with struct server_stats
+                           (see server.h) as the payload. */
+};
+
+/* Extras of the PROTO_NSFD reply. */
+enum {
+    PROTO_NSFD_ROOT = 1 << 0,   /* Root directory of the original namespace's
+                                   process, if it's chrooted. */
+};
+
+struct proto_hdr {
+    uint32_t version;
+    uint32_t type;
+    int32_t value;
+};
+
+/* Max. size of a message payload and max. number of fds attached to it. */
+#define PROTO_MSG_MAX (128 * 1024)
+#define PROTO_MAX_FDS 4
+
+ssize_t proto_send(int sock, uint32_t type, int32_t value,
+                   const void *data, size_t len,
+                   const int *fds, int nfds);
+ssize_t proto_recv(int sock, struct proto_hdr *hdr,
+                   void *data, size_t size,
+                   int *fds, int *nfds, int flags);
+const char *proto_strerror(int err);
+
+#endif //VOIDNSRUN_PROTO_H
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "proto.h"
+#include "spawn.h"
+#include "server.h"
+
+/*
+ * The server that runs in the namespace and serves voidnsundo.
+ *
+ * It's a single-threaded epoll loop. A connection carries one request (see
+ * proto.h). Usually the request is already there when the connection is
+ * accepted, so it's answered and closed right away. Otherwise, and when the
+ * client waits for a spawned program to exit, the connection is kept in a
+ * table of SERVER_MAX_CONNS entries. When the table is full, the server stops
+ * accepting, and new clients wait in the listen backlog.
+ *
+ * SIGTERM and SIGCHLD are read from a signalfd, so they don't have to
+ * interrupt anything.
+ *
+ * The server counts what it does in a struct server_stats, which it sends to
+ * root on a PROTO_STATS request (voidnsrun --stats). The counters live in
+ * a shared anonymous mapping and are updated with atomic adds, so that the
+ * children forked for PROTO_SPAWN can count their own failures there, after
+ * the fork and without any locking.
+ */
+
+#define SERVER_MAX_EVENTS 8
+#define SERVER_MAX_CONNS 256
+
+struct conn {
+    int fd;     /* -1 if the slot is free. */
+    pid_t pid;  /* Spawned program the client waits for, or 0. */
+};
+
+struct server {
+    const struct server_config *config;
+    int epoll_fd;
+    int sock_fd;
+    int reserve_fd;
+    bool accepting;
+    size_t nconns;
+    struct conn conns[SERVER_MAX_CONNS];
+    struct server_stats *stats;
+    uint64_t started;
+};
+
+#define STAT_ADD(srv, field, n) \
+    __atomic_fetch_add(&(srv)->stats->field, (n), __ATOMIC_RELAXED)
+
+/* epoll tags of the listening socket and the signalfd. Connections are
+ * tagged with their struct conn. */
+static char listen_tag, signal_tag;
+
+/* Requests are read here. */
+static char msg_buf[PROTO_MSG_MAX];
+
+static time_t monotonic_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int server_listen(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        ERROR("socket: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        ERROR("bind: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, SOMAXCONN) == -1) {
+        ERROR("listen: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void server_set_accepting(struct server *srv, bool accepting)
+{
+    struct epoll_event ev = {0};
+
+    if (srv->accepting == accepting)
+        return;
+    ev.events = accepting ? EPOLLIN : 0;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, srv->sock_fd, &ev) == -1)
+        ERROR("epoll_ctl: %s\n", strerror(errno));
+    srv->accepting = accepting;
+}
+
+static void server_close_conn(struct server *srv, struct conn *conn)
+{
+    close(conn->fd);
+    conn->fd = -1;
+    conn->pid = 0;
+    srv->nconns--;
+    server_set_accepting(srv, true);
+}
+
+/* Replies with an error and counts it. */
+static void server_error(struct server *srv, int fd, int err)
+{
+    STAT_ADD(srv, errors, 1);
+    proto_send(fd, PROTO_ERROR, err, NULL, 0, NULL, 0);
+}
+
+static bool peer_is_root(int fd)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0
+        && cred.uid == 0;
+}
+
+/* Counts how long sending the namespace fd has taken. */
+static void server_record_latency(struct server *srv, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+
+    while (us > 0 && i < SERVER_STATS_BUCKETS - 1) {
+        us >>= 1;
+        i++;
+    }
+    STAT_ADD(srv, latency[i], 1);
+    STAT_ADD(srv, latency_sum_ns, ns);
+    if (ns > srv->stats->latency_max_ns)
+        __atomic_store_n(&srv->stats->latency_max_ns, ns, __ATOMIC_RELAXED);
+}
+
+static void server_send_stats(struct server *srv, int fd)
+{
+    struct server_stats stats;
+
+    if (!peer_is_root(fd)) {
+        server_error(srv, fd, EPERM);
+        return;
+    }
+
+    /* Only spawn_failed is written by other processes. */
+    memcpy(&stats, srv->stats, sizeof(stats));
+    stats.spawn_failed = __atomic_load_n(&srv->stats->spawn_failed, __ATOMIC_RELAXED);
+    stats.uptime_ms = (monotonic_ns() - srv->started) / 1000000;
+    stats.open = srv->nconns;
+
+    if (proto_send(fd, PROTO_STATS, 0, &stats, sizeof(stats), NULL, 0) == -1) {
+        DEBUG("%s: %s\n", __func__, strerror(errno));
+        STAT_ADD(srv, errors, 1);
+    }
+}
+
+static pid_t server_spawn(struct server *srv, int fd, size_t len,
+                          const int *fds, int nfds)
+{
+    struct spawn s;
+    pid_t pid;
+    int pidfd;
+
+    /* The socket is only accessible by root anyway, but the request carries
+     * the credentials the program will run with, so make sure. */
+    if (!peer_is_root(fd)) {
+        server_error(srv, fd, EPERM);
+        return 0;
+    }
+
+    if (nfds != SPAWN_FDS || !spawn_parse(msg_buf, len, &s)) {
+        server_error(srv, fd, EINVAL);
+        return 0;
+    }
+
+    pid = spawn_start(&s, srv->config->nsfd, srv->config->rootfd, fds,
+                      &srv->stats->spawn_failed);
+    spawn_free(&s);
+    if (pid == -1) {
+        ERROR("fork: %s\n", strerror(errno));
+        server_error(srv, fd, errno);
+        return 0;
+    }
+    DEBUG("%s: spawned %d\n", __func__, (int)pid);
+
+    /* Without pidfd (Linux < 5.3), the client falls back to kill(). */
+    pidfd = sys_pidfd_open(pid, 0);
+    if (proto_send(fd, PROTO_PID, pid, NULL, 0, &pidfd, pidfd != -1 ? 1 : 0) != -1)
+        STAT_ADD(srv, fds_sent, pidfd != -1 ? 1 : 0);
+    if (pidfd != -1)
+        close(pidfd);
+    return pid;
+}
+
+/* Handles the request of a connection. Returns the pid of a spawned program
+ * the client is going to wait for, 0 if the connection can be closed, or -1
+ * if the request hasn't arrived yet. */
+static pid_t server_request(struct server *srv, int fd)
+{
+    struct proto_hdr hdr;
+    int fds[PROTO_MAX_FDS], fds_out[PROTO_MAX_FDS];
+    int nfds, nfds_out;
+    pid_t pid = 0;
+    ssize_t len;
+    uint64_t t;
+
+    len = proto_recv(fd, &hdr, msg_buf, sizeof(msg_buf), fds, &nfds, MSG_DONTWAIT);
+    if (len == -1) {
+        if (errno == EAGAIN)
+            return -1;
+        DEBUG("%s: %s\n", __func__, strerror(errno));
+        if (errno == EPROTO)
+            server_error(srv, fd, EPROTO);
+        else
+            STAT_ADD(srv, errors, 1);
+        return 0;
+    }
+
+    switch (hdr.type) {
+    case PROTO_NSFD:
+        STAT_ADD(srv, nsfd, 1);
+        /* Everything is sent at once, the client needs nothing else. */
+        nfds_out = 0;
+        fds_out[nfds_out++] = srv->config->nsfd;
+        if (srv->config->rootfd != -1)
+            fds_out[nfds_out++] = srv->config->rootfd;
+        t = monotonic_ns();
+        if (proto_send(fd, PROTO_NSFD, srv->config->rootfd != -1 ? PROTO_NSFD_ROOT : 0,
+                       NULL, 0, fds_out, nfds_out) == -1) {
+            DEBUG("%s: %s\n", __func__, strerror(errno));
+            STAT_ADD(srv, errors, 1);
+            break;
+        }
+        server_record_latency(srv, monotonic_ns() - t);
+        STAT_ADD(srv, fds_sent, nfds_out);
+        break;
+    case PROTO_SPAWN:
+        STAT_ADD(srv, spawn, 1);
+        pid = server_spawn(srv, fd, len, fds, nfds);
+        break;
+    case PROTO_STATS:
+        STAT_ADD(srv, stats, 1);
+        server_send_stats(srv, fd);
+        break;
+    default:
+        DEBUG("%s: unknown request %u\n", __func__, hdr.type);
+        server_error(srv, fd, EINVAL);
+        break;
+    }
+
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    return pid;
+}
+
+/* Puts a connection into the table. */
+static void server_keep(struct server *srv, int fd, pid_t pid)
+{
+    struct epoll_event ev = {0};
+    struct conn *conn = NULL;
+
+    for (size_t i = 0; i < SERVER_MAX_CONNS; i++) {
+        if (srv->conns[i].fd == -1) {
+            conn = &srv->conns[i];
+            break;
+        }
+    }
+
+    ev.events = EPOLLIN|EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (conn == NULL || epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        STAT_ADD(srv, errors, 1);
+        close(fd);
+        return;
+    }
+
+    conn->fd = fd;
+    conn->pid = pid;
+    if (++srv->nconns > srv->stats->open_max)
+        srv->stats->open_max = srv->nconns;
+    if (srv->nconns == SERVER_MAX_CONNS)
+        server_set_accepting(srv, false);
+}
+
+/* Accepts everything that is waiting in the backlog, while there's room. */
+static void server_accept(struct server *srv)
+{
+    int conn;
+    pid_t pid;
+
+    while (srv->accepting) {
+        conn = accept4(srv->sock_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* Out of fds. The connection would stay in the backlog and epoll
+             * would keep reporting it, so use the reserved fd to accept and
+             * drop it. accept() fails like this even if there's nothing to
+             * accept, so stop when the backlog is empty. */
+            if ((errno == EMFILE || errno == ENFILE) && srv->reserve_fd != -1) {
+                ERROR("accept: %s\n", strerror(errno));
+                STAT_ADD(srv, errors, 1);
+                close(srv->reserve_fd);
+                conn = accept(srv->sock_fd, NULL, NULL);
+                if (conn != -1)
+                    close(conn);
+                srv->reserve_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+                if (conn == -1)
+                    return;
+                continue;
+            }
+
+            if (errno != EAGAIN) {
+                ERROR("accept: %s\n", strerror(errno));
+                STAT_ADD(srv, errors, 1);
+            }
+            return;
+        }
+        STAT_ADD(srv, accepted, 1);
+
+        pid = server_request(srv, conn);
+        if (pid != 0)
+            server_keep(srv, conn, pid > 0 ? pid : 0);
+        else
+            close(conn);
+    }
+}
+
+static void server_conn_event(struct server *srv, struct conn *conn)
+{
+    pid_t pid;
+
+    /* A client that waits for a program can only hang up. */
+    if (conn->pid > 0) {
+        server_close_conn(srv, conn);
+        return;
+    }
+
+    pid = server_request(srv, conn->fd);
+    if (pid > 0)
+        conn->pid = pid;
+    else if (pid == 0)
+        server_close_conn(srv, conn);
+}
+
+/* Reaps spawned programs and reports their exit status. */
+static void server_reap(struct server *srv)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        DEBUG("%s: %d exited with status %d\n", __func__, (int)pid, status);
+        STAT_ADD(srv, exited, 1);
+        for (size_t i = 0; i < SERVER_MAX_CONNS; i++) {
+            struct conn *conn = &srv->conns[i];
+            if (conn->fd != -1 && conn->pid == pid) {
+                proto_send(conn->fd, PROTO_EXIT, status, NULL, 0, NULL, 0);
+                server_close_conn(srv, conn);
+                break;
+            }
+        }
+    }
+}
+
+/* Serves clients until SIGTERM, or until it has been idle for too long.
+ * Returns 0 on normal stop, -1 on error. */
+int server_run(int sock_fd, const struct server_config *config)
+{
+    static struct server srv;
+    struct epoll_event ev = {0}, events[SERVER_MAX_EVENTS];
+    struct signalfd_siginfo si;
+    sigset_t mask;
+    int signal_fd = -1;
+    int timeout = config->idle_timeout > 0 ? SESSION_POLL_INTERVAL * 1000 : -1;
+    int ret = -1;
+    time_t now, last_check, last_busy;
+
+    srv.config = config;
+    srv.sock_fd = sock_fd;
+    srv.epoll_fd = -1;
+    srv.reserve_fd = -1;
+    srv.accepting = true;
+    srv.nconns = 0;
+    for (size_t i = 0; i < SERVER_MAX_CONNS; i++)
+        srv.conns[i].fd = -1;
+
+    srv.started = monotonic_ns();
+    srv.stats = mmap(NULL, sizeof(struct server_stats), PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (srv.stats == MAP_FAILED) {
+        srv.stats = NULL;
+        ERROR_EXIT("mmap: %s\n", strerror(errno));
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        ERROR_EXIT("sigprocmask: %s\n", strerror(errno));
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if (signal_fd == -1)
+        ERROR_EXIT("signalfd: %s\n", strerror(errno));
+
+    srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv.epoll_fd == -1)
+        ERROR_EXIT("epoll_create1: %s\n", strerror(errno));
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1)
+        ERROR_EXIT("epoll_ctl: %s\n", strerror(errno));
+
+    ev.data.ptr = &signal_tag;
+    if (epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1)
+        ERROR_EXIT("epoll_ctl: %s\n", strerror(errno));
+
+    /* Keep one fd in reserve for the case we run out of them. */
+    srv.reserve_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+
+    last_check = last_busy = monotonic_sec();
+    for (;;) {
+        int n = epoll_wait(srv.epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR)
+            ERROR_EXIT("epoll_wait: %s\n", strerror(errno));
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &signal_tag) {
+                while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+                    if (si.ssi_signo == SIGCHLD)
+                        continue;
+                    DEBUG("%s: got signal %u\n", __func__, si.ssi_signo);
+                    ret = 0;
+                    goto end;
+                }
+                server_reap(&srv);
+            } else if (tag == &listen_tag) {
+                server_accept(&srv);
+            } else {
+                server_conn_event(&srv, tag);
+            }
+        }
+
+        if (config->idle_timeout > 0) {
+            now = monotonic_sec();
+            if (now - last_check >= SESSION_POLL_INTERVAL) {
+                last_check = now;
+                /* Clients waiting for spawned programs count, too. */
+                if (srv.nconns > 0 || !config->is_idle())
+                    last_busy = now;
+                else if (now - last_busy >= config->idle_timeout) {
+                    DEBUG("%s: idle for %ld seconds\n", __func__, (long)(now - last_busy));
+                    ret = 0;
+                    goto end;
+                }
+            }
+        }
+    }
+
+end:
+    for (size_t i = 0; i < SERVER_MAX_CONNS; i++) {
+        if (srv.conns[i].fd != -1)
+            close(srv.conns[i].fd);
+    }
+    if (srv.reserve_fd != -1)
+        close(srv.reserve_fd);
+    if (srv.epoll_fd != -1)
+        close(srv.epoll_fd);
+    if (signal_fd != -1)
+        close(signal_fd);
+    if (srv.stats != NULL)
+        munmap(srv.stats, sizeof(struct server_stats));
+    return ret;
+}
+
+/* Asks the server at addr for its counters. On error, returns false with
+ * errno set. */
+bool server_get_stats(const struct sockaddr_un *addr, struct server_stats *stats)
+{
+    struct proto_hdr hdr;
+    int fds[PROTO_MAX_FDS], nfds;
+    ssize_t len;
+    bool ret = false;
+    int sock;
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return false;
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == -1
+            || proto_send(sock, PROTO_STATS, 0, NULL, 0, NULL, 0) == -1)
+        goto end;
+
+    len = proto_recv(sock, &hdr, stats, sizeof(*stats), fds, &nfds, 0);
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    if (len == -1)
+        goto end;
+
+    if (hdr.type == PROTO_ERROR)
+        errno = hdr.value;
+    else if (hdr.type != PROTO_STATS || len != sizeof(*stats))
+        errno = EPROTO;
+    else
+        ret = true;
+
+end:
+    close(sock);
+    return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef VOIDNSRUN_SERVER_H
+#define VOIDNSRUN_SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+struct server_config {
+    /* The fd that is passed to clients, and the root directory that goes
+     * with it, or -1. */
+    int nsfd;
+    int rootfd;
+
+    /* If not 0, the server stops after is_idle() has been returning true
+     * for this many seconds. */
+    int idle_timeout;
+    bool (*is_idle)(void);
+};
+
+/*
+ * Counters of a running server, as returned by a PROTO_STATS request. They
+ * count from the server's start.
+ *
+ * latency is a histogram of how long sending the namespace fd to a client
+ * took: bucket 0 counts sends under 1 µs, bucket i sends of 2^(i-1) to 2^i µs,
+ * and the last one everything longer.
+ */
+#define SERVER_STATS_BUCKETS 16
+
+struct server_stats {
+    uint64_t uptime_ms;
+    uint64_t accepted;          /* Connections. */
+    uint64_t open, open_max;    /* Connections kept open, now and at most. */
+    uint64_t nsfd, spawn, stats;/* Requests, by type. */
+    uint64_t fds_sent;
+    uint64_t errors;            /* Failed requests and connections. */
+    uint64_t spawn_failed;      /* Spawned programs that failed to exec. */
+    uint64_t exited;            /* Spawned programs that have exited. */
+    uint64_t latency_sum_ns;
+    uint64_t latency_max_ns;
+    uint64_t latency[SERVER_STATS_BUCKETS];
+};
+
+/* Server side. */
+int server_listen(const struct sockaddr_un *addr);
+int server_run(int sock_fd, const struct server_config *config);
+
+/* Client side. */
+bool server_get_stats(const struct sockaddr_un *addr, struct server_stats *stats);
+
+#endif //VOIDNSRUN_SERVER_H
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "session.h"
+
+/*
+ * A session is a mount namespace that outlives the voidnsrun call that has
+ * created it. It is kept alive by the server child (the "holder"), which
+ * registers itself in SESSION_DIR in a file named "<uid>.<name>" containing
+ * a single line:
+ *
+ *     <holder pid> <holder starttime> <session key>
+ *
+ * The key is a hash of everything that affects the layout of the namespace,
+ * so a later call only reuses the session if it would have built the very
+ * same namespace by itself.
+ *
+ * SESSION_DIR is only writable by root, so the contents of these files can be
+ * trusted. The pid is verified against its start time to make sure it hasn't
+ * been reused by another process.
+ */
+
+bool session_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > SESSION_NAME_MAX || name[0] == '.')
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i])
+                && name[i] != '-' && name[i] != '_' && name[i] != '.')
+            return false;
+    }
+    return true;
+}
+
+static void session_filename(char *buf, size_t size, const char *name,
+                             const char *suffix)
+{
+    snprintf(buf, size, "%u.%s%s", (unsigned)getuid(), name, suffix);
+}
+
+int session_dir_open(void)
+{
+    char buf[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    /* This should be safe, SESSION_DIR is hardcoded in config.h and it's
+     * definitely smaller than buffer. */
+    strcpy(buf, SESSION_DIR);
+    char *parent = dirname(buf);
+
+    if (mkdir(parent, 0700) == -1 && errno != EEXIST) {
+        ERROR("error: failed to create %s: %s.\n", parent, strerror(errno));
+        return -1;
+    }
+    if (mkdir(SESSION_DIR, 0700) == -1 && errno != EEXIST) {
+        ERROR("error: failed to create %s: %s.\n", SESSION_DIR, strerror(errno));
+        return -1;
+    }
+
+    fd = open(SESSION_DIR, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", SESSION_DIR, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_uid != 0 || (st.st_mode & 077) != 0) {
+        ERROR("error: %s must be owned by root and not accessible by others.\n",
+              SESSION_DIR);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Serializes creation of sessions with the same name. The lock is released
+ * when all copies of the returned descriptor are closed. */
+int session_lock(int dirfd, const char *name)
+{
+    char filename[SESSION_NAME_MAX + 32];
+    int fd;
+
+    session_filename(filename, sizeof(filename), name, ".lock");
+    fd = openat(dirfd, filename, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        ERROR("error: failed to open session lock: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX) == -1) {
+        ERROR("flock: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Returns a descriptor of the session's mount namespace, or -1 if there's no
+ * live session with that name. If the session exists but was created with
+ * a different configuration, *mismatch is set to true. */
+int session_find(int dirfd, const char *name, uint64_t key, bool *mismatch)
+{
+    char filename[SESSION_NAME_MAX + 32];
+    char buf[128];
+    int fd, nsfd, pid;
+    ssize_t len;
+    unsigned long long starttime, file_key;
+
+    *mismatch = false;
+    session_filename(filename, sizeof(filename), name, "");
+
+    fd = openat(dirfd, filename, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (len <= 0)
+        goto stale;
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%d %llu %llx", &pid, &starttime, &file_key) != 3)
+        goto stale;
+
+    nsfd = ns_open_pid(pid, starttime);
+    if (nsfd == -1)
+        goto stale;
+
+    if (file_key != key) {
+        close(nsfd);
+        *mismatch = true;
+        return -1;
+    }
+
+    DEBUG("%s: joining session %s held by %d\n", __func__, name, pid);
+    return nsfd;
+
+stale:
+    DEBUG("%s: removing stale session %s\n", __func__, name);
+    unlinkat(dirfd, filename, 0);
+    return -1;
+}
+
+bool session_register(int dirfd, const char *name, uint64_t key)
+{
+    char filename[SESSION_NAME_MAX + 32];
+    char tmpname[SESSION_NAME_MAX + 32];
+    char buf[128];
+    unsigned long long starttime;
+    int fd, len;
+    bool ok;
+
+    if (!proc_starttime(getpid(), &starttime)) {
+        ERROR("error: failed to get own start time.\n");
+        return false;
+    }
+
+    session_filename(filename, sizeof(filename), name, "");
+    session_filename(tmpname, sizeof(tmpname), name, ".tmp");
+
+    fd = openat(dirfd, tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        ERROR("error: failed to create %s: %s.\n", tmpname, strerror(errno));
+        return false;
+    }
+
+    len = snprintf(buf, sizeof(buf), "%d %llu %llx\n",
+                   (int)getpid(), starttime, (unsigned long long)key);
+    ok = write(fd, buf, len) == len;
+    close(fd);
+
+    /* Publish it atomically, so readers never see a partial file. */
+    if (!ok || renameat(dirfd, tmpname, dirfd, filename) == -1) {
+        ERROR("error: failed to register session %s.\n", name);
+        unlinkat(dirfd, tmpname, 0);
+        return false;
+    }
+
+    return true;
+}
+
+void session_unregister(int dirfd, const char *name)
+{
+    char filename[SESSION_NAME_MAX + 32];
+    char buf[128];
+    int fd, pid;
+    ssize_t len;
+
+    session_filename(filename, sizeof(filename), name, "");
+    fd = openat(dirfd, filename, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1)
+        return;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    /* Only remove the file if it still points to us. */
+    if (len > 0) {
+        buf[len] = '\0';
+        if (sscanf(buf, "%d", &pid) == 1 && pid == getpid())
+            unlinkat(dirfd, filename, 0);
+    }
+}
+
+/* A session is idle when no process but the holder itself is in its mount
+ * namespace. */
+bool session_is_idle(void)
+{
+    struct stat self, st;
+    char path[64];
+    DIR *proc;
+    struct dirent *de;
+    long me = getpid();
+    bool idle = true;
+
+    if (stat("/proc/self/ns/mnt", &self) == -1)
+        return false;
+    if ((proc = opendir("/proc")) == NULL)
+        return false;
+
+    while ((de = readdir(proc)) != NULL) {
+        char *end;
+        long pid = strtol(de->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0 || pid == me)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%ld/ns/mnt", pid);
+        if (stat(path, &st) == 0
+                && st.st_ino == self.st_ino && st.st_dev == self.st_dev) {
+            idle = false;
+            break;
+        }
+    }
+
+    closedir(proc);
+    return idle;
+}
+
+/* Opens the mount namespace of a running process for --join. The process must
+ * belong to the caller and its namespace must have been created by voidnsrun,
+ * which is recognized by the root-owned socket (or, with --no-server, the
+ * origin file) that voidnsrun leaves there for this very namespace. */
+int ns_open_voidnsrun(pid_t pid)
+{
+    char path[PATH_MAX];
+    char sock[128], origin[128];
+    struct stat st;
+    unsigned long long starttime;
+    uid_t uid;
+    int fd;
+
+    if (!proc_starttime(pid, &starttime) || !proc_uid(pid, &uid)) {
+        ERROR("error: process %d not found.\n", (int)pid);
+        return -1;
+    }
+
+    if (getuid() != 0 && uid != getuid()) {
+        ERROR("error: process %d doesn't belong to you.\n", (int)pid);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", (int)pid);
+    if (!sock_path(sock, sizeof(sock), path)
+            || !ns_file_path(origin, sizeof(origin), path, "origin")) {
+        ERROR("error: process %d not found.\n", (int)pid);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/root%s", (int)pid, sock);
+    if (lstat(path, &st) == -1 || !S_ISSOCK(st.st_mode) || st.st_uid != 0) {
+        snprintf(path, sizeof(path), "/proc/%d/root%s", (int)pid, origin);
+        if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode))
+            st.st_uid = -1;
+    }
+    if (st.st_uid != 0) {
+        ERROR("error: process %d is not running in a voidnsrun namespace.\n",
+              (int)pid);
+        return -1;
+    }
+
+    fd = ns_open_pid(pid, starttime);
+    if (fd == -1)
+        ERROR("error: failed to open mount namespace of process %d.\n", (int)pid);
+    return fd;
+}
@@ -0,0 +1,19 @@
+#ifndef VOIDNSRUN_SESSION_H
+#define VOIDNSRUN_SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+bool session_name_valid(const char *name);
+
+int session_dir_open(void);
+int session_lock(int dirfd, const char *name);
+int session_find(int dirfd, const char *name, uint64_t key, bool *mismatch);
+bool session_register(int dirfd, const char *name, uint64_t key);
+void session_unregister(int dirfd, const char *name);
+bool session_is_idle(void);
+
+int ns_open_voidnsrun(pid_t pid);
+
+#endif //VOIDNSRUN_SESSION_H
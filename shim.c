@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "mountapi.h"
+#include "shim.h"
+
+/*
+ * Automatic undo shims.
+ *
+ * In the namespace, /usr is the container's, so programs that only the host
+ * has in its /usr/bin and such are gone. shim_scan() finds them by comparing
+ * the PATH directories of the host with the same directories in the
+ * container, and shim_install() creates a symlink to voidnsundo for each of
+ * them in SHIM_DIR, which is added to PATH. voidnsundo, when called through
+ * such a symlink, starts the program of the same name on the host.
+ *
+ * PATH directories outside of /usr (and those under -d mounts) are the same
+ * in the namespace as on the host, so their programs don't need shims, and
+ * they also hide the host-only programs of the same name.
+ *
+ * Nothing is trusted here: a shim only lets the user start a host program
+ * with their own rights, which voidnsundo allows anyway. But the directories
+ * are opened and listed with the user's credentials, so that the names of
+ * programs they can't see don't show up as shims. That's also why the cache
+ * is per user. Only the cache itself is read and written as root.
+ */
+
+struct scan_dir {
+    char *path;         /* Real path on the host. */
+    bool replaced;      /* Comes from the container in the namespace. */
+    int host_fd;
+    int container_fd;
+};
+
+static bool shim_name_valid(const char *name)
+{
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL
+        && strcmp(name, VOIDNSUNDO_NAME) != 0;
+}
+
+typedef void (*scan_cb)(int dirfd, const char *name, void *arg);
+
+/* Lists a directory with getdents64(), many entries per call. Directories
+ * are skipped. */
+static void list_dir(int fd, scan_cb cb, void *arg)
+{
+    char buf[32768];
+    ssize_t n;
+
+    if (lseek(fd, 0, SEEK_SET) == -1)
+        return;
+    while ((n = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            if (de->d_type != DT_DIR && shim_name_valid(de->d_name))
+                cb(fd, de->d_name, arg);
+        }
+    }
+}
+
+struct collect_arg {
+    struct name_set *visible;
+    struct name_set *shims;
+    struct strarray *names;
+};
+
+/* Everything the namespace has in PATH. */
+static void collect_visible(int dirfd, const char *name, void *arg)
+{
+    struct collect_arg *c = arg;
+    char *s;
+
+    (void)dirfd;
+    if (name_set_has(c->visible, name))
+        return;
+    s = arena_alloc(c->names->arena, strlen(name) + 1);
+    name_set_add(c->visible, strcpy(s, name));
+}
+
+/* Host programs that are not visible in the namespace. */
+static void collect_shims(int dirfd, const char *name, void *arg)
+{
+    struct collect_arg *c = arg;
+    struct stat st;
+    char *s;
+
+    if (name_set_has(c->visible, name) || name_set_has(c->shims, name))
+        return;
+    if (fstatat(dirfd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)
+            || (st.st_mode & 0111) == 0)
+        return;
+    s = arena_alloc(c->names->arena, strlen(name) + 1);
+    strcpy(s, name);
+    name_set_add(c->shims, s);
+    strarray_append(c->names, s);
+}
+
+static void dir_stat(int fd, struct shim_cache_dir *d)
+{
+    struct stat st;
+
+    memset(d, 0, sizeof(*d));
+    if (fd != -1 && fstat(fd, &st) == 0) {
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        d->mtime_sec = st.st_mtim.tv_sec;
+        d->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+static void cache_path(char *buf, size_t size, uint64_t key)
+{
+    snprintf(buf, size, "%s/%016llx", SHIM_CACHE_DIR, (unsigned long long)key);
+}
+
+static bool cache_load(uint64_t key, const struct shim_cache_dir *dirs,
+                       uint32_t ndirs, struct strarray *names)
+{
+    struct shim_cache_header hdr;
+    char path[128];
+    struct stat st;
+    char *buf = NULL;
+    size_t start = names->end;
+    bool ok = false;
+    int fd;
+
+    cache_path(path, sizeof(path), key);
+    fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) == -1 || st.st_uid != 0 || (st.st_mode & 022) != 0)
+        goto end;
+
+    size_t dirs_size = sizeof(struct shim_cache_dir) * ndirs;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+            || memcmp(hdr.magic, SHIM_MAGIC, sizeof(SHIM_MAGIC)) != 0
+            || hdr.version != SHIM_VERSION
+            || hdr.key != key
+            || hdr.ndirs != ndirs
+            || (off_t)(sizeof(hdr) + dirs_size + hdr.names_size) != st.st_size)
+        goto end;
+
+    buf = malloc(dirs_size + hdr.names_size + 1);
+    if (buf == NULL || read(fd, buf, dirs_size + hdr.names_size)
+            != (ssize_t)(dirs_size + hdr.names_size))
+        goto end;
+
+    /* Any change in these directories may change the result. */
+    if (memcmp(buf, dirs, dirs_size) != 0)
+        goto end;
+
+    char *p = buf + dirs_size, *end = p + hdr.names_size;
+    *end = '\0';
+    for (uint32_t i = 0; i < hdr.nnames; i++) {
+        size_t len = strlen(p);
+        if (p + len >= end || !shim_name_valid(p))
+            goto end;
+        strarray_append(names, strcpy(arena_alloc(names->arena, len + 1), p));
+        p += len + 1;
+    }
+    ok = true;
+
+end:
+    if (!ok)
+        names->end = start;
+    free(buf);
+    close(fd);
+    return ok;
+}
+
+/* Writes the cache atomically. Failures are not fatal. */
+static void cache_write(uint64_t key, const struct shim_cache_dir *dirs,
+                        uint32_t ndirs, const struct strarray *names)
+{
+    struct shim_cache_header hdr = {0};
+    char path[128], tmp[PATH_MAX];
+    FILE *f;
+    int fd;
+
+    if ((mkdir(CACHE_DIR, 0700) == -1 && errno != EEXIST)
+            || (mkdir(SHIM_CACHE_DIR, 0700) == -1 && errno != EEXIST)) {
+        DEBUG("%s: mkdir(%s): %s\n", __func__, SHIM_CACHE_DIR, strerror(errno));
+        return;
+    }
+
+    memcpy(hdr.magic, SHIM_MAGIC, sizeof(SHIM_MAGIC));
+    hdr.version = SHIM_VERSION;
+    hdr.key = key;
+    hdr.ndirs = ndirs;
+    hdr.nnames = names->end;
+    for (size_t i = 0; i < names->end; i++)
+        hdr.names_size += strlen(names->list[i]) + 1;
+
+    cache_path(path, sizeof(path), key);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+        DEBUG("%s: open(%s): %s\n", __func__, tmp, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(dirs, sizeof(struct shim_cache_dir), ndirs, f);
+    for (size_t i = 0; i < names->end; i++)
+        fwrite(names->list[i], strlen(names->list[i]) + 1, 1, f);
+
+    if (ferror(f) | fclose(f) || rename(tmp, path) == -1) {
+        DEBUG("%s: failed to write %s\n", __func__, path);
+        unlink(tmp);
+    }
+
+    /* The key depends on PATH, which the user can vary at will. */
+    cache_trim(SHIM_CACHE_DIR, SHIM_CACHE_MAX);
+}
+
+/* Finds programs in the host's PATH that the namespace won't have. Their names
+ * are appended to names. */
+bool shim_scan(const char *path_env, const char *root,
+               const struct strarray *dir_mounts,
+               struct strarray *names)
+{
+    struct scan_dir *dirs = NULL;
+    struct shim_cache_dir *stats = NULL;
+    struct name_set visible = {0}, shims = {0};
+    char *copy = NULL, *entry, *save = NULL;
+    char real[PATH_MAX];
+    size_t ndirs = 0;
+    uint64_t key = FNV1A_INIT;
+    uid_t uid = getuid();
+    int root_fd = -1;
+    bool cached, ok = false;
+
+    if (!fs_as_user(true)) {
+        ERROR("error: failed to switch to your credentials: %s.\n", strerror(errno));
+        goto end;
+    }
+
+    root_fd = open(root, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (root_fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", root, strerror(errno));
+        goto end;
+    }
+
+    copy = strdup(path_env);
+    dirs = calloc(strlen(path_env) / 2 + 1, sizeof(*dirs));
+    if (copy == NULL || dirs == NULL) {
+        ERROR("error: out of memory.\n");
+        goto end;
+    }
+
+    key = fnv1a(key, &uid, sizeof(uid));
+    key = fnv1a_str(key, root);
+    for (entry = strtok_r(copy, ":", &save); entry != NULL;
+            entry = strtok_r(NULL, ":", &save)) {
+        struct scan_dir *d = &dirs[ndirs];
+        bool dup = false;
+
+        /* Relative entries depend on the working directory, skip them. */
+        if (entry[0] != '/' || realpath(entry, real) == NULL)
+            continue;
+        for (size_t i = 0; i < ndirs; i++)
+            dup = dup || !strcmp(dirs[i].path, real);
+        if (dup)
+            continue;
+
+        d->path = strdup(real);
+        d->replaced = startswith(real, "/usr/");
+        for (size_t i = 0; i < dir_mounts->end && d->replaced; i++) {
+            size_t len = strlen(dir_mounts->list[i]);
+            if (!strncmp(real, dir_mounts->list[i], len)
+                    && (real[len] == '/' || real[len] == '\0'))
+                d->replaced = false;
+        }
+        d->host_fd = open(real, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        d->container_fd = d->replaced ? open_in_root(root_fd, real, O_RDONLY|O_DIRECTORY|O_CLOEXEC) : -1;
+        ndirs++;
+
+        key = fnv1a_str(key, real);
+        key = fnv1a(key, &d->replaced, sizeof(d->replaced));
+    }
+
+    stats = calloc(ndirs * 2 + 1, sizeof(*stats));
+    if (stats == NULL) {
+        ERROR("error: out of memory.\n");
+        goto end;
+    }
+    for (size_t i = 0; i < ndirs; i++) {
+        dir_stat(dirs[i].host_fd, &stats[i * 2]);
+        dir_stat(dirs[i].container_fd, &stats[i * 2 + 1]);
+    }
+
+    fs_as_user(false);
+    cached = cache_load(key, stats, ndirs * 2, names);
+    fs_as_user(true);
+    if (cached) {
+        DEBUG("%s: using cached list of %zu shims\n", __func__, names->end);
+        ok = true;
+        goto end;
+    }
+
+    struct collect_arg arg = {&visible, &shims, names};
+    for (size_t i = 0; i < ndirs; i++) {
+        if (dirs[i].replaced && dirs[i].container_fd != -1)
+            list_dir(dirs[i].container_fd, collect_visible, &arg);
+        else if (!dirs[i].replaced && dirs[i].host_fd != -1)
+            list_dir(dirs[i].host_fd, collect_visible, &arg);
+    }
+    for (size_t i = 0; i < ndirs; i++) {
+        if (dirs[i].replaced && dirs[i].host_fd != -1)
+            list_dir(dirs[i].host_fd, collect_shims, &arg);
+    }
+    DEBUG("%s: found %zu shims\n", __func__, names->end);
+
+    fs_as_user(false);
+    cache_write(key, stats, ndirs * 2, names);
+    ok = true;
+
+end:
+    fs_as_user(false);
+    for (size_t i = 0; i < ndirs; i++) {
+        free(dirs[i].path);
+        if (dirs[i].host_fd != -1)
+            close(dirs[i].host_fd);
+        if (dirs[i].container_fd != -1)
+            close(dirs[i].container_fd);
+    }
+    free(dirs);
+    free(stats);
+    free(copy);
+    name_set_free(&visible);
+    name_set_free(&shims);
+    if (root_fd != -1)
+        close(root_fd);
+    return ok;
+}
+
+/* Creates SHIM_DIR with a symlink to target for every name. */
+bool shim_install(const char *target, const struct strarray *names)
+{
+    int fd;
+
+    if (mkdir(SHIM_DIR, 0755) == -1) {
+        ERROR("error: failed to create %s: %s.\n", SHIM_DIR, strerror(errno));
+        return false;
+    }
+
+    fd = open(SHIM_DIR, O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", SHIM_DIR, strerror(errno));
+        return false;
+    }
+
+    for (size_t i = 0; i < names->end; i++) {
+        if (symlinkat(target, fd, names->list[i]) == -1 && errno != EEXIST) {
+            ERROR("error: failed to create shim %s: %s.\n",
+                  names->list[i], strerror(errno));
+            close(fd);
+            return false;
+        }
+    }
+
+    close(fd);
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef VOIDNSRUN_SHIM_H
+#define VOIDNSRUN_SHIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * The cache of a scan. It's named after the key, which covers PATH, the
+ * container and the -d mounts, and is valid as long as the scanned
+ * directories have the same mtimes.
+ */
+
+#define SHIM_MAGIC "VNSSHIM"
+#define SHIM_VERSION 1
+
+struct shim_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ndirs;
+    uint64_t key;
+    uint32_t nnames;
+    uint32_t names_size;
+};
+
+/* Every scanned directory is stored twice, as it is on the host and in the
+ * container. A directory that doesn't exist is all zeros. */
+struct shim_cache_dir {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+bool shim_scan(const char *path_env, const char *root,
+               const struct strarray *dir_mounts,
+               struct strarray *names);
+bool shim_install(const char *target, const struct strarray *names);
+
+#endif //VOIDNSRUN_SHIM_H
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <grp.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+
+#include "utils.h"
+#include "macros.h"
+#include "proto.h"
+#include "spawn.h"
+
+/*
+ * Remote spawn: instead of receiving the namespace fd and calling setns()
+ * and execvp() itself, voidnsundo sends the program, its environment, the
+ * working directory and the stdio fds to the server, which starts the program
+ * in the original namespace and returns its pidfd. Then voidnsundo waits for
+ * the exit status, forwarding signals to the program meanwhile.
+ */
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+int sys_pidfd_open(pid_t pid, unsigned int flags)
+{
+    return syscall(__NR_pidfd_open, pid, flags);
+}
+
+static int sys_pidfd_send_signal(int pidfd, int sig)
+{
+    return syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+/* Appends a string to the buffer. Returns false if it doesn't fit. */
+static bool put_str(char *buf, size_t size, size_t *len, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    if (*len + n > size)
+        return false;
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return true;
+}
+
+/* Sends a PROTO_SPAWN request. Fails with EMSGSIZE if the arguments and the
+ * environment are too big for a single message. */
+ssize_t spawn_send(int sock, char *const argv[], char *const envp[])
+{
+    static char buf[PROTO_MSG_MAX];
+    struct spawn_request *req = (struct spawn_request *)buf;
+    char cwd[PATH_MAX];
+    int fds[SPAWN_FDS];
+    int ngroups, devnull = -1;
+    size_t len = sizeof(*req);
+    ssize_t ret = -1;
+    mode_t mask;
+
+    ngroups = getgroups((PROTO_MSG_MAX - sizeof(*req)) / sizeof(gid_t),
+                        (gid_t *)(buf + len));
+    if (ngroups == -1) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    len += ngroups * sizeof(gid_t);
+
+    mask = umask(0);
+    umask(mask);
+
+    req->uid = getuid();
+    req->gid = getgid();
+    req->umask = mask;
+    req->ngroups = ngroups;
+    req->argc = 0;
+    req->envc = 0;
+
+    /* An empty path means that only the fd can be used. */
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+    if (!put_str(buf, sizeof(buf), &len, cwd))
+        goto too_big;
+    for (; argv[req->argc] != NULL; req->argc++) {
+        if (!put_str(buf, sizeof(buf), &len, argv[req->argc]))
+            goto too_big;
+    }
+    for (; envp[req->envc] != NULL; req->envc++) {
+        if (!put_str(buf, sizeof(buf), &len, envp[req->envc]))
+            goto too_big;
+    }
+
+    fds[0] = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (fds[0] == -1)
+        return -1;
+
+    /* Closed stdio fds are replaced with /dev/null. */
+    for (int i = 0; i < 3; i++) {
+        if (i != sock && fcntl(i, F_GETFD) != -1) {
+            fds[i+1] = i;
+            continue;
+        }
+        if (devnull == -1 && (devnull = open("/dev/null", O_RDWR|O_CLOEXEC)) == -1)
+            goto end;
+        fds[i+1] = devnull;
+    }
+
+    ret = proto_send(sock, PROTO_SPAWN, 0, buf, len, fds, SPAWN_FDS);
+
+end:
+    close(fds[0]);
+    if (devnull != -1)
+        close(devnull);
+    return ret;
+
+too_big:
+    errno = EMSGSIZE;
+    return -1;
+}
+
+static volatile pid_t spawn_pid = 0;
+static volatile int spawn_pidfd = -1;
+
+static void forward_signal(int sig)
+{
+    int saved_errno = errno;
+    if (spawn_pidfd != -1)
+        sys_pidfd_send_signal(spawn_pidfd, sig);
+    else if (spawn_pid > 0)
+        kill(spawn_pid, sig);
+    errno = saved_errno;
+}
+
+/* Waits for the spawned program to exit. Returns the exit code voidnsundo
+ * should exit with. */
+int spawn_wait(int sock)
+{
+    const int signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2,
+                           SIGWINCH};
+    struct proto_hdr hdr;
+    struct sigaction sa = {0};
+    int fds[PROTO_MAX_FDS];
+    int nfds;
+
+    if (proto_recv(sock, &hdr, NULL, 0, fds, &nfds, 0) == -1) {
+        ERROR("error: failed to get a reply from the server: %s.\n",
+              proto_strerror(errno));
+        return 1;
+    }
+    if (hdr.type == PROTO_ERROR) {
+        ERROR("error: server failed to spawn the program: %s.\n", strerror(hdr.value));
+        return 1;
+    }
+    if (hdr.type != PROTO_PID) {
+        ERROR("error: unexpected reply from the server.\n");
+        return 1;
+    }
+
+    spawn_pid = hdr.value;
+    if (nfds > 0)
+        spawn_pidfd = fds[0];
+    for (int i = 1; i < nfds; i++)
+        close(fds[i]);
+    DEBUG("%s: spawned pid %d\n", __func__, (int)hdr.value);
+
+    sa.sa_handler = forward_signal;
+    sa.sa_flags = SA_RESTART;
+    for (size_t i = 0; i < ARRAY_SIZE(signals); i++)
+        sigaction(signals[i], &sa, NULL);
+
+    if (proto_recv(sock, &hdr, NULL, 0, fds, &nfds, 0) == -1 || hdr.type != PROTO_EXIT) {
+        /* The server has gone away before the program exited, so its exit
+         * status is lost. Still wait for it, like a normal run would do. */
+        if (spawn_pidfd != -1) {
+            struct pollfd pfd = {.fd = spawn_pidfd, .events = POLLIN};
+            while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+                ;
+        }
+        ERROR("error: lost connection to the server, exit status is unknown.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+
+    if (WIFEXITED(hdr.value))
+        return WEXITSTATUS(hdr.value);
+
+    if (WIFSIGNALED(hdr.value)) {
+        /* Die the same way. */
+        int sig = WTERMSIG(hdr.value);
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return 128 + sig;
+    }
+
+    return 1;
+}
+
+/* Parses a PROTO_SPAWN payload. Pointers in s point into buf. */
+bool spawn_parse(char *buf, size_t len, struct spawn *s)
+{
+    char *p, *end = buf + len;
+
+    memset(s, 0, sizeof(*s));
+    if (len < sizeof(s->req))
+        return false;
+    memcpy(&s->req, buf, sizeof(s->req));
+
+    p = buf + sizeof(s->req);
+    if (s->req.ngroups > (size_t)(end - p) / sizeof(gid_t) || s->req.argc == 0)
+        return false;
+    s->groups = (const gid_t *)p;
+    p += s->req.ngroups * sizeof(gid_t);
+
+    /* Every string must be NUL-terminated within the buffer. */
+    size_t nstrings = 1 + (size_t)s->req.argc + s->req.envc;
+    if (nstrings > (size_t)(end - p))
+        return false;
+
+    s->argv = malloc(sizeof(char *) * (s->req.argc + 1));
+    s->envp = malloc(sizeof(char *) * (s->req.envc + 1));
+    if (s->argv == NULL || s->envp == NULL)
+        goto fail;
+
+    for (size_t i = 0; i < nstrings; i++) {
+        char *nul = memchr(p, '\0', end - p);
+        if (nul == NULL)
+            goto fail;
+        if (i == 0)
+            s->cwd = p;
+        else if (i <= s->req.argc)
+            s->argv[i - 1] = p;
+        else
+            s->envp[i - 1 - s->req.argc] = p;
+        p = nul + 1;
+    }
+    s->argv[s->req.argc] = NULL;
+    s->envp[s->req.envc] = NULL;
+    return true;
+
+fail:
+    spawn_free(s);
+    return false;
+}
+
+void spawn_free(struct spawn *s)
+{
+    free(s->argv);
+    free(s->envp);
+    s->argv = NULL;
+    s->envp = NULL;
+}
+
+/* This runs in the forked child of the server. Returns only if the program
+ * couldn't be started, with the exit status for that. */
+static int spawn_exec(const struct spawn *s, int nsfd, int rootfd, const int *fds)
+{
+    extern char **environ;
+    sigset_t mask;
+    int fd[SPAWN_FDS];
+
+    /* Undo what the server has set up for itself. */
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGINT, SIG_DFL);
+    setsid();
+
+    /* Move the fds out of the way before putting them into place, in case
+     * some of them are 0, 1 or 2. Errors go to the client's stderr from now
+     * on. */
+    for (int i = 0; i < SPAWN_FDS; i++) {
+        fd[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+        if (fd[i] == -1)
+            return 126;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fd[i+1], i) == -1)
+            return 126;
+    }
+
+    if (setns(nsfd, CLONE_NEWNS) == -1) {
+        ERROR("setns: %s.\n", strerror(errno));
+        return 126;
+    }
+    if (rootfd != -1 && !enter_root(rootfd)) {
+        ERROR("error: failed to change root: %s.\n", strerror(errno));
+        return 126;
+    }
+
+    if (setgroups(s->req.ngroups, s->groups) == -1) {
+        ERROR("setgroups: %s\n", strerror(errno));
+        return 126;
+    }
+    if (setresgid(s->req.gid, s->req.gid, s->req.gid) == -1) {
+        ERROR("setresgid: %s\n", strerror(errno));
+        return 126;
+    }
+    if (setresuid(s->req.uid, s->req.uid, s->req.uid) == -1) {
+        ERROR("setresuid: %s\n", strerror(errno));
+        return 126;
+    }
+    umask(s->req.umask);
+
+    /* Resolve the path in this namespace, like voidnsundo does, but if it
+     * doesn't lead to the same directory, use the fd. */
+    enter_cwd(s->cwd, fd[0]);
+
+    /* Don't leak anything of the server to the program. */
+    syscall(__NR_close_range, 3, ~0U, 0);
+
+    environ = s->envp;
+    execvp(s->argv[0], s->argv);
+    ERROR("execvp(%s): %s\n", s->argv[0], strerror(errno));
+    return errno == ENOENT ? 127 : 126;
+}
+
+/* Starts the program in the namespace of nsfd, chrooted to rootfd if it's not
+ * -1. Returns its pid, or -1. If the program can't be started, the child adds
+ * one to *failed, which must be in memory shared with the caller, or NULL. */
+pid_t spawn_start(const struct spawn *s, int nsfd, int rootfd, const int *fds,
+                  uint64_t *failed)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        int status = spawn_exec(s, nsfd, rootfd, fds);
+        if (failed != NULL)
+            __atomic_fetch_add(failed, 1, __ATOMIC_RELAXED);
+        _exit(status);
+    }
+    return pid;
+}
@@ -0,0 +1,47 @@
+#ifndef VOIDNSRUN_SPAWN_H
+#define VOIDNSRUN_SPAWN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Payload of a PROTO_SPAWN request. It's followed by ngroups gids and then by
+ * NUL-terminated strings: the working directory, argc arguments and envc
+ * environment variables.
+ *
+ * The attached fds are the working directory (an O_PATH fd), stdin, stdout
+ * and stderr, in this order.
+ */
+struct spawn_request {
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t umask;
+    uint32_t ngroups;
+    uint32_t argc;
+    uint32_t envc;
+};
+
+#define SPAWN_FDS 4
+
+struct spawn {
+    struct spawn_request req;
+    const gid_t *groups;
+    const char *cwd;
+    char **argv;
+    char **envp;
+};
+
+/* Client side. */
+ssize_t spawn_send(int sock, char *const argv[], char *const envp[]);
+int spawn_wait(int sock);
+
+/* Server side. */
+bool spawn_parse(char *buf, size_t len, struct spawn *s);
+void spawn_free(struct spawn *s);
+pid_t spawn_start(const struct spawn *s, int nsfd, int rootfd, const int *fds,
+                  uint64_t *failed);
+
+int sys_pidfd_open(pid_t pid, unsigned int flags);
+
+#endif //VOIDNSRUN_SPAWN_H
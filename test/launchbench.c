@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+
+/*
+ * Launch latency benchmark.
+ *
+ * Builds a throwaway container on tmpfs (its /usr is a bind mount of the host
+ * /usr, so that programs can run in it) and measures:
+ *
+ *   run    - voidnsrun launching /bin/true, from fork to exit.
+ *   run-u  - the same, but with -u mounts of voidnsundo instead of -m mounts.
+ *   direct - /usr/bin/true run directly, inside the namespace. This is the
+ *            baseline for the modes below.
+ *   undo   - voidnsundo /bin/true round trip, inside the namespace.
+ *   bind   - /usr/bin/true bind mounted to voidnsundo, inside the namespace.
+ *   spawn  - voidnsundo -S /bin/true round trip, inside the namespace.
+ *
+ * Each of them is measured with a different number of -m (or -u) mounts. When strace
+ * is available, syscalls of one launch are counted, too.
+ *
+ * Must be run as root, as it mounts things. Everything is mounted in a
+ * private mount namespace and goes away when the benchmark exits.
+ */
+
+#define ERROR(f_, ...) fprintf(stderr, (f_), ##__VA_ARGS__)
+#define ERROR_EXIT(f_, ...) { \
+        fprintf(stderr, (f_), ##__VA_ARGS__); \
+        return 1; \
+    }
+
+#define DEFAULT_RUNS 50
+#define DEFAULT_MOUNTS "0,10,50,500,1000"
+
+enum scenario {
+    SCENARIO_RUN,
+    SCENARIO_RUN_U,
+    SCENARIO_DIRECT,
+    SCENARIO_UNDO,
+    SCENARIO_BIND,
+    SCENARIO_SPAWN,
+};
+
+const char *scenario_names[] = {"run", "run-u", "direct", "undo", "bind", "spawn"};
+
+char fixture[] = "/tmp/voidnsrun-bench.XXXXXX";
+char self_path[PATH_MAX];
+
+double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Runs argv, optionally with stdout redirected to out_fd, and waits for it.
+ * Returns its exit status, or -1. */
+int run(char **argv, int out_fd, int quiet)
+{
+    int status;
+    pid_t pid = fork();
+    if (pid == -1)
+        return -1;
+
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(out_fd != -1 ? out_fd : devnull, STDOUT_FILENO);
+        if (quiet)
+            dup2(devnull, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) == -1)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, size_t n, double q)
+{
+    size_t i = (size_t)(q * n + 0.999999);
+    if (i == 0)
+        i = 1;
+    if (i > n)
+        i = n;
+    return sorted[i - 1];
+}
+
+int mkdirs(const char *path, mode_t mode)
+{
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(buf, mode) == -1 && errno != EEXIST)
+                return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir(buf, mode) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+int copy_file(const char *from, const char *to, mode_t mode)
+{
+    char buf[65536];
+    ssize_t n;
+    int in, out, ret = -1;
+
+    if ((in = open(from, O_RDONLY)) == -1)
+        return -1;
+    if ((out = open(to, O_WRONLY|O_CREAT|O_TRUNC, mode)) == -1) {
+        close(in);
+        return -1;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n)
+            goto end;
+    }
+    if (n == 0 && fchmod(out, mode) == 0)
+        ret = 0;
+end:
+    close(in);
+    close(out);
+    return ret;
+}
+
+/*
+ * Fixture layout:
+ *   T/c          - container
+ *   T/c/usr      - bind mount of the host /usr
+ *   T/m/<i>      - mountpoints for -m
+ *   T/u/<i>      - mountpoints for -u
+ *   T/c/T/m/<i>  - their sources in the container
+ *   T/bin/voidnsundo, T/c/T/bin/voidnsundo - copies of voidnsundo
+ */
+int fixture_setup(const char *undo_src, int max_mounts)
+{
+    char path[PATH_MAX];
+
+    if (mkdtemp(fixture) == NULL)
+        ERROR_EXIT("mkdtemp: %s\n", strerror(errno));
+
+    if (unshare(CLONE_NEWNS) == -1)
+        ERROR_EXIT("unshare: %s\n", strerror(errno));
+    if (mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL) == -1)
+        ERROR_EXIT("mount: failed to make / private: %s\n", strerror(errno));
+    if (mount("tmpfs", fixture, "tmpfs", 0, "mode=0755") == -1)
+        ERROR_EXIT("mount: failed to mount tmpfs: %s\n", strerror(errno));
+
+    snprintf(path, sizeof(path), "%s/c/usr", fixture);
+    if (mkdirs(path, 0755) == -1)
+        ERROR_EXIT("mkdir(%s): %s\n", path, strerror(errno));
+    if (mount("/usr", path, NULL, MS_BIND|MS_REC, NULL) == -1)
+        ERROR_EXIT("mount: failed to bind /usr: %s\n", strerror(errno));
+
+    for (int i = 0; i < max_mounts; i++) {
+        snprintf(path, sizeof(path), "%s/m/%d", fixture, i);
+        if (mkdirs(path, 0755) == -1)
+            ERROR_EXIT("mkdir(%s): %s\n", path, strerror(errno));
+        snprintf(path, sizeof(path), "%s/c%s/m/%d", fixture, fixture, i);
+        if (mkdirs(path, 0755) == -1)
+            ERROR_EXIT("mkdir(%s): %s\n", path, strerror(errno));
+    }
+
+    snprintf(path, sizeof(path), "%s/u", fixture);
+    mkdirs(path, 0755);
+    for (int i = 0; i < max_mounts; i++) {
+        snprintf(path, sizeof(path), "%s/u/%d", fixture, i);
+        int fd = open(path, O_WRONLY|O_CREAT, 0755);
+        if (fd == -1)
+            ERROR_EXIT("open(%s): %s\n", path, strerror(errno));
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "%s/bin", fixture);
+    mkdirs(path, 0755);
+    snprintf(path, sizeof(path), "%s/bin/voidnsundo", fixture);
+    if (copy_file(undo_src, path, 04755) == -1)
+        ERROR_EXIT("failed to copy %s: %s\n", undo_src, strerror(errno));
+
+    snprintf(path, sizeof(path), "%s/c%s/bin", fixture, fixture);
+    mkdirs(path, 0755);
+    snprintf(path, sizeof(path), "%s/c%s/bin/voidnsundo", fixture, fixture);
+    if (copy_file(undo_src, path, 04755) == -1)
+        ERROR_EXIT("failed to copy %s: %s\n", undo_src, strerror(errno));
+
+    return 0;
+}
+
+void fixture_teardown(void)
+{
+    umount2(fixture, MNT_DETACH);
+    rmdir(fixture);
+}
+
+/* Builds the voidnsrun command line for a scenario. The returned array and
+ * its strings are leaked, the benchmark is short-lived. */
+char **build_argv(const char *voidnsrun, enum scenario sc, int mounts,
+                  int inner_runs, const char *strace_out)
+{
+    char **argv = calloc(2 * mounts + 32, sizeof(char *));
+    char buf[PATH_MAX];
+    int n = 0;
+
+    if (strace_out) {
+        argv[n++] = "strace";
+        argv[n++] = "-f";
+        argv[n++] = "-c";
+        argv[n++] = "-o";
+        argv[n++] = (char *)strace_out;
+    }
+
+    argv[n++] = (char *)voidnsrun;
+    argv[n++] = "-r";
+    snprintf(buf, sizeof(buf), "%s/c", fixture);
+    argv[n++] = strdup(buf);
+
+    for (int i = 0; i < mounts; i++) {
+        argv[n++] = sc == SCENARIO_RUN_U ? "-u" : "-m";
+        snprintf(buf, sizeof(buf), "%s/%c/%d", fixture,
+                 sc == SCENARIO_RUN_U ? 'u' : 'm', i);
+        argv[n++] = strdup(buf);
+    }
+
+    if (sc == SCENARIO_BIND || sc == SCENARIO_RUN_U) {
+        argv[n++] = "-U";
+        snprintf(buf, sizeof(buf), "%s/bin/voidnsundo", fixture);
+        argv[n++] = strdup(buf);
+    }
+    if (sc == SCENARIO_BIND) {
+        argv[n++] = "-u";
+        argv[n++] = "/usr/bin/true";
+    }
+
+    argv[n++] = "--";
+    if (sc == SCENARIO_RUN || sc == SCENARIO_RUN_U) {
+        argv[n++] = "/bin/true";
+        return argv;
+    }
+
+    snprintf(buf, sizeof(buf), "%d", inner_runs);
+    argv[n++] = self_path;
+    argv[n++] = "--inner";
+    argv[n++] = strdup(buf);
+    if (sc == SCENARIO_UNDO || sc == SCENARIO_SPAWN) {
+        snprintf(buf, sizeof(buf), "%s/bin/voidnsundo", fixture);
+        argv[n++] = strdup(buf);
+        if (sc == SCENARIO_SPAWN)
+            argv[n++] = "-S";
+        argv[n++] = "/bin/true";
+    } else {
+        argv[n++] = "/usr/bin/true";
+    }
+    return argv;
+}
+
+/* Inner mode: runs the command n times and prints each latency in ms. */
+int inner(int n, char **argv)
+{
+    for (int i = 0; i < n; i++) {
+        double start = now_ms();
+        int ret = run(argv, -1, 0);
+        if (ret != 0)
+            ERROR_EXIT("%s exited with %d\n", argv[0], ret);
+        printf("%f\n", now_ms() - start);
+    }
+    return 0;
+}
+
+/* Collects latencies of a scenario into samples. Returns the number of
+ * samples, or -1 on failure. Output of the launched programs is suppressed,
+ * so on failure the scenario is run once more to show what went wrong. */
+int measure(const char *voidnsrun, enum scenario sc, int mounts, int runs,
+            double *samples)
+{
+    char tmp[] = "/tmp/voidnsrun-bench-out.XXXXXX";
+    char **argv;
+    int count = 0;
+    int ret;
+
+    if (sc == SCENARIO_RUN || sc == SCENARIO_RUN_U) {
+        argv = build_argv(voidnsrun, sc, mounts, 0, NULL);
+        for (ret = 0; count < runs && ret == 0; count++) {
+            double start = now_ms();
+            ret = run(argv, -1, 1);
+            samples[count] = now_ms() - start;
+        }
+        if (ret != 0)
+            run(argv, -1, 0);
+        free(argv);
+        return ret == 0 ? count : -1;
+    }
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return -1;
+    unlink(tmp);
+
+    argv = build_argv(voidnsrun, sc, mounts, runs, NULL);
+    ret = run(argv, fd, 1);
+    free(argv);
+
+    if (ret == 0) {
+        FILE *f = fdopen(dup(fd), "r");
+        rewind(f);
+        while (count < runs && fscanf(f, "%lf", &samples[count]) == 1)
+            count++;
+        fclose(f);
+    } else {
+        argv = build_argv(voidnsrun, sc, mounts, 1, NULL);
+        run(argv, -1, 0);
+        free(argv);
+    }
+    close(fd);
+    return ret == 0 ? count : -1;
+}
+
+/* Runs a scenario once under strace -c and gets the total number of syscalls
+ * and failed syscalls. Returns 0 if strace is not available. */
+int count_syscalls(const char *voidnsrun, enum scenario sc, int mounts,
+                   long *calls, long *errors)
+{
+    char tmp[] = "/tmp/voidnsrun-bench-strace.XXXXXX";
+    char line[256];
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return 0;
+    close(fd);
+
+    char **argv = build_argv(voidnsrun, sc, mounts, 1, tmp);
+    int ret = run(argv, -1, 1);
+    free(argv);
+
+    int found = 0;
+    FILE *f = fopen(tmp, "r");
+    if (ret == 0 && f) {
+        while (fgets(line, sizeof(line), f)) {
+            char *tokens[8];
+            int n = 0;
+            for (char *t = strtok(line, " \t\n"); t && n < 8; t = strtok(NULL, " \t\n"))
+                tokens[n++] = t;
+            if (n >= 5 && !strcmp(tokens[n-1], "total")) {
+                *calls = atol(tokens[3]);
+                *errors = n == 6 ? atol(tokens[4]) : 0;
+                found = 1;
+            }
+        }
+    }
+    if (f)
+        fclose(f);
+    unlink(tmp);
+    return found;
+}
+
+void usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS] VOIDNSRUN VOIDNSUNDO\n", progname);
+    printf("\n"
+           "Options:\n"
+           "    -n <runs>:   Number of runs per scenario. Default is %d.\n"
+           "    -m <list>:   Comma separated list of mount counts.\n"
+           "                 Default is " DEFAULT_MOUNTS ".\n"
+           "    -h:          Print this help.\n",
+           DEFAULT_RUNS);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = DEFAULT_RUNS;
+    char *mounts_arg = DEFAULT_MOUNTS;
+    int mount_counts[32];
+    int n_counts = 0, max_mounts = 0;
+    int c;
+
+    if (argc > 2 && !strcmp(argv[1], "--inner"))
+        return inner(atoi(argv[2]), argv + 3);
+
+    while ((c = getopt(argc, argv, "n:m:h")) != -1) {
+        switch (c) {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'm':
+            mounts_arg = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2 || runs <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (geteuid() != 0)
+        ERROR_EXIT("error: the benchmark must be run as root.\n");
+
+    char *list = strdup(mounts_arg);
+    for (char *t = strtok(list, ","); t && n_counts < 32; t = strtok(NULL, ",")) {
+        mount_counts[n_counts] = atoi(t);
+        if (mount_counts[n_counts] > max_mounts)
+            max_mounts = mount_counts[n_counts];
+        n_counts++;
+    }
+    free(list);
+
+    char voidnsrun[PATH_MAX], voidnsundo[PATH_MAX];
+    if (!realpath(argv[optind], voidnsrun) || !realpath(argv[optind+1], voidnsundo))
+        ERROR_EXIT("error: can't resolve paths of the binaries.\n");
+    if (!realpath("/proc/self/exe", self_path))
+        ERROR_EXIT("error: can't resolve own path.\n");
+
+    if (fixture_setup(voidnsundo, max_mounts) != 0) {
+        fixture_teardown();
+        return 1;
+    }
+
+    double *samples = malloc(sizeof(double) * runs);
+    int exit_code = 0;
+
+    printf("%-6s %7s %6s %10s %10s %10s %10s\n",
+           "mode", "mounts", "runs", "p50 ms", "p99 ms", "syscalls", "failed");
+    for (int sc = SCENARIO_RUN; sc <= SCENARIO_SPAWN; sc++) {
+        for (int i = 0; i < n_counts; i++) {
+            int mounts = mount_counts[i];
+            int n = measure(voidnsrun, sc, mounts, runs, samples);
+            if (n <= 0) {
+                printf("%-6s %7d %6s %10s %10s %10s %10s\n",
+                       scenario_names[sc], mounts, "-", "failed", "-", "-", "-");
+                exit_code = 1;
+                continue;
+            }
+            qsort(samples, n, sizeof(double), cmp_double);
+
+            long calls, errors;
+            char calls_buf[32] = "n/a", errors_buf[32] = "n/a";
+            if (count_syscalls(voidnsrun, sc, mounts, &calls, &errors)) {
+                snprintf(calls_buf, sizeof(calls_buf), "%ld", calls);
+                snprintf(errors_buf, sizeof(errors_buf), "%ld", errors);
+            }
+
+            printf("%-6s %7d %6d %10.3f %10.3f %10s %10s\n",
+                   scenario_names[sc], mounts, n,
+                   percentile(samples, n, 0.5), percentile(samples, n, 0.99),
+                   calls_buf, errors_buf);
+            fflush(stdout);
+        }
+    }
+
+    free(samples);
+    fixture_teardown();
+    return exit_code;
+}
@@ -1,38 +1,395 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <linux/limits.h>
 #include "utils.h"
+#include "proto.h"
 
+/*
+ * Client for testserver.
+ *
+ * Without options, gets the namespace fd from the server once and prints its
+ * inode. With any of the options below, it's a load generator: it runs M
+ * client processes that get the namespace fd as fast as they can, for a
+ * number of requests or seconds, and reports throughput and handoff latency.
+ * It does that for each of the ways to get the fd of another process:
+ *
+ *   scm   - PROTO_NSFD request to the server, the fd comes with SCM_RIGHTS.
+ *           This is what voidnsundo does.
+ *   pidfd - pidfd_open() of the server and pidfd_getfd() of its nsfd.
+ *   proc  - open() of /proc/<server pid>/ns/mnt.
+ *
+ * Every handoff is checked to be the right namespace. Before and after each
+ * method, and after a second of idling, fds and CPU time of the server are
+ * read from /proc, so that fd leaks and busy loops in the server are caught.
+ * The exit code is 1 if anything has failed or leaked.
+ *
+ * Run it through testserver: ./testserver ./testclient -c 16 -d 10
+ */
+
+#define ERROR(f_, ...) fprintf(stderr, (f_), ##__VA_ARGS__)
 #define ERROR_EXIT(f_, ...) { \
         fprintf(stderr, (f_), ##__VA_ARGS__); \
         return 1; \
     }
 
-int main()
+#define SOCK_NAME "/tmp/voidnsrun-test.sock"
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_SECONDS 5
+#define MAX_CLIENTS 1024
+
+/* Latencies are kept in ns, in a shared mapping that is only touched as far
+ * as it's used. */
+#define MAX_SAMPLES (1 << 22)
+
+/* The server may use at most this much CPU while idle, in ms per second. */
+#define IDLE_CPU_MAX 10
+
+enum method {
+    METHOD_SCM,
+    METHOD_PIDFD,
+    METHOD_PROC,
+};
+
+const char *method_names[] = {"scm", "pidfd", "proc"};
+
+struct server_stats {
+    int fds;
+    double cpu_ms;
+};
+
+bool g_verbose = false;
+
+pid_t server_pid;
+int server_nsfd = -1;
+ino_t ns_ino;
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int sock_connect(void)
 {
     struct sockaddr_un addr = {0};
     int sock;
 
-    // Create and connect a unix domain socket
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
     if (sock == -1)
-        ERROR_EXIT("socket: %s\n", strerror(errno));
+        return -1;
 
-    addr.sun_family  = AF_UNIX;
-    strcpy(&addr.sun_path[1], "/tmp/voidnsrun-test.sock");
+    addr.sun_family = AF_UNIX;
+    strcpy(&addr.sun_path[1], SOCK_NAME);
 
-    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
-        ERROR_EXIT("connect: %s\n", strerror(errno));
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int get_nsfd_scm(void)
+{
+    struct proto_hdr hdr;
+    int fds[PROTO_MAX_FDS];
+    int nfds = 0;
+    int sock = sock_connect();
+    if (sock == -1)
+        return -1;
 
-    int fd = recv_fd(sock);
+    if (proto_send(sock, PROTO_NSFD, 0, NULL, 0, NULL, 0) == -1
+            || proto_recv(sock, &hdr, NULL, 0, fds, &nfds, 0) == -1) {
+        close(sock);
+        return -1;
+    }
     close(sock);
 
-    assert(fd != 0);
+    for (int i = 1; i < nfds; i++)
+        close(fds[i]);
+    if (hdr.type != PROTO_NSFD || nfds < 1) {
+        if (nfds > 0)
+            close(fds[0]);
+        errno = EPROTO;
+        return -1;
+    }
+    return fds[0];
+}
+
+int get_nsfd_pidfd(void)
+{
+    int pidfd, fd;
+
+    pidfd = syscall(SYS_pidfd_open, server_pid, 0);
+    if (pidfd == -1)
+        return -1;
+    fd = syscall(SYS_pidfd_getfd, pidfd, server_nsfd, 0);
+    close(pidfd);
+    return fd;
+}
+
+int get_nsfd_proc(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", server_pid);
+    return open(path, O_RDONLY|O_CLOEXEC);
+}
+
+int get_nsfd(enum method m)
+{
+    switch (m) {
+    case METHOD_SCM:
+        return get_nsfd_scm();
+    case METHOD_PIDFD:
+        return get_nsfd_pidfd();
+    case METHOD_PROC:
+        return get_nsfd_proc();
+    }
+    return -1;
+}
+
+/* Finds the server's pid from the socket, and the number of its nsfd in
+ * /proc/<pid>/fd for pidfd_getfd(). */
+int server_find(void)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    char path[PATH_MAX], link[64], expected[64];
+    struct stat st;
+    DIR *dir;
+    struct dirent *de;
+    int sock;
+
+    if (stat("/proc/self/ns/mnt", &st) == -1)
+        ERROR_EXIT("stat: %s\n", strerror(errno));
+    ns_ino = st.st_ino;
+    snprintf(expected, sizeof(expected), "mnt:[%lu]", (unsigned long)ns_ino);
+
+    sock = sock_connect();
+    if (sock == -1)
+        ERROR_EXIT("connect: %s\n", strerror(errno));
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        ERROR_EXIT("getsockopt: %s\n", strerror(errno));
+    close(sock);
+    server_pid = cred.pid;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", server_pid);
+    dir = opendir(path);
+    if (!dir)
+        ERROR_EXIT("opendir(%s): %s\n", path, strerror(errno));
+    while ((de = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%s", server_pid, de->d_name);
+        ssize_t n = readlink(path, link, sizeof(link) - 1);
+        if (n == -1)
+            continue;
+        link[n] = '\0';
+        if (!strcmp(link, expected)) {
+            server_nsfd = atoi(de->d_name);
+            break;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+/* Reads the number of open fds and the CPU time of the server. */
+int server_stats(struct server_stats *s)
+{
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+    DIR *dir;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", server_pid);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    s->fds = 0;
+    while (readdir(dir) != NULL)
+        s->fds++;
+    closedir(dir);
+    s->fds -= 2;
+
+    /* utime and stime are fields 14 and 15, after the command in parens,
+     * which may contain spaces. */
+    snprintf(path, sizeof(path), "/proc/%d/stat", server_pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    char *p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!p || !(p = strrchr(buf, ')')))
+        return -1;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+        return -1;
+    s->cpu_ms = (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+    return 0;
+}
+
+/* One client process. Writes latencies to samples and returns the number of
+ * failed handoffs as the exit code (capped). */
+int client(enum method m, long requests, uint64_t deadline,
+           uint64_t *samples, long *count)
+{
+    int errors = 0;
+    struct stat st;
+
+    for (long i = 0; i < requests && i < MAX_SAMPLES; i++) {
+        if (deadline && now_ns() >= deadline)
+            break;
+
+        uint64_t t = now_ns();
+        int fd = get_nsfd(m);
+        uint64_t elapsed = now_ns() - t;
+
+        if (fd == -1) {
+            if (errors++ == 0)
+                ERROR("%s: %s\n", method_names[m], strerror(errno));
+            continue;
+        }
+        if (fstat(fd, &st) == -1 || st.st_ino != ns_ino) {
+            if (errors++ == 0)
+                ERROR("%s: got the wrong fd\n", method_names[m]);
+        }
+        close(fd);
+
+        samples[(*count)++] = elapsed;
+    }
+    return errors > 255 ? 255 : errors;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile_us(uint64_t *sorted, size_t n, double q)
+{
+    size_t i = (size_t)(q * n + 0.999999);
+    if (i == 0)
+        i = 1;
+    if (i > n)
+        i = n;
+    return sorted[i - 1] / 1000.0;
+}
+
+/* Runs the clients with one method and prints a line of results. Returns 0
+ * if there were no errors and no leaks. */
+int load(enum method m, int clients, long requests, int seconds)
+{
+    size_t size = sizeof(uint64_t) * MAX_SAMPLES * clients;
+    uint64_t *samples;
+    long *counts;
+    struct server_stats before, after, idle;
+    long errors = 0;
+    size_t n = 0;
+    uint64_t t, deadline = 0;
+    int ret = 0;
+
+    samples = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    counts = mmap(NULL, sizeof(long) * clients, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED || counts == MAP_FAILED)
+        ERROR_EXIT("mmap: %s\n", strerror(errno));
+
+    if (server_stats(&before) == -1)
+        ERROR_EXIT("error: can't read stats of the server.\n");
+
+    t = now_ns();
+    if (seconds)
+        deadline = t + (uint64_t)seconds * 1000000000ULL;
+
+    for (int i = 0; i < clients; i++) {
+        long share = requests / clients + (i < requests % clients);
+        pid_t pid = fork();
+        if (pid == -1)
+            ERROR_EXIT("fork: %s\n", strerror(errno));
+        if (pid == 0)
+            _exit(client(m, share, deadline, samples + (size_t)i * MAX_SAMPLES,
+                         &counts[i]));
+    }
+
+    for (int i = 0; i < clients; i++) {
+        int status;
+        if (wait(&status) == -1)
+            break;
+        if (!WIFEXITED(status))
+            errors++;
+        else
+            errors += WEXITSTATUS(status);
+    }
+    t = now_ns() - t;
+
+    /* The server may not have seen the last clients go yet, so fds are
+     * compared after idling. */
+    if (server_stats(&after) == -1)
+        ERROR_EXIT("error: can't read stats of the server.\n");
+    sleep(1);
+    if (server_stats(&idle) == -1)
+        ERROR_EXIT("error: can't read stats of the server.\n");
+
+    /* Put all samples together. */
+    for (int i = 0; i < clients; i++) {
+        memmove(samples + n, samples + (size_t)i * MAX_SAMPLES,
+                counts[i] * sizeof(uint64_t));
+        n += counts[i];
+    }
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+
+    if (n == 0) {
+        printf("%-6s %9s %7ld\n", method_names[m], "-", errors);
+        ret = 1;
+    } else {
+        printf("%-6s %9zu %7ld %10.0f %9.1f %9.1f %9.1f %9.1f %6d %6d %9.1f %7.1f\n",
+               method_names[m], n, errors, n / (t / 1e9),
+               percentile_us(samples, n, 0.5), percentile_us(samples, n, 0.99),
+               percentile_us(samples, n, 0.999), samples[n - 1] / 1000.0,
+               before.fds, idle.fds, after.cpu_ms - before.cpu_ms,
+               idle.cpu_ms - after.cpu_ms);
+    }
+    fflush(stdout);
+
+    if (errors)
+        ret = 1;
+    if (idle.fds > before.fds) {
+        ERROR("error: the server leaks fds: %d before, %d after.\n",
+              before.fds, idle.fds);
+        ret = 1;
+    }
+    if (idle.cpu_ms - after.cpu_ms > IDLE_CPU_MAX) {
+        ERROR("error: the server is busy while idle: %.1f ms of CPU in 1 s.\n",
+              idle.cpu_ms - after.cpu_ms);
+        ret = 1;
+    }
+
+    munmap(samples, size);
+    munmap(counts, sizeof(long) * clients);
+    return ret;
+}
+
+int single(void)
+{
+    int fd = get_nsfd_scm();
+    if (fd == -1)
+        ERROR_EXIT("error: failed to get nsfd: %s\n", strerror(errno));
 
     struct stat st;
     if (fstat(fd, &st) == -1)
@@ -41,4 +398,88 @@ int main()
     printf("st_ino: %lu\n", st.st_ino);
 
     return 0;
-}
\ No newline at end of file
+}
+
+void usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS]\n", progname);
+    printf("\n"
+           "Options:\n"
+           "    -c <clients>: Number of concurrent clients. Default is %d.\n"
+           "    -d <seconds>: Run each method for this long. Default is %d.\n"
+           "    -n <count>:   Or make this many requests with each method.\n"
+           "    -m <method>:  scm, pidfd, proc or all. Default is all.\n"
+           "    -h:           Print this help.\n",
+           DEFAULT_CLIENTS, DEFAULT_SECONDS);
+}
+
+int main(int argc, char **argv)
+{
+    int clients = DEFAULT_CLIENTS;
+    int seconds = 0;
+    long requests = 0;
+    int method = -1;
+    int exit_code = 0;
+    int c;
+
+    if (argc == 1)
+        return single();
+
+    while ((c = getopt(argc, argv, "c:d:n:m:h")) != -1) {
+        switch (c) {
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "all"))
+                break;
+            for (method = METHOD_PROC; method >= 0; method--) {
+                if (!strcmp(optarg, method_names[method]))
+                    break;
+            }
+            if (method == -1)
+                ERROR_EXIT("error: unknown method %s.\n", optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            return 1;
+        }
+    }
+
+    if (clients <= 0 || clients > MAX_CLIENTS || seconds < 0 || requests < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!seconds && !requests)
+        seconds = DEFAULT_SECONDS;
+    if (!requests)
+        requests = (long)MAX_SAMPLES * clients;
+
+    if (server_find() != 0)
+        return 1;
+
+    printf("server pid %d, nsfd %d, %d clients\n", server_pid, server_nsfd, clients);
+    printf("%-6s %9s %7s %10s %9s %9s %9s %9s %6s %6s %9s %7s\n",
+           "method", "requests", "errors", "req/s", "p50 us", "p99 us",
+           "p999 us", "max us", "fds", "fds+", "cpu ms", "idle");
+    for (int m = METHOD_SCM; m <= METHOD_PROC; m++) {
+        if (method != -1 && m != method)
+            continue;
+        if (m == METHOD_PIDFD && server_nsfd == -1) {
+            printf("%-6s %9s\n", method_names[m], "no nsfd");
+            continue;
+        }
+        if (load(m, clients, requests, seconds) != 0)
+            exit_code = 1;
+    }
+
+    return exit_code;
+}
@@ -5,10 +5,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/prctl.h>
 #include "utils.h"
+#include "server.h"
 
 #define ERROR(f_, ...) fprintf(stderr, (f_), ##__VA_ARGS__)
 #define UNUSED(x)      (void)(x)
@@ -17,18 +19,14 @@
         return 1; \
     }
 
-volatile sig_atomic_t term_caught = 0;
-void onterm(int sig)
-{
-    printf("sigterm caught\n");
-    UNUSED(sig);
-    term_caught = 1;
-}
+bool g_verbose = true;
 
-int main()
+/* Serves the namespace fd on an abstract socket and runs a program, /bin/sh
+ * by default, while the server is there. testclient connects to it. */
+int main(int argc, char **argv)
 {
     int result;
-    int sock_fd, sock_conn;
+    int sock_fd;
     int nsfd;
 
     /* Get current namespace's file descriptor. */
@@ -44,10 +42,11 @@ int main()
         ERROR_EXIT("fork: %s\n", strerror(errno));
 
     if (pid == 0) {
-        /* Catch SIGTERM. */
-        struct sigaction sa = {0};
-        sa.sa_handler = onterm;
-        sigaction(SIGTERM, &sa, NULL);
+        /* Block SIGTERM, the server reads it from a signalfd. */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
 
         /* Ignore SIGINT. */
         signal(SIGINT, SIG_IGN);
@@ -60,34 +59,28 @@ int main()
             ERROR_EXIT("error: parent has died already.\n");
 
         /* Create unix socket. */
-        sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (sock_fd == -1)
-            ERROR_EXIT("socket: %s.\n", strerror(errno));
-
         struct sockaddr_un sock_addr = {0};
         sock_addr.sun_family = AF_UNIX;
         strcpy(&sock_addr.sun_path[1], "/tmp/voidnsrun-test.sock");
 
-        if (bind(sock_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) == -1)
-            ERROR_EXIT("bind: %s\n", strerror(errno));
+        sock_fd = server_listen(&sock_addr);
+        if (sock_fd == -1)
+            return 1;
 
-        listen(sock_fd, 1);
+        struct server_config config = {.nsfd = nsfd, .rootfd = -1};
+        if (server_run(sock_fd, &config) == -1)
+            return 1;
 
-        while (!term_caught) {
-            sock_conn = accept(sock_fd, NULL, 0);
-            if (sock_conn == -1) {
-                ERROR("accept: %s\n", strerror(errno));
-                continue;
-            }
-            printf("accepted\n");
-            send_fd(sock_conn, nsfd);
-        }
         printf("exiting\n");
     } else {
         /* This is parent. Launch a program. */
-        char *argv[2] = {"/bin/sh", NULL};
+        char *sh[2] = {"/bin/sh", NULL};
+        char **prog = argc > 1 ? argv + 1 : sh;
+
+        /* Give the server a moment to start listening. */
+        usleep(100000);
 
-        result = execvp(argv[0], (char *const *)argv);
+        result = execvp(prog[0], (char *const *)prog);
         if (result == -1)
             ERROR_EXIT("execvp: %s\n", strerror(errno));
     }
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "trace.h"
+
+/*
+ * Startup phase timing. Each phase is written as one JSON line:
+ *
+ *   {"prog":"voidnsrun","pid":123,"phase":"mount","detail":"/usr",
+ *    "start_ns":4567,"duration_ns":890}
+ *
+ * Timestamps come from CLOCK_MONOTONIC. Every line is written with a single
+ * write() call, so lines from different processes sharing the fd don't mix.
+ */
+
+static int trace_fd = -1;
+static const char *trace_prog = NULL;
+
+void trace_setup(const char *prog, bool to_stderr)
+{
+    const char *env = getenv(TRACE_VAR);
+    int fd;
+
+    trace_prog = prog;
+    if (to_stderr)
+        trace_fd = STDERR_FILENO;
+    else if (env && parse_posint(env, &fd) && fcntl(fd, F_GETFD) != -1)
+        trace_fd = fd;
+}
+
+bool trace_enabled(void)
+{
+    return trace_fd != -1;
+}
+
+/* The fd the trace goes to, or -1. */
+int trace_fileno(void)
+{
+    return trace_fd;
+}
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t json_escape(char *buf, size_t size, const char *s)
+{
+    size_t n = 0;
+    for (; *s && n + 7 < size; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(buf + n, size - n, "\\u%04x", c);
+        } else
+            buf[n++] = c;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+void trace_phase(const char *phase, uint64_t start, const char *detail)
+{
+    char line[PATH_MAX + 256];
+    char escaped[PATH_MAX];
+    uint64_t end;
+    int len;
+
+    if (trace_fd == -1)
+        return;
+
+    end = trace_now();
+    json_escape(escaped, sizeof(escaped), detail ? detail : "");
+    len = snprintf(line, sizeof(line),
+                   "{\"prog\":\"%s\",\"pid\":%d,\"phase\":\"%s\",\"detail\":\"%s\","
+                   "\"start_ns\":%llu,\"duration_ns\":%llu}\n",
+                   trace_prog, (int)getpid(), phase, escaped,
+                   (unsigned long long)start, (unsigned long long)(end - start));
+    if (len >= (int)sizeof(line))
+        return;
+    if (write(trace_fd, line, len) == -1)
+        return;
+}
@@ -0,0 +1,13 @@
+#ifndef VOIDNSRUN_TRACE_H
+#define VOIDNSRUN_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void trace_setup(const char *prog, bool to_stderr);
+bool trace_enabled(void);
+int trace_fileno(void);
+uint64_t trace_now(void);
+void trace_phase(const char *phase, uint64_t start, const char *detail);
+
+#endif //VOIDNSRUN_TRACE_H
@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <limits.h>
 #include <unistd.h>
-#include <sys/socket.h>
+#include <dirent.h>
+#include <sys/fsuid.h>
 #include <sys/stat.h>
 #include "macros.h"
 #include "utils.h"
@@ -34,15 +38,6 @@ bool exists(const char *s)
     return stat(s, &st) == 0;
 }
 
-bool mkfile(const char *s)
-{
-    int fd;
-    if ((fd = creat(s, 0700)) == -1)
-        return false;
-    close(fd);
-    return true;
-}
-
 mode_t getmode(const char *s)
 {
     struct stat st;
@@ -51,119 +46,432 @@ mode_t getmode(const char *s)
     return st.st_mode;
 }
 
+/* Same as getmode(), but for an open fd, e.g. an O_PATH one. */
+mode_t fgetmode(int fd)
+{
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_TYPE|STATX_MODE, &stx) == -1)
+        return 0;
+    return stx.stx_mode;
+}
+
 bool startswith(const char *haystack, const char *needle)
 {
     return strncmp(haystack, needle, strlen(needle)) == 0;
 }
 
-int send_fd(int sock, int fd)
+bool parse_posint(const char *s, int *out)
 {
-    struct msghdr msg = {0};
-    struct iovec iov[1];
-    struct cmsghdr *cmsg = NULL;
-    char ctrl_buf[CMSG_SPACE(sizeof(int))];
-    char data[1];
+    char *end;
+    long val;
 
-    memset(ctrl_buf, 0, CMSG_SPACE(sizeof(int)));
+    errno = 0;
+    val = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || val <= 0 || val > INT_MAX)
+        return false;
+    *out = (int)val;
+    return true;
+}
 
-    data[0] = ' ';
-    iov[0].iov_base = data;
-    iov[0].iov_len = sizeof(data);
+/* Finds prog in PATH, like execvp() does. The path is put to buf. */
+bool find_in_path(const char *prog, char *buf, size_t size)
+{
+    const char *dir = getenv("PATH");
 
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
-    msg.msg_iov = iov;
-    msg.msg_iovlen = 1;
-    msg.msg_controllen =  CMSG_SPACE(sizeof(int));
-    msg.msg_control = ctrl_buf;
+    if (strchr(prog, '/') != NULL) {
+        snprintf(buf, size, "%s", prog);
+        return access(buf, X_OK) == 0;
+    }
 
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    if (dir == NULL)
+        dir = "/bin:/usr/bin";
+    while (*dir != '\0') {
+        size_t len = strcspn(dir, ":");
+        snprintf(buf, size, "%.*s%s%s", (int)len, dir, len ? "/" : "", prog);
+        if (access(buf, X_OK) == 0 && !isdir(buf))
+            return true;
+        dir += len;
+        if (*dir == ':')
+            dir++;
+    }
+    return false;
+}
 
-    *((int *)CMSG_DATA(cmsg)) = fd;
+/* Changes the root directory to dirfd, unless it's the root already. */
+bool enter_root(int dirfd)
+{
+    struct stat root_st, st;
 
-    return sendmsg(sock, &msg, 0);
+    if (fstat(dirfd, &st) == -1 || stat("/", &root_st) == -1)
+        return false;
+    if (st.st_dev == root_st.st_dev && st.st_ino == root_st.st_ino)
+        return true;
+    return fchdir(dirfd) == 0 && chroot(".") == 0;
 }
 
-int recv_fd(int sock)
+/* Changes the working directory to path if it leads to the same directory as
+ * dirfd, and to dirfd otherwise. With only the fd, the working directory
+ * could be in a mount of another namespace, which getcwd() can't make a
+ * path of. */
+void enter_cwd(const char *path, int dirfd)
 {
-    struct msghdr msg = {0};
-    struct iovec iov[1];
-    struct cmsghdr *cmsg = NULL;
-    char ctrl_buf[CMSG_SPACE(sizeof(int))];
-    char data[1];
+    struct stat cwd_st, st;
 
-    memset(ctrl_buf, 0, CMSG_SPACE(sizeof(int)));
+    if (dirfd == -1) {
+        if (chdir(path) == -1)
+            DEBUG("chdir: %s\n", strerror(errno));
+        return;
+    }
 
-    iov[0].iov_base = data;
-    iov[0].iov_len = sizeof(data);
+    if (fstat(dirfd, &cwd_st) == -1
+            || path[0] == '\0'
+            || chdir(path) == -1
+            || stat(".", &st) == -1
+            || st.st_dev != cwd_st.st_dev || st.st_ino != cwd_st.st_ino) {
+        if (fchdir(dirfd) == -1)
+            DEBUG("fchdir: %s\n", strerror(errno));
+    }
+}
 
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
-    msg.msg_control = ctrl_buf;
-    msg.msg_controllen = CMSG_SPACE(sizeof(int));
-    msg.msg_iov = iov;
-    msg.msg_iovlen = 1;
+#define FNV1A_PRIME 0x100000001b3ULL
 
-    recvmsg(sock, &msg, 0);
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV1A_PRIME;
+    }
+    return hash;
+}
 
-    cmsg = CMSG_FIRSTHDR(&msg);
+/* Hashes the string together with its terminating NUL, so that consecutive
+ * strings can't be shifted into each other ("ab", "c" vs "a", "bc"). */
+uint64_t fnv1a_str(uint64_t hash, const char *s)
+{
+    return fnv1a(hash, s, strlen(s) + 1);
+}
 
-    return *((int *) CMSG_DATA(cmsg));
+/* Makes file access checks use the real uid and gid if user is true, or the
+ * effective ones again. voidnsrun is setuid root, and this is how it looks at
+ * files on the caller's behalf. */
+bool fs_as_user(bool user)
+{
+    uid_t uid = user ? getuid() : geteuid();
+    gid_t gid = user ? getgid() : getegid();
+
+    setfsgid(gid);
+    setfsuid(uid);
+
+    /* These don't report errors, so check the values they have now. */
+    return (uid_t)setfsuid(-1) == uid && (gid_t)setfsgid(-1) == gid;
 }
 
-bool isxbpscommand(const char *s)
+struct cache_file {
+    char name[NAME_MAX + 1];
+    struct timespec mtime;
+};
+
+static int cmp_mtime(const void *a, const void *b)
 {
-    const char *commands[] = {
-        "/xbps-install",
-        "/xbps-remove",
-        "/xbps-reconfigure",
-        "/xbps-query",
-        "/xbps-pkgdb",
-    };
-    for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
-        const char *command = commands[i];
-        if (!strcmp(s, command+1))
-            return true;
-        char *slash = strrchr(s, '/');
-        if (slash && !strcmp(slash, command))
-            return true;
+    const struct timespec *x = &((const struct cache_file *)a)->mtime;
+    const struct timespec *y = &((const struct cache_file *)b)->mtime;
+
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec)
+        return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Removes the least recently written files of a cache directory, so that at
+ * most max are left. */
+void cache_trim(const char *dir, size_t max)
+{
+    struct cache_file *files = NULL, *tmp;
+    size_t n = 0, size = 0;
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return;
+
+    while ((de = readdir(d)) != NULL) {
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1
+                || !S_ISREG(st.st_mode))
+            continue;
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            tmp = realloc(files, size * sizeof(*files));
+            if (tmp == NULL)
+                goto end;
+            files = tmp;
+        }
+        snprintf(files[n].name, sizeof(files[n].name), "%s", de->d_name);
+        files[n].mtime = st.st_mtim;
+        n++;
     }
-    return false;
+
+    if (n <= max)
+        goto end;
+    qsort(files, n, sizeof(*files), cmp_mtime);
+    for (size_t i = 0; i < n - max; i++) {
+        DEBUG("%s: removing %s/%s\n", __func__, dir, files[i].name);
+        unlinkat(dirfd(d), files[i].name, 0);
+    }
+
+end:
+    free(files);
+    closedir(d);
 }
 
-bool strarray_append(struct strarray *a, char *s)
+bool proc_starttime(pid_t pid, unsigned long long *starttime)
 {
-    if (a->end == a->size - 1)
+    char path[32];
+    char buf[1024];
+    FILE *f;
+    char *p;
+    bool found = false;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
         return false;
-    else
-        a->list[a->end++] = s;
-    return true;
+    if (fgets(buf, sizeof(buf), f) == NULL)
+        goto end;
+
+    /* The second field is the command name in parentheses and it may contain
+     * anything, including spaces and parentheses. Start after the last ')'. */
+    if ((p = strrchr(buf, ')')) == NULL)
+        goto end;
+
+    /* starttime is the 22nd field. Every field after the ')' is preceded by
+     * a space, the first of them being the 3rd one. */
+    for (int field = 3; field <= 22; field++) {
+        if ((p = strchr(p + 1, ' ')) == NULL)
+            goto end;
+    }
+    found = sscanf(p, " %llu", starttime) == 1;
+
+end:
+    fclose(f);
+    return found;
 }
 
-bool intarray_append(struct intarray *a, int i)
+bool proc_uid(pid_t pid, uid_t *uid)
 {
-    if (a->end == a->size - 1)
+    char path[32];
+    char buf[256];
+    FILE *f;
+    unsigned int ruid;
+    bool found = false;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
         return false;
-    else
-        a->list[a->end++] = i;
-    return true;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        if (sscanf(buf, "Uid: %u", &ruid) == 1) {
+            *uid = ruid;
+            found = true;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
 }
 
-void strarray_alloc(struct strarray *a, size_t size)
+/* Opens the mount namespace of the process and makes sure that it is still
+ * the same process that was started at starttime. */
+int ns_open_pid(pid_t pid, unsigned long long starttime)
+{
+    char path[32];
+    unsigned long long now_starttime;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", (int)pid);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    /* If the pid had been reused before the open() call, the start time would
+     * not match now. */
+    if (!proc_starttime(pid, &now_starttime) || now_starttime != starttime) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Gets the path of a file of the namespace at ns_path, e.g. /proc/self/ns/mnt,
+ * in its directory in SOCK_DIR. The directory is named after the namespace, so
+ * every voidnsrun instance has its own and voidnsundo can find it without
+ * asking anyone. */
+bool ns_file_path(char *buf, size_t size, const char *ns_path, const char *name)
+{
+    struct stat st;
+
+    if (stat(ns_path, &st) == -1)
+        return false;
+    return snprintf(buf, size, "%s/%lu/%s", SOCK_DIR,
+                    (unsigned long)st.st_ino, name) < (int)size;
+}
+
+bool sock_path(char *buf, size_t size, const char *ns_path)
+{
+    return ns_file_path(buf, size, ns_path, "sock");
+}
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char _Alignas(ARENA_ALIGN) data[];
+};
+
+void out_of_memory(void)
+{
+    ERROR("error: out of memory.\n");
+    exit(1);
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_block *b = a->head;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (b == NULL || b->size - b->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(struct arena_block) + block_size);
+        if (b == NULL)
+            out_of_memory();
+        b->next = a->head;
+        b->size = block_size;
+        b->used = 0;
+        a->head = b;
+    }
+
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void arena_free(struct arena *a)
+{
+    while (a->head != NULL) {
+        struct arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+/* Concatenates a and b. */
+char *arena_concat(struct arena *arena, const char *a, const char *b)
+{
+    size_t len_a = strlen(a), len_b = strlen(b);
+    char *s = arena_alloc(arena, len_a + len_b + 1);
+    memcpy(s, a, len_a);
+    memcpy(s + len_a, b, len_b + 1);
+    return s;
+}
+
+/* Grows the list of an array to twice its size. The old list stays in the
+ * arena, which at most doubles the memory used, but keeps appending linear. */
+static void *array_grow(struct arena *arena, void *list, size_t *size,
+                        size_t elem)
+{
+    size_t new_size = *size ? *size * 2 : 16;
+    void *new_list = arena_alloc(arena, new_size * elem);
+    if (*size)
+        memcpy(new_list, list, *size * elem);
+    *size = new_size;
+    return new_list;
+}
+
+void strarray_init(struct strarray *a, struct arena *arena)
 {
     a->end = 0;
-    a->size = size;
-    a->list = malloc(sizeof(char *) * size);
-    assert(a->list != NULL);
+    a->size = 0;
+    a->list = NULL;
+    a->arena = arena;
+}
+
+void strarray_append(struct strarray *a, char *s)
+{
+    if (a->end == a->size)
+        a->list = array_grow(a->arena, a->list, &a->size, sizeof(char *));
+    a->list[a->end++] = s;
+}
+
+void *vec_push(struct vec *v, const void *item)
+{
+    if (v->len == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 16;
+        v->data = realloc(v->data, v->cap * v->elem);
+        if (v->data == NULL)
+            out_of_memory();
+    }
+    memcpy(v->data + v->len * v->elem, item, v->elem);
+    return v->data + v->len++ * v->elem;
+}
+
+
+static void name_set_grow(struct name_set *set)
+{
+    struct name_set bigger = {0};
+    bigger.size = set->size ? set->size * 2 : 1024;
+    bigger.slots = calloc(bigger.size, sizeof(char *));
+    if (bigger.slots == NULL)
+        out_of_memory();
+    for (size_t i = 0; i < set->size; i++) {
+        if (set->slots[i] != NULL)
+            name_set_add(&bigger, set->slots[i]);
+    }
+    free(set->slots);
+    *set = bigger;
 }
 
-void intarray_alloc(struct intarray *i, size_t size)
+/* Returns true if the name was not in the set yet. */
+bool name_set_add(struct name_set *set, const char *name)
 {
-    i->end = 0;
-    i->size = size;
-    i->list = malloc(sizeof(int) * size);
-    assert(i->list != NULL);
-}
\ No newline at end of file
+    size_t i;
+
+    if ((set->count + 1) * 2 > set->size)
+        name_set_grow(set);
+
+    i = fnv1a_str(FNV1A_INIT, name) & (set->size - 1);
+    while (set->slots[i] != NULL) {
+        if (!strcmp(set->slots[i], name))
+            return false;
+        i = (i + 1) & (set->size - 1);
+    }
+    set->slots[i] = name;
+    set->count++;
+    return true;
+}
+
+bool name_set_has(const struct name_set *set, const char *name)
+{
+    if (set->size == 0)
+        return false;
+    size_t i = fnv1a_str(FNV1A_INIT, name) & (set->size - 1);
+    while (set->slots[i] != NULL) {
+        if (!strcmp(set->slots[i], name))
+            return true;
+        i = (i + 1) & (set->size - 1);
+    }
+    return false;
+}
+
+void name_set_free(struct name_set *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->size = 0;
+    set->count = 0;
+}
@@ -2,36 +2,87 @@
 #define VOIDNSRUN_UTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "config.h"
 
+/* Per-launch allocator. Everything allocated from an arena is freed at once
+ * with arena_free(). */
+struct arena_block;
+
+struct arena {
+    struct arena_block *head;
+};
+
 struct strarray {
     size_t end;
     size_t size;
     char **list;
+    struct arena *arena;
 };
 
-struct intarray {
-    size_t end;
+/* Growable array of any type, for building flat buffers. */
+struct vec {
+    char *data;
+    size_t len;   /* In elements. */
+    size_t cap;
+    size_t elem;
+};
+
+#define VEC(type) {NULL, 0, 0, sizeof(type)}
+#define VEC_AT(v, type, i) (((type *)(v)->data)[i])
+
+/* A set of names, with open addressing. The names are not copied. */
+struct name_set {
+    const char **slots;
     size_t size;
-    int *list;
+    size_t count;
 };
 
 bool isdir(const char *s);
 bool isexe(const char *s);
 bool exists(const char *s);
-bool mkfile(const char *s);
 bool startswith(const char *haystack, const char *needle);
+bool parse_posint(const char *s, int *out);
 mode_t getmode(const char *s);
+mode_t fgetmode(int fd);
+
+bool find_in_path(const char *prog, char *buf, size_t size);
+
+bool fs_as_user(bool user);
+void cache_trim(const char *dir, size_t max);
+
+bool enter_root(int dirfd);
+void enter_cwd(const char *path, int dirfd);
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+uint64_t fnv1a_str(uint64_t hash, const char *s);
+
+bool proc_starttime(pid_t pid, unsigned long long *starttime);
+bool proc_uid(pid_t pid, uid_t *uid);
+
+int ns_open_pid(pid_t pid, unsigned long long starttime);
+bool ns_file_path(char *buf, size_t size, const char *ns_path, const char *name);
+bool sock_path(char *buf, size_t size, const char *ns_path);
+
+/* Running out of memory is reported with "error: out of memory." and handled
+ * like any other error of the function. Only what has no way to fail, like
+ * the allocators below, exits with out_of_memory() instead. */
+void out_of_memory(void);
 
-int send_fd(int sock, int fd);
-int recv_fd(int sock);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a);
+char *arena_concat(struct arena *arena, const char *a, const char *b);
 
-bool isxbpscommand(const char *s);
+void strarray_init(struct strarray *a, struct arena *arena);
+void strarray_append(struct strarray *a, char *s);
 
-void strarray_alloc(struct strarray *a, size_t size);
-bool strarray_append(struct strarray *a, char *s);
+void *vec_push(struct vec *v, const void *item);
 
-void intarray_alloc(struct intarray *i, size_t size);
-bool intarray_append(struct intarray *a, int i);
+bool name_set_add(struct name_set *set, const char *name);
+bool name_set_has(const struct name_set *set, const char *name);
+void name_set_free(struct name_set *set);
 
 #endif //VOIDNSRUN_UTILS_H
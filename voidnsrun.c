@@ -8,13 +8,14 @@
 #include <errno.h>
 #include <sched.h>
 #include <stdbool.h>
-#include <dirent.h>
 #include <signal.h>
 #include <libgen.h>
+#include <getopt.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <linux/limits.h>
@@ -22,121 +23,1208 @@
 #include "config.h"
 #include "utils.h"
 #include "macros.h"
+#include "session.h"
+#include "mountapi.h"
+#include "trace.h"
+#include "server.h"
+#include "profile.h"
+#include "shim.h"
+#include "origin.h"
+#include "proto.h"
+#include "spawn.h"
+#include "batch.h"
+#include "libprefetch.h"
+#include "libindex.h"
 
-volatile sig_atomic_t term_caught = 0;
 bool g_verbose = false;
 
+enum {
+    OPT_SESSION = 0x100,
+    OPT_IDLE_TIMEOUT,
+    OPT_JOIN,
+    OPT_PROFILE,
+    OPT_AUTO_UNDO,
+    OPT_NO_SERVER,
+    OPT_POOL,
+    OPT_EXPORT_NS,
+    OPT_MINIMAL,
+    OPT_KEEP,
+    OPT_NO_LD_CACHE,
+    OPT_LD_CACHE_OVERLAY,
+    OPT_PREFETCH_LIBS,
+    OPT_CHECK,
+    OPT_STATS,
+};
+
+struct option long_options[] = {
+    {"session",      required_argument, NULL, OPT_SESSION},
+    {"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+    {"join",         required_argument, NULL, OPT_JOIN},
+    {"profile",      required_argument, NULL, OPT_PROFILE},
+    {"auto-undo",    no_argument,       NULL, OPT_AUTO_UNDO},
+    {"no-server",    no_argument,       NULL, OPT_NO_SERVER},
+    {"pool",         required_argument, NULL, OPT_POOL},
+    {"export-ns",    required_argument, NULL, OPT_EXPORT_NS},
+    {"minimal",      no_argument,       NULL, OPT_MINIMAL},
+    {"keep",         required_argument, NULL, OPT_KEEP},
+    {"no-ld-cache",  no_argument,       NULL, OPT_NO_LD_CACHE},
+    {"ld-cache-overlay", no_argument,   NULL, OPT_LD_CACHE_OVERLAY},
+    {"prefetch-libs", no_argument,      NULL, OPT_PREFETCH_LIBS},
+    {"check",        no_argument,       NULL, OPT_CHECK},
+    {"stats",        optional_argument, NULL, OPT_STATS},
+    {NULL, 0, NULL, 0}
+};
+
 void usage(const char *progname)
 {
-    printf("Usage: %s [OPTIONS] PROGRAM [ARGS]\n", progname);
+    printf("Usage: %s [OPTIONS] PROGRAM [ARGS]\n"
+           "       %s [OPTIONS] -x JOBFILE\n"
+           "       %s [--join PID] --stats[=json]\n", progname, progname, progname);
     printf("\n"
             "Options:\n"
             "    -r <path>: Container path. When this option is not present,\n"
             "               " CONTAINER_DIR_VAR " environment variable is used.\n"
-            "    -m <path>: Add bind mount. You can add up to %d paths.\n"
-            "    -u <path>: Add undo bind mount. You can add up to %d paths.\n"
+            "    -m <path>: Add bind mount.\n"
+            "    -u <path>: Add undo bind mount.\n"
             "    -d <path>: Add /usr subdirectory bind mount.\n"
             "    -U <path>: Path to " VOIDNSUNDO_NAME ". When this option is not present,\n"
             "               " UNDO_BIN_VAR " environment variable is used.\n"
             "    -i:        Don't treat missing source or target for added mounts as error.\n"
+            "    -x <path>: Run the jobs from this file (- for stdin) instead of\n"
+            "               PROGRAM, one per line.\n"
+            "    -j <n>:    Run up to this many jobs at a time. Default is 1.\n"
             "    -V:        Enable verbose output.\n"
+            "    -T:        Write timing of startup phases to stderr as JSON lines.\n"
+            "               Set " TRACE_VAR "=<fd> to write them to another fd.\n"
             "    -h:        Print this help.\n"
-            "    -v:        Print version.\n",
-           USER_LISTS_MAX, USER_LISTS_MAX);
+            "    -v:        Print version.\n"
+            "    --session <name>:\n"
+            "               Keep the namespace alive after PROGRAM exits and reuse it\n"
+            "               for later launches with the same name and options.\n"
+            "    --idle-timeout <seconds>:\n"
+            "               Tear the session down after it has had no processes for\n"
+            "               this long. Default is %d.\n"
+            "    --join <pid>:\n"
+            "               Run PROGRAM in the namespace of a running process that\n"
+            "               was launched with voidnsrun.\n"
+            "    --profile <name>:\n"
+            "               Use this launch profile from " PROFILE_DIR ".\n"
+            "               By default, the profile is picked by PROGRAM's name.\n"
+            "    --auto-undo:\n"
+            "               Make programs from PATH that only the host has available\n"
+            "               through " VOIDNSUNDO_NAME ", like -u does.\n"
+            "    --prefetch-libs:\n"
+            "               Read PROGRAM and its libraries ahead in the background\n"
+            "               while it starts. Helps with cold starts of big programs.\n"
+            "    --check:\n"
+            "               Instead of running PROGRAM, list the libraries it needs\n"
+            "               that can't be found in the namespace.\n"
+            "    --stats[=text|json]:\n"
+            "               Print the counters of the " VOIDNSUNDO_NAME " server of this\n"
+            "               namespace, or of the one of --join, and exit.\n"
+            "    --no-server:\n"
+            "               Don't keep a helper process for " VOIDNSUNDO_NAME ". It returns\n"
+            "               to the original namespace through init or the parent\n"
+            "               process instead.\n"
+            "    --minimal:\n"
+            "               Only keep the root filesystem, /dev, /proc, /sys, /run,\n"
+            "               /tmp, /home and /root of the host, instead of all of\n"
+            "               its mounts.\n"
+            "    --keep <path>:\n"
+            "               Also keep this path, with the mounts under it, in\n"
+            "               a --minimal namespace.\n"
+            "    --no-ld-cache:\n"
+            "               Don't mount the container's " LD_CACHE " in the\n"
+            "               namespace.\n"
+            "    --ld-cache-overlay:\n"
+            "               If the host has no " LD_CACHE ", provide it with a\n"
+            "               read-only overlay on /etc to mount the container's one.\n"
+            "    --pool <name>:\n"
+            "               Ask voidnsrund to run PROGRAM in a prebuilt namespace\n"
+            "               of this pool. Other options are ignored.\n"
+            "    --export-ns <fd>:\n"
+            "               Send the namespace over the unix socket <fd> and exit,\n"
+            "               instead of running PROGRAM. Used by voidnsrund.\n",
+           SESSION_IDLE_TIMEOUT);
 }
 
-size_t mount_dirs(const char *source_prefix,
-                  size_t source_prefix_len,
-                  struct strarray *targets,
-                  struct intarray *created)
+/* A mount point that is missing and provided by an overlay instead. */
+struct skel_entry {
+    const char *path;
+    mode_t mode;        /* S_IFDIR or S_IFREG, and the permissions. */
+};
+
+/* Creates rel and its missing parents in the skeleton layer. Directories that
+ * exist in the lower layer get its mode and owner, because the skeleton covers
+ * them in the overlay. The entry itself gets mode, it's either a directory or
+ * an empty file. */
+static bool mkskel(int skel_fd, int lower_fd, const char *target,
+                   const char *rel, mode_t mode)
 {
     char buf[PATH_MAX];
-    int successful = 0;
-    mode_t mode;
-    for (size_t i = 0; i < targets->end; i++) {
-        /* Check if it's safe to proceed. */
-        if (source_prefix_len + strlen(targets->list[i]) >= PATH_MAX) {
-            ERROR("error: path %s%s is too large.\n", source_prefix, targets->list[i]);
+    struct stat st;
+    char *p;
+
+    if (snprintf(buf, sizeof(buf), "%s", rel) >= (int)sizeof(buf))
+        return false;
+    p = buf;
+    for (;;) {
+        char *slash = strchr(p, '/');
+        if (slash != NULL)
+            *slash = '\0';
+
+        if (fstatat(skel_fd, buf, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            uid_t uid = 0;
+            gid_t gid = 0;
+            mode_t m = slash != NULL ? S_IFDIR|0755 : mode;
+
+            if (S_ISDIR(m) && fstatat(lower_fd, buf, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                /* A symlink or a file would be hidden by the directory. */
+                if (!S_ISDIR(st.st_mode)) {
+                    ERROR("error: %s/%s is not a directory.\n", target, buf);
+                    return false;
+                }
+                uid = st.st_uid;
+                gid = st.st_gid;
+                m = st.st_mode;
+            }
+
+            if ((S_ISDIR(m) ? mkdirat(skel_fd, buf, m & 07777)
+                            : mknodat(skel_fd, buf, S_IFREG|(m & 07777), 0)) == -1
+                    || fchownat(skel_fd, buf, uid, gid, AT_SYMLINK_NOFOLLOW) == -1
+                    || fchmodat(skel_fd, buf, m & 07777, 0) == -1) {
+                ERROR("error: failed to create %s/%s: %s.\n", target, buf,
+                      strerror(errno));
+                return false;
+            }
+        }
+
+        if (slash == NULL)
+            return true;
+        *slash = '/';
+        p = slash + 1;
+    }
+}
+
+/* Overlay layers don't include mounts below them. Clones the mounts below the
+ * lower layer (only the topmost ones, the clones are recursive), so that they
+ * can be mounted on the overlay. Returns their number, or -1. */
+static int clone_submounts(const char *lower, char ***rels, int **fds)
+{
+    char real[PATH_MAX], mnt[PATH_MAX];
+    char *line = NULL;
+    size_t line_size = 0, len;
+    int n = 0;
+    FILE *f;
+
+    *rels = NULL;
+    *fds = NULL;
+    if (realpath(lower, real) == NULL)
+        return -1;
+    len = strlen(real);
+
+    if ((f = fopen("/proc/self/mountinfo", "r")) == NULL)
+        return -1;
+
+    while (getline(&line, &line_size, f) != -1) {
+        char *p, *q;
+        bool nested = false;
+
+        /* The 5th field is the mount point, with spaces and such escaped as
+         * octal numbers. */
+        if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) != 1)
             continue;
+        for (p = q = mnt; *p; q++) {
+            if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3') {
+                *q = (char)strtol((char[]){p[1], p[2], p[3], 0}, NULL, 8);
+                p += 4;
+            } else
+                *q = *p++;
+        }
+        *q = '\0';
+
+        if (strncmp(mnt, real, len) != 0 || mnt[len] != '/')
+            continue;
+        for (int i = 0; i < n; i++) {
+            size_t l = strlen((*rels)[i]);
+            if (!strncmp(mnt + len + 1, (*rels)[i], l) && mnt[len + 1 + l] == '/')
+                nested = true;
+        }
+        if (nested)
+            continue;
+
+        char **new_rels = realloc(*rels, sizeof(char *) * (n + 1));
+        if (new_rels == NULL)
+            goto nomem;
+        *rels = new_rels;
+        int *new_fds = realloc(*fds, sizeof(int) * (n + 1));
+        if (new_fds == NULL)
+            goto nomem;
+        *fds = new_fds;
+
+        (*rels)[n] = strdup(mnt + len + 1);
+        if ((*rels)[n] == NULL)
+            goto nomem;
+        (*fds)[n] = clone_tree(AT_FDCWD, mnt);
+        if ((*fds)[n] == -1) {
+            ERROR("open_tree(%s): %s\n", mnt, strerror(errno));
+            free((*rels)[n]);
+            goto fail;
+        }
+        n++;
+    }
+
+    free(line);
+    fclose(f);
+    return n;
+
+nomem:
+    ERROR("error: out of memory.\n");
+fail:
+    for (int i = 0; i < n; i++) {
+        close((*fds)[i]);
+        free((*rels)[i]);
+    }
+    free(*rels);
+    free(*fds);
+    *rels = NULL;
+    *fds = NULL;
+    free(line);
+    fclose(f);
+    return -1;
+}
+
+/* Mounts a read-only overlay at target, which consists of the lower directory
+ * and an in-memory skeleton layer on top of it. The skeleton has the entries,
+ * which are paths below target, so they can be used as mount points without
+ * creating anything in the lower directory itself. */
+static bool mount_skel_overlay(const char *lower, int lower_fd, const char *target,
+                               const struct skel_entry *entries, size_t n)
+{
+    char opts[128];
+    char path[PATH_MAX];
+    struct stat st;
+    char **sub_rels;
+    int *sub_fds;
+    int skel_fd = -1;
+    int subs;
+    bool ok = false;
+    uint64_t t = trace_now();
+
+    if (fstat(lower_fd, &st) == -1) {
+        ERROR("fstat: %s\n", strerror(errno));
+        return false;
+    }
+
+    subs = clone_submounts(lower, &sub_rels, &sub_fds);
+    if (subs == -1) {
+        ERROR("error: failed to clone mounts below %s.\n", lower);
+        goto end;
+    }
+
+    /* The skeleton is mounted at target itself and covered by the overlay. */
+    snprintf(opts, sizeof(opts), "size=64k,mode=%04o,uid=%u,gid=%u",
+             st.st_mode & 07777, (unsigned)st.st_uid, (unsigned)st.st_gid);
+    if (mount("tmpfs", target, "tmpfs", 0, opts) == -1) {
+        ERROR("mount: error mounting tmpfs in %s: %s.\n", target, strerror(errno));
+        goto end;
+    }
+
+    skel_fd = open(target, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (skel_fd == -1) {
+        ERROR("open(%s): %s\n", target, strerror(errno));
+        goto end;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!mkskel(skel_fd, lower_fd, target,
+                    entries[i].path + strlen(target) + 1, entries[i].mode))
+            goto end;
+    }
+
+    /* Using fds here saves us from escaping ':' and ',' in the paths. */
+    snprintf(opts, sizeof(opts), "lowerdir=/proc/self/fd/%d:/proc/self/fd/%d",
+             skel_fd, lower_fd);
+    if (mount("overlay", target, "overlay", MS_RDONLY, opts) == -1) {
+        ERROR("mount: error mounting overlay in %s: %s.\n", target, strerror(errno));
+        goto end;
+    }
+    trace_phase("overlay", t, target);
+
+    for (int i = 0; i < subs; i++) {
+        snprintf(path, sizeof(path), "%s/%s", target, sub_rels[i]);
+        if (attach_tree(sub_fds[i], AT_FDCWD, path) == -1) {
+            ERROR("move_mount(%s): %s\n", path, strerror(errno));
+            goto end;
+        }
+    }
+    ok = true;
+
+end:
+    if (skel_fd != -1)
+        close(skel_fd);
+    for (int i = 0; i < subs; i++) {
+        close(sub_fds[i]);
+        free(sub_rels[i]);
+    }
+    free(sub_fds);
+    free(sub_rels);
+    return ok;
+}
+
+/* Orders entries by their parent directory, so that the ones with the same
+ * parent are next to each other, and parents come before their children. */
+static int skel_entry_cmp(const void *a, const void *b)
+{
+    const char *pa = ((const struct skel_entry *)a)->path;
+    const char *pb = ((const struct skel_entry *)b)->path;
+    size_t la = strrchr(pa, '/') - pa;
+    size_t lb = strrchr(pb, '/') - pb;
+    int r = memcmp(pa, pb, la < lb ? la : lb);
+
+    if (r != 0)
+        return r;
+    if (la != lb)
+        return la < lb ? -1 : 1;
+    return strcmp(pa + la, pb + lb);
+}
+
+/*
+ * Provides missing mount points without writing to the container. Each parent
+ * directory of the entries is shadowed with an overlay (see
+ * mount_skel_overlay()) that has them as empty files or directories. This only
+ * happens in the namespace, so nothing has to be removed on exit, and nothing
+ * is left behind in the container if voidnsrun gets killed.
+ *
+ * Errors are reported here, the mount points that are still missing are
+ * reported again by the caller when it fails to mount them.
+ */
+static void mount_placeholders(struct skel_entry *entries, size_t n)
+{
+    char parent[PATH_MAX];
+    size_t i, j, len;
+    int parent_fd;
+
+    qsort(entries, n, sizeof(*entries), skel_entry_cmp);
+
+    for (i = 0; i < n; i = j) {
+        const char *path = entries[i].path;
+        len = strrchr(path, '/') - path;
+        for (j = i + 1; j < n; j++) {
+            const char *p = entries[j].path;
+            if (strncmp(p, path, len + 1) != 0 || strchr(p + len + 1, '/') != NULL)
+                break;
         }
 
-        /* Should be safe as we just checked that total length of source_prefix
-         * and targets->list[i] is no more than PATH_MAX-1. */
-        strcpy(buf, source_prefix);
-        strcat(buf, targets->list[i]);
+        /* Never shadow the root directory. */
+        if (len == 0 || len >= sizeof(parent)) {
+            ERROR("error: can't create mount point at %s.\n", path);
+            continue;
+        }
+        memcpy(parent, path, len);
+        parent[len] = '\0';
 
-        if (!isdir(buf)) {
-            ERROR("error: source mount dir %s does not exists.\n", buf);
+        parent_fd = open_path(AT_FDCWD, parent, RESOLVE_NO_MAGICLINKS);
+        if (parent_fd == -1) {
+            ERROR("error: can't create mount point at %s: %s.\n", path, strerror(errno));
             continue;
         }
 
-        if (!exists(targets->list[i])) {
-            if (created != NULL) {
-                mode = getmode(buf);
-                if (mode == 0) {
-                    ERROR("error: can't get mode for %s.\n", buf);
-                    continue;
-                }
+        if (S_ISDIR(fgetmode(parent_fd))) {
+            DEBUG("%s: %zu mount points in %s\n", __func__, j - i, parent);
+            mount_skel_overlay(parent, parent_fd, parent, entries + i, j - i);
+        } else
+            ERROR("error: %s is not a directory.\n", parent);
+        close(parent_fd);
+    }
+}
 
-                if (mkdir(targets->list[i], mode) == -1) {
-                    ERROR("error: failed to create mountpotint at %s: %s.\n",
-                          targets->list[i], strerror(errno));
-                    continue;
-                } else
-                    intarray_append(created, i);
-            } else {
-                ERROR("error: mount dir %s does not exists.\n", buf);
-                continue;
+/*
+ * Bind mounts targets from source_prefix. Both the source and the target of
+ * each mount are opened once with O_PATH, checked with statx() and then
+ * mounted by fd, so nothing can be swapped between the checks and the mount.
+ *
+ * Missing targets are an error, unless placeholders is set, in which case they
+ * are provided by mount_placeholders() first.
+ */
+size_t mount_dirs(const char *source_prefix,
+                  struct strarray *targets,
+                  bool placeholders)
+{
+    struct skel_entry *missing = NULL;
+    size_t nmissing = 0;
+    struct stat st;
+    int root_fd, src_fd, target_fd;
+    int successful = 0;
+    mode_t mode;
+
+    root_fd = open(source_prefix, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (root_fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", source_prefix, strerror(errno));
+        return 0;
+    }
+
+    if (placeholders) {
+        missing = malloc(sizeof(*missing) * (targets->end + 1));
+        if (missing == NULL) {
+            ERROR("error: out of memory.\n");
+            close(root_fd);
+            return 0;
+        }
+        for (size_t i = 0; i < targets->end; i++) {
+            const char *target = targets->list[i];
+            if (stat(target, &st) == -1 && errno == ENOENT
+                    && fstatat(root_fd, target + strspn(target, "/"), &st, 0) == 0
+                    && S_ISDIR(st.st_mode)) {
+                missing[nmissing].path = target;
+                missing[nmissing++].mode = st.st_mode;
             }
         }
+        mount_placeholders(missing, nmissing);
+        free(missing);
+    }
 
-        if (!isdir(targets->list[i])) {
-            ERROR("error: mount point %s is not a directory.\n", targets->list[i]);
-            continue;
+    for (size_t i = 0; i < targets->end; i++) {
+        const char *target = targets->list[i];
+        uint64_t t = trace_now();
+        target_fd = -1;
+
+        /* The source is resolved beneath source_prefix, so that a symlink
+         * can't lead it out of the container. */
+        src_fd = open_path(root_fd, target + strspn(target, "/"),
+                           RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS);
+        mode = src_fd != -1 ? fgetmode(src_fd) : 0;
+        if (!S_ISDIR(mode)) {
+            ERROR("error: source mount dir %s%s does not exists.\n",
+                  source_prefix, target);
+            goto next;
+        }
+
+        target_fd = open_path(AT_FDCWD, target, RESOLVE_NO_MAGICLINKS);
+        if (target_fd == -1 && errno == ENOENT) {
+            ERROR("error: mount dir %s does not exists.\n", target);
+            goto next;
+        }
+
+        if (target_fd == -1 || !S_ISDIR(fgetmode(target_fd))) {
+            ERROR("error: mount point %s is not a directory.\n", target);
+            goto next;
         }
 
-        if (mount(buf, targets->list[i], NULL, MS_BIND|MS_REC, NULL) == -1)
-            ERROR("mount: failed to mount %s: %s\n", targets->list[i], strerror(errno));
+        if (bind_fd(src_fd, target_fd, true) == -1)
+            ERROR("mount: failed to mount %s: %s\n", target, strerror(errno));
         else
             successful++;
+
+next:
+        if (src_fd != -1)
+            close(src_fd);
+        if (target_fd != -1)
+            close(target_fd);
+        trace_phase("mount", t, target);
     }
+
+    close(root_fd);
     return successful;
 }
 
-size_t mount_undo(const char *source,
-                  const struct strarray *targets,
-                  struct intarray *created)
+size_t mount_undo(const char *source, const struct strarray *targets)
 {
+    struct skel_entry *missing;
+    size_t nmissing = 0;
+    struct stat st;
+    int src_fd, target_fd;
     int successful = 0;
+
+    if (targets->end == 0)
+        return 0;
+
+    src_fd = open_path(AT_FDCWD, source, RESOLVE_NO_MAGICLINKS);
+    if (src_fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", source, strerror(errno));
+        return 0;
+    }
+
+    /* If a mount point does not exist, mount() would fail. Such mount points
+     * are provided as empty files by overlays, which only exist in this
+     * namespace. */
+    missing = malloc(sizeof(*missing) * targets->end);
+    if (missing == NULL) {
+        ERROR("error: out of memory.\n");
+        close(src_fd);
+        return 0;
+    }
     for (size_t i = 0; i < targets->end; i++) {
-        /* If the mount point does not exist, create an empty file, otherwise
-         * mount() call will fail. In this case, remember which files we have
-         * created to unlink() them before exit. */
-        if (!exists(targets->list[i])) {
-            if (mkfile(targets->list[i]))
-                intarray_append(created, i);
-            else
-                continue;
+        if (targets->list[i][0] == '/'
+                && stat(targets->list[i], &st) == -1 && errno == ENOENT) {
+            missing[nmissing].path = targets->list[i];
+            missing[nmissing++].mode = S_IFREG|0644;
         }
+    }
+    mount_placeholders(missing, nmissing);
+    free(missing);
 
-        DEBUG("%s: source=%s, target=%s\n", __func__, source, targets->list[i]);
-        if (mount(source, targets->list[i], NULL, MS_BIND, NULL) == -1)
+    for (size_t i = 0; i < targets->end; i++) {
+        const char *target = targets->list[i];
+        uint64_t t = trace_now();
+
+        target_fd = open_path(AT_FDCWD, target, RESOLVE_NO_MAGICLINKS);
+        if (target_fd == -1) {
+            ERROR("error: failed to open %s: %s.\n", target, strerror(errno));
+            continue;
+        }
+
+        DEBUG("%s: source=%s, target=%s\n", __func__, source, target);
+        if (bind_fd(src_fd, target_fd, false) == -1)
             ERROR("mount: failed to mount %s to %s: %s",
-                 source, targets->list[i], strerror(errno));
+                 source, target, strerror(errno));
         else
             successful++;
+
+        close(target_fd);
+        trace_phase("mount_undo", t, target);
     }
+
+    close(src_fd);
     return successful;
 }
 
-void onterm(int sig)
+/*
+ * Mounts the container's ld.so cache at LD_CACHE, without the rest of its
+ * /etc. glibc programs look their libraries up there, and without it (the
+ * host is usually musl and has none), ld.so tries every default directory
+ * for every library on every start.
+ *
+ * If the host has no LD_CACHE, nothing is mounted, unless overlay is set. Then
+ * it's provided by an overlay, which makes /etc read-only in the namespace and
+ * hides later changes to the host's /etc. A stale cache is still mounted,
+ * because ld.so falls back to the directories for what it doesn't find, and a
+ * warning is printed if warn is set. Returns true if the cache has been
+ * mounted.
+ */
+bool mount_ld_cache(const char *dir, bool overlay, bool warn)
+{
+    static const char *lib_dirs[] = LD_CACHE_DIRS;
+    struct skel_entry entry = {LD_CACHE, S_IFREG|0644};
+    struct stat st, cache_st;
+    int root_fd, src_fd = -1, target_fd = -1;
+    uint64_t t = trace_now();
+    bool ok = false;
+
+    if (!overlay && stat(LD_CACHE, &st) == -1 && errno == ENOENT) {
+        DEBUG("%s: %s not found, not mounting the container's one\n",
+              __func__, LD_CACHE);
+        return false;
+    }
+
+    root_fd = open(dir, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (root_fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", dir, strerror(errno));
+        return false;
+    }
+
+    src_fd = open_path(root_fd, LD_CACHE + 1, RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS);
+    if (src_fd == -1 || fstat(src_fd, &cache_st) == -1 || !S_ISREG(cache_st.st_mode)) {
+        DEBUG("%s: %s%s not found\n", __func__, dir, LD_CACHE);
+        goto end;
+    }
+
+    /* Adding or removing a library changes the mtime of its directory. */
+    for (size_t i = 0; warn && i < ARRAY_SIZE(lib_dirs); i++) {
+        if (fstatat(root_fd, lib_dirs[i] + 1, &st, 0) == -1)
+            continue;
+        if (st.st_mtim.tv_sec > cache_st.st_mtim.tv_sec
+                || (st.st_mtim.tv_sec == cache_st.st_mtim.tv_sec
+                    && st.st_mtim.tv_nsec > cache_st.st_mtim.tv_nsec)) {
+            ERROR("warning: %s%s is older than %s%s, run `chroot %s ldconfig` "
+                  "as root to update it.\n", dir, LD_CACHE, dir, lib_dirs[i], dir);
+            break;
+        }
+    }
+
+    if (stat(LD_CACHE, &st) == -1 && errno == ENOENT)
+        mount_placeholders(&entry, 1);
+
+    target_fd = open_path(AT_FDCWD, LD_CACHE, RESOLVE_NO_MAGICLINKS);
+    if (target_fd == -1 || !S_ISREG(fgetmode(target_fd))) {
+        ERROR("error: mount point %s is not a file.\n", LD_CACHE);
+        goto end;
+    }
+
+    DEBUG("%s: source=%s%s, target=%s\n", __func__, dir, LD_CACHE, LD_CACHE);
+    if (bind_fd(src_fd, target_fd, false) == -1) {
+        ERROR("mount: failed to mount %s%s to %s: %s\n",
+              dir, LD_CACHE, LD_CACHE, strerror(errno));
+        goto end;
+    }
+    trace_phase("mount", t, LD_CACHE);
+    ok = true;
+
+end:
+    if (target_fd != -1)
+        close(target_fd);
+    if (src_fd != -1)
+        close(src_fd);
+    close(root_fd);
+    return ok;
+}
+
+/*
+ * Builds the namespace's /usr with the new mount API. The container's /usr
+ * and the host /usr subdirectories are cloned as detached trees, the
+ * subdirectories are grafted onto the container's tree, and the result is
+ * attached at /usr in one step. Unlike the mount() path, this doesn't need to
+ * preserve the host /usr at OLDROOT, because the host subdirectories are
+ * cloned before /usr gets covered.
+ *
+ * If some of the mount points don't exist in the container, /usr becomes a
+ * read-only overlay that provides them (see mount_skel_overlay()), and the
+ * host subdirectories are mounted on top of it. Either way, nothing is
+ * created in the container, and there's nothing to clean up: it all goes
+ * away with the namespace.
+ *
+ * Returns false with errno set to ENOSYS if the kernel doesn't support the
+ * new mount API. Nothing is mounted in this case.
+ */
+bool mount_usr_tree(const char *dir, const struct strarray *dir_mounts)
+{
+    struct skel_entry *entries;
+    char buf[PATH_MAX];
+    struct stat st;
+    int usr_fd = -1;
+    int *host_fds = NULL;
+    int saved_errno = 0;
+    size_t missing = 0;
+    bool attached = false;
+    bool ok = false;
+    uint64_t t;
+
+    host_fds = malloc(sizeof(int) * (dir_mounts->end + 1));
+    if (host_fds == NULL) {
+        ERROR("error: out of memory.\n");
+        return false;
+    }
+    for (size_t i = 0; i < dir_mounts->end; i++)
+        host_fds[i] = -1;
+
+    /* Clone the host subdirectories while /usr is still the host's one. */
+    for (size_t i = 0; i < dir_mounts->end; i++) {
+        const char *path = dir_mounts->list[i];
+        t = trace_now();
+        if (!isdir(path)) {
+            ERROR("error: source mount dir %s does not exists.\n", path);
+            goto end;
+        }
+
+        host_fds[i] = clone_tree(AT_FDCWD, path);
+        if (host_fds[i] == -1) {
+            saved_errno = errno;
+            if (saved_errno != ENOSYS)
+                ERROR("open_tree(%s): %s\n", path, strerror(errno));
+            goto end;
+        }
+        trace_phase("clone_tree", t, path);
+    }
+
+    if (snprintf(buf, sizeof(buf), "%s/usr", dir) >= (int)sizeof(buf)) {
+        ERROR("error: path %s/usr is too large.\n", dir);
+        goto end;
+    }
+
+    /* Check the mount points. Symlinks are not followed: in a detached tree,
+     * an absolute one would be resolved against the host's root. */
+    usr_fd = open_path(AT_FDCWD, buf, 0);
+    if (usr_fd == -1) {
+        ERROR("open(%s): %s\n", buf, strerror(errno));
+        goto end;
+    }
+    for (size_t i = 0; i < dir_mounts->end; i++) {
+        const char *path = dir_mounts->list[i];
+        if (fstatat(usr_fd, path + strlen("/usr/"), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (errno != ENOENT) {
+                ERROR("error: can't create mountpoint at %s.\n", path);
+                goto end;
+            }
+            missing++;
+        } else if (!S_ISDIR(st.st_mode)) {
+            ERROR("error: mount point %s is not a directory.\n", path);
+            goto end;
+        }
+    }
+
+    if (missing > 0) {
+        DEBUG("%s: %zu mount points are missing, using overlay\n", __func__, missing);
+        entries = malloc(sizeof(*entries) * dir_mounts->end);
+        if (entries == NULL) {
+            ERROR("error: out of memory.\n");
+            goto end;
+        }
+        for (size_t i = 0; i < dir_mounts->end; i++) {
+            entries[i].path = dir_mounts->list[i];
+            entries[i].mode = S_IFDIR|(fgetmode(host_fds[i]) & 07777);
+        }
+        attached = mount_skel_overlay(buf, usr_fd, "/usr", entries, dir_mounts->end);
+        free(entries);
+        if (!attached)
+            goto end;
+    } else {
+        close(usr_fd);
+        t = trace_now();
+        usr_fd = clone_tree(AT_FDCWD, buf);
+        if (usr_fd == -1) {
+            saved_errno = errno;
+            if (saved_errno != ENOSYS)
+                ERROR("open_tree(%s): %s\n", buf, strerror(errno));
+            goto end;
+        }
+        trace_phase("clone_tree", t, buf);
+    }
+
+    for (size_t i = 0; i < dir_mounts->end; i++) {
+        const char *path = dir_mounts->list[i];
+        const char *rel = path + strlen("/usr/");
+        t = trace_now();
+
+        DEBUG("%s: grafting %s\n", __func__, path);
+        if (!attached) {
+            if (attach_tree(host_fds[i], usr_fd, rel) == 0) {
+                trace_phase("mount", t, path);
+                continue;
+            }
+
+            /* Mounting on detached trees is only supported since Linux 6.15.
+             * On older kernels, attach /usr first and graft onto it. */
+            if (errno != EINVAL) {
+                ERROR("move_mount(%s): %s\n", path, strerror(errno));
+                goto end;
+            }
+            if (attach_tree(usr_fd, AT_FDCWD, "/usr") == -1) {
+                ERROR("move_mount(/usr): %s\n", strerror(errno));
+                goto end;
+            }
+            attached = true;
+        }
+
+        if (attach_tree(host_fds[i], AT_FDCWD, path) == -1) {
+            ERROR("move_mount(%s): %s\n", path, strerror(errno));
+            goto end;
+        }
+        trace_phase("mount", t, path);
+    }
+
+    t = trace_now();
+    if (!attached && attach_tree(usr_fd, AT_FDCWD, "/usr") == -1) {
+        ERROR("move_mount(/usr): %s\n", strerror(errno));
+        goto end;
+    }
+    trace_phase("mount", t, "/usr");
+
+    ok = true;
+
+end:
+    if (usr_fd != -1)
+        close(usr_fd);
+    for (size_t i = 0; i < dir_mounts->end; i++) {
+        if (host_fds[i] != -1)
+            close(host_fds[i]);
+    }
+    free(host_fds);
+
+    errno = saved_errno;
+    return ok;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Replaces the root with a minimal tree: the root filesystem without the
+ * mounts on it, and the kept paths with theirs. unshare() has copied the
+ * whole mount table of the host, with all the mounts of containers, snaps
+ * and autofs. They are detached here, together with the old root, so the
+ * namespace doesn't hold them, and mount events under them don't reach it.
+ *
+ * The kept paths are cloned before anything is attached, so the new tree
+ * doesn't contain itself. It's staged on top of the container directory,
+ * which is there for sure. Everything in it is private. */
+bool mount_minimal(const char *dir, struct strarray *keep)
+{
+    char buf[PATH_MAX*2];
+    struct mount_attr attr = {0};
+    struct stat st;
+    int root_fd = -1;
+    int *fds;
+    bool attached = false, ok = false;
+    uint64_t t = trace_now();
+
+    /* pivot_root() doesn't work with shared mounts. */
+    if (mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL) == -1) {
+        ERROR("mount: failed to make / private: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* A path under another kept path comes with it. */
+    qsort(keep->list, keep->end, sizeof(char *), path_cmp);
+    fds = malloc(sizeof(int) * (keep->end + 1));
+    if (fds == NULL) {
+        ERROR("error: out of memory.\n");
+        return false;
+    }
+    for (size_t i = 0; i < keep->end; i++) {
+        const char *path = keep->list[i];
+        fds[i] = -1;
+
+        bool covered = !strcmp(path, "/");
+        for (size_t j = 0; j < i && !covered; j++) {
+            size_t len = strlen(keep->list[j]);
+            covered = fds[j] != -1 && !strncmp(path, keep->list[j], len)
+                      && (path[len] == '/' || path[len] == '\0');
+        }
+        if (covered)
+            continue;
+
+        if (stat(path, &st) == -1) {
+            DEBUG("%s: %s: %s\n", __func__, path, strerror(errno));
+            continue;
+        }
+
+        fds[i] = clone_tree(AT_FDCWD, path);
+        if (fds[i] == -1) {
+            if (errno == ENOSYS)
+                ERROR("error: --minimal needs the new mount API (Linux 5.2+).\n");
+            else
+                ERROR("open_tree(%s): %s\n", path, strerror(errno));
+            goto end;
+        }
+    }
+
+    root_fd = sys_open_tree(AT_FDCWD, "/", OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC);
+    if (root_fd == -1) {
+        ERROR("open_tree(/): %s\n", strerror(errno));
+        goto end;
+    }
+    attr.propagation = MS_PRIVATE;
+    sys_mount_setattr(root_fd, "", AT_EMPTY_PATH, &attr, sizeof(attr));
+
+    for (size_t i = 0; i < keep->end; i++) {
+        const char *path = keep->list[i];
+        if (fds[i] == -1)
+            continue;
+
+        DEBUG("%s: keeping %s\n", __func__, path);
+        if (!attached) {
+            if (attach_tree(fds[i], root_fd, path + 1) == 0)
+                continue;
+
+            /* Mounting on detached trees is only supported since Linux 6.15.
+             * On older kernels, attach the root first and graft onto it. */
+            if (errno != EINVAL)
+                goto attach_failed;
+            if (attach_tree(root_fd, AT_FDCWD, dir) == -1) {
+                ERROR("move_mount(%s): %s\n", dir, strerror(errno));
+                goto end;
+            }
+            attached = true;
+        }
+
+        snprintf(buf, sizeof(buf), "%s%s", dir, path);
+        if (attach_tree(fds[i], AT_FDCWD, buf) == 0)
+            continue;
+
+attach_failed:
+        if (errno == ENOENT)
+            ERROR("error: there's no %s on the root filesystem, keep its mount point instead.\n",
+                  path);
+        else
+            ERROR("move_mount(%s): %s\n", path, strerror(errno));
+        goto end;
+    }
+
+    if (!attached && attach_tree(root_fd, AT_FDCWD, dir) == -1) {
+        ERROR("move_mount(%s): %s\n", dir, strerror(errno));
+        goto end;
+    }
+
+    /* The old root ends up on top of the new one, and is detached from
+     * there. */
+    if (chdir(dir) == -1 || syscall(SYS_pivot_root, ".", ".") == -1) {
+        ERROR("pivot_root: %s\n", strerror(errno));
+        goto end;
+    }
+    if (umount2(".", MNT_DETACH) == -1) {
+        ERROR("umount: failed to detach the old root: %s\n", strerror(errno));
+        goto end;
+    }
+    if (chdir("/") == -1) {
+        ERROR("chdir: %s\n", strerror(errno));
+        goto end;
+    }
+    trace_phase("minimal", t, NULL);
+
+    ok = true;
+
+end:
+    if (root_fd != -1)
+        close(root_fd);
+    for (size_t i = 0; i < keep->end; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    free(fds);
+    return ok;
+}
+
+/* Computes a key that identifies the namespace layout built from these
+ * options. Sessions are only reused when their keys match. */
+uint64_t namespace_key(const char *dir,
+                       const char *undo_bin,
+                       const struct strarray *user_mounts,
+                       const struct strarray *required_mounts,
+                       const struct strarray *undo_mounts,
+                       const struct strarray *dir_mounts,
+                       bool ignore_missing,
+                       bool auto_undo,
+                       bool ld_cache,
+                       bool ld_cache_overlay,
+                       const struct strarray *keep_mounts)
+{
+    const struct strarray *lists[] = {user_mounts, required_mounts, undo_mounts,
+                                      dir_mounts};
+    uint64_t key = FNV1A_INIT;
+
+    key = fnv1a_str(key, dir);
+    key = fnv1a_str(key, undo_bin ? undo_bin : "");
+    for (size_t i = 0; i < ARRAY_SIZE(lists); i++) {
+        key = fnv1a(key, &lists[i]->end, sizeof(lists[i]->end));
+        for (size_t j = 0; j < lists[i]->end; j++)
+            key = fnv1a_str(key, lists[i]->list[j]);
+    }
+    key = fnv1a(key, &ignore_missing, sizeof(ignore_missing));
+    key = fnv1a(key, &auto_undo, sizeof(auto_undo));
+    key = fnv1a(key, &ld_cache, sizeof(ld_cache));
+    key = fnv1a(key, &ld_cache_overlay, sizeof(ld_cache_overlay));
+
+    /* NULL if the tree is not minimal. */
+    if (keep_mounts) {
+        key = fnv1a_str(key, "minimal");
+        for (size_t j = 0; j < keep_mounts->end; j++)
+            key = fnv1a_str(key, keep_mounts->list[j]);
+    }
+    return key;
+}
+
+/* Drops root rights, restores working directory and launches the program,
+ * or runs the jobs of jobfile, if it's set, or checks the program's libraries
+ * against check, if it's set. Only returns on failure, or with the batch's
+ * or the check's exit code. */
+int exec_program(const char *cwd, char **argv, const char *jobfile, int jobs,
+                 bool prefetch_libs, const struct libindex *check)
+{
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    uint64_t t = trace_now();
+
+    if (setreuid(uid, uid) == -1) {
+        ERROR("setreuid: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (setregid(gid, gid) == -1) {
+        ERROR("setregid: %s\n", strerror(errno));
+        return 1;
+    }
+    trace_phase("drop_privileges", t, NULL);
+
+    /* Restore working directory. */
+    if (chdir(cwd) == -1)
+        DEBUG("chdir: %s\n", strerror(errno));
+
+    if (jobfile) {
+        trace_phase("batch", trace_now(), jobfile);
+        return batch_run(jobfile, jobs);
+    }
+
+    if (check)
+        return libindex_check(check, argv[0]);
+
+    /* The libraries are read as the user, and while the program starts. */
+    if (prefetch_libs)
+        libprefetch_start(argv[0]);
+
+    /* Launch program. */
+    trace_phase("exec", trace_now(), argv[0]);
+    if (execvp(argv[0], (char *const *)argv) == -1)
+        ERROR("execvp(%s): %s\n", argv[0], strerror(errno));
+    return 1;
+}
+
+/* Asks voidnsrund to start the program in a namespace of the pool, and waits
+ * for it like voidnsundo -S does. Returns the exit code. */
+int run_in_pool(const char *pool, char **argv)
+{
+    extern char **environ;
+    struct sockaddr_un addr = {0};
+    uint64_t t = trace_now();
+    int sock, exit_code = 1;
+
+    /* voidnsrund takes the credentials from the socket. */
+    if (setregid(getgid(), getgid()) == -1 || setreuid(getuid(), getuid()) == -1) {
+        ERROR("error: failed to drop privileges: %s.\n", strerror(errno));
+        return 1;
+    }
+    trace_phase("drop_privileges", t, NULL);
+
+    t = trace_now();
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", BROKER_DIR, pool);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        ERROR("connect(%s): %s\n", addr.sun_path, strerror(errno));
+        goto end;
+    }
+    trace_phase("connect", t, addr.sun_path);
+
+    t = trace_now();
+    if (spawn_send(sock, argv, environ) == -1) {
+        ERROR("error: failed to send spawn request: %s.\n", strerror(errno));
+        goto end;
+    }
+    trace_phase("spawn", t, argv[0]);
+
+    exit_code = spawn_wait(sock);
+
+end:
+    if (sock != -1)
+        close(sock);
+    return exit_code;
+}
+
+/* Counts the mounts of the current namespace. */
+static long count_mounts(void)
+{
+    char buf[4096];
+    long n = 0;
+    ssize_t len;
+    int fd;
+
+    fd = open("/proc/self/mountinfo", O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < len; i++)
+            n += buf[i] == '\n';
+    }
+    close(fd);
+    return len == 0 ? n : -1;
+}
+
+/* Returns the upper bound, in µs, of the latency bucket that holds the
+ * given share of the sends, or 0 if it's the last one. */
+static uint64_t latency_percentile(const struct server_stats *st, uint64_t count,
+                                   double share)
+{
+    uint64_t seen = 0;
+
+    for (int i = 0; i < SERVER_STATS_BUCKETS - 1; i++) {
+        seen += st->latency[i];
+        if (seen >= count * share)
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+/* Prints the counters of the server of the current namespace for --stats.
+ * Returns the exit code. */
+static int show_stats(bool json)
 {
-    UNUSED(sig);
-    term_caught = 1;
+    struct sockaddr_un addr = {0};
+    struct server_stats st;
+    uint64_t count = 0;
+    long mounts;
+
+    addr.sun_family = AF_UNIX;
+    if (!sock_path(addr.sun_path, sizeof(addr.sun_path), "/proc/self/ns/mnt")) {
+        ERROR("error: failed to get socket path.\n");
+        return 1;
+    }
+
+    if (!server_get_stats(&addr, &st)) {
+        if (errno == ENOENT || errno == ECONNREFUSED)
+            ERROR("error: there's no %s server in this namespace.\n", VOIDNSUNDO_NAME);
+        else if (errno == EINVAL)
+            ERROR("error: the server is of an older version without --stats.\n");
+        else
+            ERROR("error: failed to get stats: %s.\n", proto_strerror(errno));
+        return 1;
+    }
+    mounts = count_mounts();
+
+    for (int i = 0; i < SERVER_STATS_BUCKETS; i++)
+        count += st.latency[i];
+
+    if (json) {
+        printf("{\"uptime_ms\":%llu,\"accepted\":%llu,\"open\":%llu,\"open_max\":%llu,"
+               "\"requests\":{\"nsfd\":%llu,\"spawn\":%llu,\"stats\":%llu},"
+               "\"fds_sent\":%llu,\"errors\":%llu,\"spawn_failed\":%llu,\"exited\":%llu,"
+               "\"latency\":{\"count\":%llu,\"sum_ns\":%llu,\"max_ns\":%llu,\"buckets\":[",
+               (unsigned long long)st.uptime_ms, (unsigned long long)st.accepted,
+               (unsigned long long)st.open, (unsigned long long)st.open_max,
+               (unsigned long long)st.nsfd, (unsigned long long)st.spawn,
+               (unsigned long long)st.stats, (unsigned long long)st.fds_sent,
+               (unsigned long long)st.errors, (unsigned long long)st.spawn_failed,
+               (unsigned long long)st.exited, (unsigned long long)count,
+               (unsigned long long)st.latency_sum_ns,
+               (unsigned long long)st.latency_max_ns);
+        for (int i = 0; i < SERVER_STATS_BUCKETS; i++)
+            printf("%s%llu", i ? "," : "", (unsigned long long)st.latency[i]);
+        printf("]},\"mounts\":%ld}\n", mounts);
+        return 0;
+    }
+
+    printf("uptime:       %llu s\n"
+           "connections:  %llu accepted, %llu open, %llu open at most\n"
+           "requests:     %llu nsfd, %llu spawn, %llu stats\n"
+           "fds sent:     %llu\n"
+           "errors:       %llu\n"
+           "spawned:      %llu exited, %llu failed to start\n",
+           (unsigned long long)st.uptime_ms / 1000,
+           (unsigned long long)st.accepted, (unsigned long long)st.open,
+           (unsigned long long)st.open_max, (unsigned long long)st.nsfd,
+           (unsigned long long)st.spawn, (unsigned long long)st.stats,
+           (unsigned long long)st.fds_sent, (unsigned long long)st.errors,
+           (unsigned long long)st.exited, (unsigned long long)st.spawn_failed);
+    if (mounts != -1)
+        printf("mounts:       %ld\n", mounts);
+
+    if (count == 0)
+        return 0;
+    printf("send latency: avg %.1f us, max %.1f us, p50 ",
+           st.latency_sum_ns / 1000.0 / count, st.latency_max_ns / 1000.0);
+    for (int i = 0; i < 2; i++) {
+        uint64_t p = latency_percentile(&st, count, i ? 0.99 : 0.5);
+        if (p != 0)
+            printf("< %llu us", (unsigned long long)p);
+        else
+            printf(">= %llu us", 1ULL << (SERVER_STATS_BUCKETS - 2));
+        printf(i ? "\n" : ", p99 ");
+    }
+    for (int i = 0; i < SERVER_STATS_BUCKETS; i++) {
+        if (st.latency[i] == 0)
+            continue;
+        if (i < SERVER_STATS_BUCKETS - 1)
+            printf("  < %5llu us: %llu\n", 1ULL << i, (unsigned long long)st.latency[i]);
+        else
+            printf(" >= %5llu us: %llu\n", 1ULL << (i - 1), (unsigned long long)st.latency[i]);
+    }
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
+    uint64_t t_start = trace_now();
+    uint64_t t;
+
     if (argc < 2) {
         usage(argv[0]);
         return 0;
@@ -146,36 +1234,75 @@ int main(int argc, char **argv)
     char *dir = NULL;
     char buf[PATH_MAX*2];
     char *undo_bin = NULL;
-    int sock_fd = -1, sock_conn = -1;
+    int sock_fd = -1;
+    int sock_dirfd = -1;
+    char sock_opts[64];
+    int rootfd = -1;
+    struct sockaddr_un sock_addr = {0};
     size_t dirlen;
     int c;
     int exit_code = 1;
-    DIR *dirptr = NULL;
     bool ignore_missing = false;
     bool forked = false;
     pid_t pid = 0;
     char cwd[PATH_MAX];
+    char *session = NULL;
+    int session_dirfd = -1;
+    int session_lockfd = -1;
+    uint64_t session_key = 0;
+    int idle_timeout = SESSION_IDLE_TIMEOUT;
+    int join_pid = 0;
+    bool usr_tree = false;
+    bool trace = false;
+    char *profile = NULL;
+    bool auto_undo = false;
+    bool no_server = false;
+    bool minimal = false;
+    bool ld_cache = true;
+    bool ld_cache_overlay = false;
+    bool prefetch_libs = false;
+    bool check = false;
+    bool stats = false;
+    bool stats_json = false;
+    struct libindex index = {0};
+    char *pool = NULL;
+    int export_fd = -1;
+    char *jobfile = NULL;
+    int jobs = 1;
+    char *host_path = NULL;
+    struct plan plan;
+    int profile_idx;
+
+    /* All the lists below live until exit, so they are allocated from one
+     * arena and freed together. */
+    struct arena arena = {0};
 
     struct strarray user_mounts;
-    strarray_alloc(&user_mounts, USER_LISTS_MAX);
+    strarray_init(&user_mounts, &arena);
 
     struct strarray undo_mounts;
-    strarray_alloc(&undo_mounts, USER_LISTS_MAX);
+    strarray_init(&undo_mounts, &arena);
 
     /* List of user-specified /usr subdirectories to mount. */
     struct strarray dir_mounts;
-    strarray_alloc(&dir_mounts, USER_LISTS_MAX);
+    strarray_init(&dir_mounts, &arena);
 
-    /* List of indexes of items in the undo_mounts array. See comments in
-     * mount_undo() function for more info. */
-    struct intarray created_undos;
-    intarray_alloc(&created_undos, USER_LISTS_MAX);
+    struct strarray default_mounts;
+    strarray_init(&default_mounts, &arena);
+
+    /* Necessary mounts of the launch profile, mounted after /usr. */
+    struct strarray required_mounts;
+    strarray_init(&required_mounts, &arena);
+
+    /* Host paths to keep with --minimal. */
+    struct strarray keep_mounts;
+    strarray_init(&keep_mounts, &arena);
 
-    /* List of indexes of items in the dir_mounts array. */
-    struct intarray created_dirs;
-    intarray_alloc(&created_dirs, USER_LISTS_MAX);
+    /* Names of host programs for --auto-undo. */
+    struct strarray shims;
+    strarray_init(&shims, &arena);
 
-    while ((c = getopt(argc, argv, "vhm:r:u:U:iVd:")) != -1) {
+    while ((c = getopt_long(argc, argv, "vhm:r:u:U:iVTd:j:x:", long_options, NULL)) != -1) {
         switch (c) {
         case 'v':
             printf("%s\n", PROG_VERSION);
@@ -195,34 +1322,202 @@ int main(int argc, char **argv)
         case 'V':
             g_verbose = true;
             break;
+        case 'T':
+            trace = true;
+            break;
         case 'm':
-            if (!strarray_append(&user_mounts, optarg))
-                ERROR_EXIT("error: only up to %lu user mounts allowed.\n",
-                           user_mounts.size);
+            strarray_append(&user_mounts, optarg);
             break;
         case 'u':
-            if (!strarray_append(&undo_mounts, optarg))
-                ERROR_EXIT("error: only up to %lu user mounts allowed.\n",
-                           undo_mounts.size);
+            strarray_append(&undo_mounts, optarg);
             break;
         case 'd':
             if (!startswith(optarg, "/usr/"))
                 ERROR_EXIT("only subdirectories of /usr are allowed for bind mounting this way.\n");
-            if (!strarray_append(&dir_mounts, optarg))
-                ERROR_EXIT("error: only up to %lu dir mounts allowed.\n",
-                           dir_mounts.size);
-                break;
+            strarray_append(&dir_mounts, optarg);
+            break;
+        case 'j':
+            if (!parse_posint(optarg, &jobs) || jobs > BATCH_JOBS_MAX)
+                ERROR_EXIT("error: invalid number of jobs %s.\n", optarg);
+            break;
+        case 'x':
+            jobfile = optarg;
+            break;
+        case OPT_SESSION:
+            if (!session_name_valid(optarg))
+                ERROR_EXIT("error: invalid session name %s.\n", optarg);
+            session = optarg;
+            break;
+        case OPT_IDLE_TIMEOUT:
+            if (!parse_posint(optarg, &idle_timeout))
+                ERROR_EXIT("error: invalid idle timeout %s.\n", optarg);
+            break;
+        case OPT_JOIN:
+            if (!parse_posint(optarg, &join_pid))
+                ERROR_EXIT("error: invalid pid %s.\n", optarg);
+            break;
+        case OPT_PROFILE:
+            if (!session_name_valid(optarg))
+                ERROR_EXIT("error: invalid profile name %s.\n", optarg);
+            profile = optarg;
+            break;
+        case OPT_AUTO_UNDO:
+            auto_undo = true;
+            break;
+        case OPT_NO_SERVER:
+            no_server = true;
+            break;
+        case OPT_MINIMAL:
+            minimal = true;
+            break;
+        case OPT_KEEP:
+            if (optarg[0] != '/')
+                ERROR_EXIT("error: --keep needs an absolute path.\n");
+            strarray_append(&keep_mounts, optarg);
+            break;
+        case OPT_NO_LD_CACHE:
+            ld_cache = false;
+            break;
+        case OPT_LD_CACHE_OVERLAY:
+            ld_cache_overlay = true;
+            break;
+        case OPT_PREFETCH_LIBS:
+            prefetch_libs = true;
+            break;
+        case OPT_CHECK:
+            check = true;
+            break;
+        case OPT_STATS:
+            if (optarg && strcmp(optarg, "json") == 0)
+                stats_json = true;
+            else if (optarg && strcmp(optarg, "text") != 0)
+                ERROR_EXIT("error: invalid stats format %s.\n", optarg);
+            stats = true;
+            break;
+        case OPT_POOL:
+            if (!session_name_valid(optarg))
+                ERROR_EXIT("error: invalid pool name %s.\n", optarg);
+            pool = optarg;
+            break;
+        case OPT_EXPORT_NS:
+            if (!parse_posint(optarg, &export_fd))
+                ERROR_EXIT("error: invalid fd %s.\n", optarg);
+            break;
         case '?':
             return 1;
         }
     }
 
-    if (!argv[optind]) {
+    if (!argv[optind] && export_fd == -1 && !jobfile && !stats) {
         usage(argv[0]);
         return 1;
     }
 
+    /* In batch mode, the jobs are the programs. */
+    if (jobfile && (argv[optind] || pool || export_fd != -1))
+        ERROR_EXIT("error: -x can't be used with PROGRAM, --pool or --export-ns.\n");
+
+    /* The library index is of the container, which a joined namespace may not
+     * have been built from. */
+    if (check && (jobfile || join_pid || pool || export_fd != -1))
+        ERROR_EXIT("error: --check can't be used with -x, --join, --pool or --export-ns.\n");
+
+    /* The counters are of a namespace that is already there, and they're
+     * root's business. */
+    if (stats) {
+        if (getuid() != 0)
+            ERROR_EXIT("error: only root can use --stats.\n");
+        if (argv[optind] || jobfile || session || pool || export_fd != -1 || check)
+            ERROR_EXIT("error: --stats can't be used with PROGRAM, -x, --session, --pool, --export-ns or --check.\n");
+    }
+
+    /* A session is the server. */
+    if (session && no_server)
+        ERROR_EXIT("error: --no-server can't be used with --session.\n");
+
+    /* The exported namespace has no server either, the one who receives it
+     * is in the original namespace. */
+    if (export_fd != -1) {
+        if (getuid() != 0)
+            ERROR_EXIT("error: only root can use --export-ns.\n");
+        if (session || join_pid || pool)
+            ERROR_EXIT("error: --export-ns can't be used with --session, --join or --pool.\n");
+        no_server = true;
+    }
+
+    trace_setup("voidnsrun", trace);
+    trace_phase("options", t_start, NULL);
+
+    /* Get current working directory. Will need to restore it later in the
+     * new mount namespace. */
+    getcwd(cwd, PATH_MAX);
+    DEBUG("cwd=%s\n", cwd);
+
+    /* The server of a namespace is only reachable from inside of it. */
+    if (stats) {
+        if (join_pid) {
+            t = trace_now();
+            nsfd = ns_open_voidnsrun(join_pid);
+            if (nsfd == -1)
+                goto end;
+            if (setns(nsfd, CLONE_NEWNS) == -1)
+                ERROR_EXIT("setns: %s.\n", strerror(errno));
+            trace_phase("setns", t, NULL);
+        }
+        exit_code = show_stats(stats_json);
+        goto end;
+    }
+
+    /* With --pool, voidnsrund starts the program in one of its prebuilt
+     * namespaces, so there's nothing to do here as root. */
+    if (pool) {
+        exit_code = run_in_pool(pool, argv + optind);
+        goto end;
+    }
+
+    /* Enter the namespace of a running program, if asked. There's nothing to
+     * set up in this case. */
+    if (join_pid) {
+        if (session)
+            ERROR_EXIT("error: --join can't be used with --session.\n");
+
+        t = trace_now();
+        nsfd = ns_open_voidnsrun(join_pid);
+        if (nsfd == -1)
+            goto end;
+
+        if (setns(nsfd, CLONE_NEWNS) == -1)
+            ERROR_EXIT("setns: %s.\n", strerror(errno));
+        trace_phase("setns", t, NULL);
+
+        exit_code = exec_program(cwd, argv + optind, jobfile, jobs,
+                                 prefetch_libs, check ? &index : NULL);
+        goto end;
+    }
+
+    /* Add the mounts of the launch profile, either the requested one or the
+     * one that matches the program. Broken profiles are reported and left
+     * out of the plan. */
+    t = trace_now();
+    profile_load(&plan);
+    if (profile) {
+        profile_idx = profile_find(&plan, profile);
+        if (profile_idx == -1)
+            ERROR_EXIT("error: profile %s not found.\n", profile);
+    } else {
+        profile_idx = argv[optind] ? profile_match(&plan, argv[optind]) : -1;
+    }
+    if (profile_idx != -1) {
+        DEBUG("profile=%s\n", profile_name(&plan, profile_idx));
+        if (!profile_apply(&plan, profile_idx, &user_mounts, &required_mounts,
+                           &undo_mounts, &dir_mounts, &ignore_missing, &dir))
+            ERROR_EXIT("error: failed to apply profile %s.\n",
+                       profile_name(&plan, profile_idx));
+    }
+    trace_phase("profile", t, profile_idx != -1 ? profile_name(&plan, profile_idx) : NULL);
+
     /* Get container path. */
+    t = trace_now();
     if (!dir)
         dir = getenv(CONTAINER_DIR_VAR);
     if (!dir)
@@ -239,8 +1534,15 @@ int main(int argc, char **argv)
 
     DEBUG("dir=%s\n", dir);
 
+    if (keep_mounts.end > 0 && !minimal)
+        ERROR_EXIT("error: --keep only works with --minimal.\n");
+    for (size_t i = 0; i < keep_mounts.end; i++) {
+        if (!exists(keep_mounts.list[i]))
+            ERROR_EXIT("error: %s does not exist.\n", keep_mounts.list[i]);
+    }
+
     /* Get voidnsundo path, if needed. */
-    if (undo_mounts.end > 0) {
+    if (undo_mounts.end > 0 || auto_undo) {
         if (!undo_bin)
             undo_bin = getenv(UNDO_BIN_VAR);
         if (!undo_bin) {
@@ -265,30 +1567,112 @@ int main(int argc, char **argv)
 
         DEBUG("undo_bin=%s\n", undo_bin);
     }
+    trace_phase("validate", t, dir);
+
+    /* The index is built before anything is mounted. */
+    if (check && !libindex_load(dir, &index))
+        ERROR_EXIT("error: failed to index the libraries of %s.\n", dir);
+
+    /* The shims are looked up after everything else in PATH. */
+    if (auto_undo) {
+        const char *path = getenv("PATH");
+        host_path = strdup(path ? path : "");
+        if (host_path == NULL)
+            ERROR_EXIT("error: out of memory.\n");
+        snprintf(buf, sizeof(buf), "%s%s%s", host_path,
+                 host_path[0] ? ":" : "", SHIM_DIR);
+        if (setenv("PATH", buf, 1) == -1)
+            ERROR_EXIT("setenv: %s\n", strerror(errno));
+    }
+
+    /* If there's already a session built with the same options, just enter
+     * it. Otherwise, hold the lock until the new session is registered, so
+     * that concurrent calls don't build it twice. */
+    if (session) {
+        bool mismatch;
+
+        session_key = namespace_key(dir,
+                                    undo_mounts.end > 0 || auto_undo ? undo_bin : NULL,
+                                    &user_mounts, &required_mounts,
+                                    &undo_mounts, &dir_mounts, ignore_missing, auto_undo, ld_cache,
+                                    ld_cache_overlay, minimal ? &keep_mounts : NULL);
+
+        t = trace_now();
+        session_dirfd = session_dir_open();
+        if (session_dirfd == -1)
+            goto end;
+
+        session_lockfd = session_lock(session_dirfd, session);
+        if (session_lockfd == -1)
+            goto end;
+
+        nsfd = session_find(session_dirfd, session, session_key, &mismatch);
+        if (mismatch)
+            ERROR_EXIT("error: session %s exists, but with different options.\n",
+                       session);
+        trace_phase("session", t, session);
+
+        if (nsfd != -1) {
+            t = trace_now();
+            if (setns(nsfd, CLONE_NEWNS) == -1)
+                ERROR_EXIT("setns: %s.\n", strerror(errno));
+            trace_phase("setns", t, NULL);
+
+            /* exec() would drop the lock, a batch would hold it. */
+            close(session_lockfd);
+            session_lockfd = -1;
+
+            exit_code = exec_program(cwd, argv + optind, jobfile, jobs,
+                                     prefetch_libs, check ? &index : NULL);
+            goto end;
+        }
+        DEBUG("creating session %s\n", session);
+    }
+
+    /* Compare the host's PATH with the container's, while the host's /usr
+     * is still there. */
+    if (auto_undo) {
+        t = trace_now();
+        if (!shim_scan(host_path, dir, &dir_mounts, &shims))
+            ERROR_EXIT("error: failed to find host programs.\n");
+        trace_phase("shim_scan", t, NULL);
+    }
 
     /* Get current namespace's file descriptor. It may be needed later
      * for voidnsundo. */
-    nsfd = open("/proc/self/ns/mnt", O_RDONLY);
+    nsfd = open("/proc/self/ns/mnt", O_RDONLY|O_CLOEXEC);
     if (nsfd == -1)
         ERROR_EXIT("error: failed to acquire mount namespace's fd.%s\n",
                    strerror(errno));
 
-    /* Get current working directory. Will need to restore it later in the
-     * new mount namespace. */
-    getcwd(cwd, PATH_MAX);
-    DEBUG("cwd=%s\n", cwd);
+    /* And the root directory, in case we're chrooted: setns() moves to the
+     * root of the namespace. */
+    rootfd = open("/", O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (rootfd == -1)
+        ERROR_EXIT("error: failed to open /: %s.\n", strerror(errno));
 
     /* Create new mount namespace. */
+    t = trace_now();
     if (unshare(CLONE_NEWNS) == -1)
         ERROR_EXIT("unshare: %s\n", strerror(errno));
+    trace_phase("unshare", t, NULL);
 
     /* Mount stuff from the container to the namespace. */
     /* First, mount what user asked us to mount. */
-    if (mount_dirs(dir, dirlen, &user_mounts, NULL) < user_mounts.end && !ignore_missing)
+    if (mount_dirs(dir, &user_mounts, false) < user_mounts.end && !ignore_missing)
         ERROR_EXIT("error: some mounts failed.\n");
 
-    /* Then preserve original /usr at /oldroot if needed. */
-    if (dir_mounts.end > 0) {
+    /* Then the container's /usr together with the host /usr subdirectories,
+     * as one tree if the kernel supports it. */
+    usr_tree = mount_usr_tree(dir, &dir_mounts);
+    if (!usr_tree && errno != ENOSYS)
+        ERROR_EXIT("error: failed to mount /usr.\n");
+    if (!usr_tree)
+        DEBUG("new mount API is not supported, falling back to mount()\n");
+
+    /* Otherwise preserve original /usr at /oldroot if needed. */
+    if (!usr_tree && dir_mounts.end > 0) {
+        t = trace_now();
         mode_t mode = getmode("/usr");
         if (mode == 0)
             ERROR_EXIT("error: failed to get mode of /usr.\n");
@@ -304,52 +1688,144 @@ int main(int argc, char **argv)
         if (mount("/usr", buf, NULL, MS_BIND|MS_REC, NULL) == -1)
             ERROR_EXIT("error: failed to mount /usr at %s: %s.",
                        buf, strerror(errno));
+        trace_phase("mount", t, OLDROOT);
     }
 
-    /* Then the necessary stuff. */
-    struct strarray default_mounts;
-    strarray_alloc(&default_mounts, 3);
-    strarray_append(&default_mounts, "/usr");
-    if (isxbpscommand(argv[optind])) {
-        strarray_append(&default_mounts, "/var");
-        strarray_append(&default_mounts, "/etc");
-    }
-    if (mount_dirs(dir, dirlen, &default_mounts, NULL) < default_mounts.end)
+    /* Then the necessary stuff: /usr, if it's not mounted yet, and what the
+     * profile requires. These always have to be there, -i or not. */
+    if (!usr_tree)
+        strarray_append(&default_mounts, "/usr");
+    for (size_t i = 0; i < required_mounts.end; i++)
+        strarray_append(&default_mounts, required_mounts.list[i]);
+    if (mount_dirs(dir, &default_mounts, false) < default_mounts.end)
         ERROR_EXIT("error: some necessary mounts failed.\n");
 
     /* Mount /usr subdirectories if needed. */
-    if (dir_mounts.end > 0
-            && mount_dirs(OLDROOT, strlen(OLDROOT), &dir_mounts, &created_dirs) < dir_mounts.end)
+    if (!usr_tree && dir_mounts.end > 0
+            && mount_dirs(OLDROOT, &dir_mounts, true) < dir_mounts.end)
         ERROR_EXIT("error: some dir mounts failed.\n");
 
     /* Now lets do bind mounts of voidnsundo (if needed). */
-    if (mount_undo(undo_bin, &undo_mounts, &created_undos) < undo_mounts.end
+    if (mount_undo(undo_bin, &undo_mounts) < undo_mounts.end
             && !ignore_missing)
         ERROR_EXIT("error: some undo mounts failed.\n");
 
-    /* Check socket directory. */
-    /* TODO: fix invalid permissions, or just die in that case. */
+    /* The container's ld.so cache, unless its whole /etc is mounted anyway. */
+    for (size_t i = 0; ld_cache && i < user_mounts.end; i++) {
+        if (strcmp(user_mounts.list[i], "/etc") == 0)
+            ld_cache = false;
+    }
+    for (size_t i = 0; ld_cache && i < required_mounts.end; i++) {
+        if (strcmp(required_mounts.list[i], "/etc") == 0)
+            ld_cache = false;
+    }
+    if (ld_cache)
+        ld_cache = mount_ld_cache(dir, ld_cache_overlay, g_verbose || check);
+
+    /* Leave only what's needed in the namespace: the default paths, the
+     * user's and what we have mounted. */
+    if (minimal) {
+        static const char *defaults[] = MINIMAL_KEEP;
+        struct strarray keep;
+        strarray_init(&keep, &arena);
+        for (size_t i = 0; i < ARRAY_SIZE(defaults); i++)
+            strarray_append(&keep, (char *)defaults[i]);
+        strarray_append(&keep, "/usr");
+        if (ld_cache)
+            strarray_append(&keep, "/etc");
+        for (size_t i = 0; i < user_mounts.end; i++)
+            strarray_append(&keep, user_mounts.list[i]);
+        for (size_t i = 0; i < required_mounts.end; i++)
+            strarray_append(&keep, required_mounts.list[i]);
+        for (size_t i = 0; i < undo_mounts.end; i++)
+            strarray_append(&keep, undo_mounts.list[i]);
+        for (size_t i = 0; i < keep_mounts.end; i++)
+            strarray_append(&keep, keep_mounts.list[i]);
+        if (!mount_minimal(dir, &keep))
+            goto end;
+    }
 
-    /* This should be safe, SOCK_PATH is hardcoded in config.h and it's definitely
-     * smaller than buffer. */
-    strcpy(buf, SOCK_PATH);
+    /* Mount a tmpfs on the socket directory. It will only be visible in this
+     * namespace, so nothing is created or removed in the host's SOCK_DIR, and
+     * concurrent instances don't interfere with each other. The directory
+     * itself is only created if it doesn't exist yet. */
+    t = trace_now();
+    if (mkdir(SOCK_DIR, 0700) == -1 && errno != EEXIST)
+        ERROR_EXIT("error: failed to create %s directory: %s.\n", SOCK_DIR,
+                   strerror(errno));
 
+    sock_dirfd = open(SOCK_DIR, O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (sock_dirfd == -1)
+        ERROR_EXIT("error: %s is not a directory.\n", SOCK_DIR);
+
+    struct stat sock_dir_st;
+    if (fstat(sock_dirfd, &sock_dir_st) == -1 || sock_dir_st.st_uid != 0
+            || (sock_dir_st.st_mode & 022) != 0)
+        ERROR_EXIT("error: %s must be owned by root and not writable by others.\n",
+                   SOCK_DIR);
+
+    /* One page is enough for the socket. tmpfs keeps a symlink's target in
+     * the inode only if it's shorter than 128 bytes, so with a longer path to
+     * voidnsundo, every shim takes a page too. */
+    size_t sock_pages = 1;
+    if (auto_undo && strlen(undo_bin) >= 128)
+        sock_pages += shims.end;
+    snprintf(sock_opts, sizeof(sock_opts), "size=%zu,mode=%s,uid=0,gid=0",
+             sock_pages * sysconf(_SC_PAGESIZE), auto_undo ? "0711" : "0700");
+
+    /* Mount through the fd, so the directory can't be swapped in between. */
+    snprintf(buf, sizeof(buf), "/proc/self/fd/%d", sock_dirfd);
+    if (mount("tmpfs", buf, "tmpfs", 0, sock_opts) == -1)
+        ERROR_EXIT("mount: error mounting tmpfs in %s: %s.\n", SOCK_DIR, strerror(errno));
+
+    /* The socket is named after this namespace. */
+    sock_addr.sun_family = AF_UNIX;
+    if (!sock_path(sock_addr.sun_path, sizeof(sock_addr.sun_path), "/proc/self/ns/mnt"))
+        ERROR_EXIT("error: failed to get socket path.\n");
+
+    strcpy(buf, sock_addr.sun_path);
     char *sock_dir = dirname(buf);
-    if (access(sock_dir, F_OK) == -1) {
-        if (mkdir(sock_dir, 0700) == -1)
-            ERROR_EXIT("error: failed to create %s directory.\n", sock_dir);
-    } else {
-        if ((dirptr = opendir(sock_dir)) == NULL)
-            ERROR_EXIT("error: %s is not a directory.\n", sock_dir);
-        if (exists(SOCK_PATH) && unlink(SOCK_PATH) == -1)
-            ERROR_EXIT("failed to unlink %s: %s", SOCK_PATH, strerror(errno));
-    }
+    if (mkdir(sock_dir, 0700) == -1)
+        ERROR_EXIT("error: failed to create %s directory: %s.\n", sock_dir,
+                   strerror(errno));
     DEBUG("sock_dir=%s\n", sock_dir);
 
-    /* Mount socket directory as tmpfs. It will only be visible in this namespace,
-     * and the socket file will also be available from this namespace only.*/
-    if (mount("tmpfs", sock_dir, "tmpfs", 0, "size=4k,mode=0700,uid=0,gid=0") == -1)
-        ERROR_EXIT("mount: error mounting tmpfs in %s: %s.\n", sock_dir, strerror(errno));
+    /* The shims share the tmpfs with the socket, so they cost no mounts. Its
+     * root is searchable for that, but the socket's directory is not. */
+    if (auto_undo && !shim_install(undo_bin, &shims))
+        goto end;
+
+    /* Without a server, record a process in the original namespace for
+     * voidnsundo and just run the program. */
+    if (no_server) {
+        char origin[128];
+        if (!ns_file_path(origin, sizeof(origin), "/proc/self/ns/mnt", "origin")
+                || !origin_record(origin, nsfd))
+            goto end;
+        trace_phase("sockdir", t, sock_dir);
+
+        if (export_fd != -1) {
+            int fd = open("/proc/self/ns/mnt", O_RDONLY|O_CLOEXEC);
+            if (fd == -1 || proto_send(export_fd, PROTO_NSFD, 0, NULL, 0, &fd, 1) == -1)
+                ERROR_EXIT("error: failed to export the namespace: %s.\n",
+                           strerror(errno));
+            close(fd);
+            exit_code = 0;
+            goto end;
+        }
+
+        exit_code = exec_program(cwd, argv + optind, jobfile, jobs,
+                                 prefetch_libs, check ? &index : NULL);
+        goto end;
+    }
+
+    /* Create unix socket. It's done before fork(), so that the socket is
+     * already there when the program starts and calls voidnsundo. The
+     * parent doesn't inherit it past exec(). */
+    sock_fd = server_listen(&sock_addr);
+    if (sock_fd == -1)
+        goto end;
+    trace_phase("sockdir", t, sock_dir);
 
     /*
      * Fork. We need it because we need to preserve file descriptor of the
@@ -366,82 +1842,88 @@ int main(int argc, char **argv)
      * call.
      *
      * We also need to make sure the socket will only be accessible by root.
-     * The path to the socket should be hardcoded.
+     * The directory of the socket should be hardcoded.
      *
      * So we fork(), start the server in the child process, while the parent
      * drops root privileges and runs the programs it was asked to run.
      */
     pid_t ppid_before_fork = getpid();
+    t = trace_now();
     pid = fork();
     if (pid == -1)
         ERROR_EXIT("fork: %s\n", strerror(errno));
+    if (pid != 0)
+        trace_phase("fork", t, NULL);
 
     forked = true;
 
     if (pid == 0) {
         /* This is the child process.
-         * Catch SIGTERM: it will be sent here when parent dies. The signal will
-         * interrupt the accept() call, so we can clean up and exit immediately.
+         * Block SIGTERM: it will be sent here when parent dies. The server
+         * reads it from a signalfd, so we can clean up and exit.
          */
-        struct sigaction sa = {0};
-        sa.sa_handler = onterm;
-        sigaction(SIGTERM, &sa, NULL);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
 
         /* Ignore SIGINT. Otherwise it will be affected by Ctrl+C in the parent
          * process. */
         signal(SIGINT, SIG_IGN);
 
-        /* Set the child to get SIGTERM when parent thread dies. */
-        int r = prctl(PR_SET_PDEATHSIG, SIGTERM);
-        if (r == -1)
-            ERROR_EXIT("prctl: %s\n", strerror(errno));
-
-        /* Maybe it already has died? */
-        if (getppid() != ppid_before_fork)
-            ERROR_EXIT("error: parent has died already.\n");
-
-        /* Create unix socket. */
-        sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (sock_fd == -1)
-            ERROR_EXIT("socket: %s.\n", strerror(errno));
-
-        struct sockaddr_un sock_addr = {0};
-        sock_addr.sun_family = AF_UNIX;
+        if (session) {
+            /* The session has to outlive the parent, so instead of following
+             * it, detach from its terminal and register the session. */
+            setsid();
+
+            int devnull = open("/dev/null", O_RDWR);
+            if (devnull != -1) {
+                dup2(devnull, STDIN_FILENO);
+                dup2(devnull, STDOUT_FILENO);
+                dup2(devnull, STDERR_FILENO);
+                if (devnull > STDERR_FILENO)
+                    close(devnull);
+            }
 
-        /* The size of sun_path is 108 bytes, our SOCK_PATH is definitely
-         * smaller. */
-        strcpy(sock_addr.sun_path, SOCK_PATH);
+            if (chdir("/") == -1)
+                ERROR_EXIT("chdir: %s\n", strerror(errno));
 
-        if (bind(sock_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) == -1)
-            ERROR_EXIT("bind: %s\n", strerror(errno));
+            if (!session_register(session_dirfd, session, session_key))
+                goto end;
 
-        listen(sock_fd, 1);
+            close(session_lockfd);
+            session_lockfd = -1;
+        } else {
+            /* Set the child to get SIGTERM when parent thread dies. */
+            int r = prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (r == -1)
+                ERROR_EXIT("prctl: %s\n", strerror(errno));
 
-        /* Accept incoming connections until SIGTERM. */
-        while (!term_caught) {
-            sock_conn = accept(sock_fd, NULL, 0);
-            if (sock_conn == -1)
-                continue;
-            send_fd(sock_conn, nsfd);
+            /* Maybe it already has died? */
+            if (getppid() != ppid_before_fork)
+                ERROR_EXIT("error: parent has died already.\n");
         }
-    } else {
-        /* Parent process. Drop root rights. */
-        uid_t uid = getuid();
-        gid_t gid = getgid();
-
-        if (setreuid(uid, uid) == -1)
-            ERROR_EXIT("setreuid: %s\n", strerror(errno));
-
-        if (setregid(gid, gid) == -1)
-            ERROR_EXIT("setregid: %s\n", strerror(errno));
 
-        /* Restore working directory. */
-        if (chdir(cwd) == -1)
-            DEBUG("chdir: %s\n", strerror(errno));
-
-        /* Launch program. */
-        if (execvp(argv[optind], (char *const *)argv+optind) == -1)
-            ERROR_EXIT("execvp(%s): %s\n", argv[optind], strerror(errno));
+        /* Serve until SIGTERM. Sessions also stop when they've been idle for
+         * idle_timeout seconds. */
+        struct server_config server = {
+            .nsfd = nsfd,
+            .rootfd = rootfd,
+            .idle_timeout = session ? idle_timeout : 0,
+            .is_idle = session_is_idle,
+        };
+        if (server_run(sock_fd, &server) == -1)
+            goto end;
+    } else {
+        /* Parent process. The child holds the session lock until the
+         * session is registered. */
+        if (session_lockfd != -1) {
+            close(session_lockfd);
+            session_lockfd = -1;
+        }
+        exit_code = exec_program(cwd, argv + optind, jobfile, jobs,
+                                 prefetch_libs, check ? &index : NULL);
+        goto end;
     }
 
     exit_code = 0;
@@ -450,65 +1932,25 @@ end:
     if (nsfd != -1)
         close(nsfd);
 
+    if (rootfd != -1)
+        close(rootfd);
+
     if (sock_fd != -1)
         close(sock_fd);
 
-    if (sock_conn != -1)
-        close(sock_conn);
-
-    if (dirptr != NULL)
-        closedir(dirptr);
-
-    if (!forked || pid == 0) {
-        /* If we created some empty files to bind the voidnsundo utility,
-         * delete them here. */
-        if (created_undos.end > 0) {
-            for (size_t i = 0; i < created_undos.end; i++) {
-                char *path = undo_mounts.list[created_undos.list[i]];
-                if (umount(path) == -1)
-                    DEBUG("umount(%s): %s\n", path, strerror(errno));
-                if (unlink(path) == -1)
-                    ERROR("unlink(%s): %s\n", path, strerror(errno));
-                else
-                    DEBUG("unlink(%s)\n", path);
-            }
-        }
-
-        /* If we had to create mount tmpfs to /oldroot and do other
-         * dirty hacks related to /usr subdirs bind mounting, clean up here. */
-        if (dir_mounts.end > 0) {
-            for (size_t i = 0; i < dir_mounts.end; i++) {
-                char *path = dir_mounts.list[i];
-                if (umount(path) == -1)
-                    ERROR("umount(%s): %s\n", path, strerror(errno));
-            }
+    if (sock_dirfd != -1)
+        close(sock_dirfd);
 
-            /* If we created some empty dirs to use them as mountpoints for
-             * bind mounts, delete them here. */
-            if (created_dirs.end > 0) {
-                for (size_t i = 0; i < created_dirs.end; i++) {
-                    char *path = dir_mounts.list[created_dirs.list[i]];
-                    if (rmdir(path) == -1)
-                        ERROR("rmdir(%s): %s\n", path, strerror(errno));
-                    else
-                        DEBUG("rmdir(%s)\n", path);
-                }
-            }
+    if (session_lockfd != -1)
+        close(session_lockfd);
 
-            strcpy(buf, OLDROOT);
-            strcat(buf, "/usr");
-            if (umount(buf) == -1)
-                ERROR("umount(%s): %s\n", buf, strerror(errno));
-
-            /* This call always fails with EBUSY and I don't know why.
-             * We can safely ignore any errors here (I hope) because
-             * the mount namespace will be destroyed as soon as there
-             * will be no processes attached to it. */
-            umount(OLDROOT);
-            /*if (umount(OLDROOT) == -1)
-                ERROR("umount(%s): %s\n", OLDROOT, strerror(errno));*/
-        }
+    if (session_dirfd != -1) {
+        if (forked && pid == 0)
+            session_unregister(session_dirfd, session);
+        close(session_dirfd);
     }
 
+    free(host_path);
+    arena_free(&arena);
     return exit_code;
 }
@@ -0,0 +1,856 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+
+#include "config.h"
+#include "utils.h"
+#include "macros.h"
+#include "session.h"
+#include "proto.h"
+#include "spawn.h"
+#include "server.h"
+
+/*
+ * voidnsrund, the launch broker.
+ *
+ * Every voidnsrun call execs a setuid binary, creates a mount namespace and
+ * mounts everything, and the kernel serializes namespace creation. When lots
+ * of programs are launched at once, that's what takes the time. voidnsrund
+ * builds namespaces in advance instead, and keeps them in pools.
+ *
+ * Pools are configured in BROKER_CONF, one per line:
+ *
+ *     # Comment.
+ *     voidnsrun <path>                   voidnsrun binary to build with.
+ *     pool <name> <size> [options]...    A pool of namespaces built with these
+ *                                        voidnsrun options.
+ *
+ * Every pool has a socket at BROKER_DIR/<name>, which anyone can connect to.
+ * A client (voidnsrun --pool) sends a PROTO_SPAWN request, just like
+ * voidnsundo -S does. voidnsrund takes a namespace from the pool, starts the
+ * program in it with the client's credentials (the ones in the request are
+ * ignored) and replies with its pid and pidfd, and then with its exit status.
+ * If the pool is empty, the request waits for the next namespace.
+ *
+ * The namespaces are built by voidnsrun itself, which is run with
+ * --export-ns: it sends the fd of the namespace back over a socketpair and
+ * exits. The fd is what keeps the namespace alive until it's used. Every
+ * namespace is used only once, so programs don't see what the previous ones
+ * have mounted, and the pool is refilled in the background right away.
+ *
+ * Since anyone can connect, the broker keeps at most BROKER_MAX_CONNS
+ * connections, BROKER_UID_CONNS of them per user, and at most
+ * BROKER_QUEUE_MAX requests waiting in each pool. When there are too many
+ * connections, it stops accepting, and new clients wait in the listen
+ * backlog, like with the server of voidnsrun. Requests over the other limits
+ * fail with EAGAIN.
+ */
+
+#define BROKER_MAX_EVENTS 16
+#define BROKER_POOL_MAX 64
+#define BROKER_ARGS_MAX 64
+#define BROKER_MAX_CONNS 256
+#define BROKER_UID_CONNS 32
+#define BROKER_QUEUE_MAX 16
+
+enum {
+    TAG_SIGNAL,
+    TAG_POOL,
+    TAG_BUILDER,
+    TAG_CONN,
+};
+
+struct conn;
+
+struct pool {
+    int tag;
+    char name[SESSION_NAME_MAX + 1];
+    int size;
+    char *args[BROKER_ARGS_MAX + 4];
+    int sock_fd;
+    int ready[BROKER_POOL_MAX];
+    int nready;
+    int building;
+    time_t retry_at;    /* When to try again after a failed build, or 0. */
+    int failures;       /* Failed builds in a row. */
+    struct conn *queue; /* Requests waiting for a namespace. */
+};
+
+struct builder {
+    int tag;
+    int fd;
+    pid_t pid;
+    struct pool *pool;
+};
+
+struct conn {
+    int tag;
+    int fd;
+    uid_t uid;
+    pid_t pid;          /* Spawned program the client waits for, or 0. */
+    struct pool *pool;
+
+    /* A request that waits in the queue of the pool. */
+    char *req;
+    size_t len;
+    int fds[SPAWN_FDS];
+    struct conn *next_queued;
+
+    struct conn *next;
+};
+
+static struct pool *pools;
+static size_t npools;
+static char *voidnsrun_bin = BROKER_VOIDNSRUN;
+static struct conn *conns;
+static size_t nconns;
+static bool accepting = true;
+static int epoll_fd = -1;
+static int reserve_fd = -1;
+
+/* Requests are read here. */
+static char msg_buf[PROTO_MSG_MAX];
+
+bool g_verbose = false;
+
+void usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS]\n", progname);
+    printf("\n"
+           "Options:\n"
+           "    -c <path>: Read pools from this file instead of\n"
+           "               " BROKER_CONF ".\n"
+           "    -V:        Enable verbose output.\n"
+           "    -h:        Print this help.\n"
+           "    -v:        Print version.\n");
+}
+
+static time_t monotonic_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static bool epoll_add(int fd, void *tag)
+{
+    struct epoll_event ev = {0};
+
+    ev.events = EPOLLIN|EPOLLRDHUP;
+    ev.data.ptr = tag;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ERROR("epoll_ctl: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Parses one "pool" line. The strings stay in text. */
+static bool parse_pool(struct pool *pool, char **save)
+{
+    char *name = strtok_r(NULL, " \t", save);
+    char *size = strtok_r(NULL, " \t", save);
+    char *arg;
+    int nargs = 1;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->tag = TAG_POOL;
+    pool->sock_fd = -1;
+
+    if (name == NULL || !session_name_valid(name)) {
+        ERROR("error: invalid pool name.\n");
+        return false;
+    }
+    strcpy(pool->name, name);
+
+    if (size == NULL || !parse_posint(size, &pool->size) || pool->size > BROKER_POOL_MAX) {
+        ERROR("error: pool %s: size must be from 1 to %d.\n", name, BROKER_POOL_MAX);
+        return false;
+    }
+
+    while ((arg = strtok_r(NULL, " \t", save)) != NULL) {
+        if (nargs == BROKER_ARGS_MAX) {
+            ERROR("error: pool %s: too many options.\n", name);
+            return false;
+        }
+        pool->args[nargs++] = arg;
+    }
+    pool->args[nargs++] = "--export-ns";
+    pool->args[nargs++] = "3";
+    pool->args[nargs] = NULL;
+    return true;
+}
+
+/* Reads BROKER_CONF or the like. It must be owned by root, since the options
+ * are passed to voidnsrun as root. */
+static bool load_config(const char *path)
+{
+    struct stat st;
+    char *text = NULL, *line, *save;
+    ssize_t len;
+    bool ok = false;
+    int fd, lineno = 0;
+
+    fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1) {
+        ERROR("error: failed to open %s: %s.\n", path, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != 0
+            || (st.st_mode & 022) != 0) {
+        ERROR("error: %s must be owned by root and not writable by others.\n", path);
+        goto end;
+    }
+
+    /* The text is never freed, the pools point into it. */
+    text = malloc(st.st_size + 1);
+    if (text == NULL || (len = read(fd, text, st.st_size)) == -1) {
+        ERROR("error: failed to read %s.\n", path);
+        goto end;
+    }
+    text[len] = '\0';
+
+    for (line = text; line != NULL; line = save) {
+        char *directive, *arg, *save2;
+
+        lineno++;
+        save = strchr(line, '\n');
+        if (save != NULL)
+            *save++ = '\0';
+
+        directive = strtok_r(line, " \t", &save2);
+        if (directive == NULL || directive[0] == '#')
+            continue;
+
+        if (!strcmp(directive, "voidnsrun")) {
+            arg = strtok_r(NULL, " \t", &save2);
+            if (arg == NULL || arg[0] != '/') {
+                ERROR("error: %s:%d: voidnsrun path must be absolute.\n", path, lineno);
+                goto end;
+            }
+            voidnsrun_bin = arg;
+        } else if (!strcmp(directive, "pool")) {
+            struct pool *new_pools = realloc(pools, sizeof(*pools) * (npools + 1));
+            if (new_pools == NULL) {
+                ERROR("error: out of memory.\n");
+                goto end;
+            }
+            pools = new_pools;
+            if (!parse_pool(&pools[npools], &save2)) {
+                ERROR("error: %s:%d: invalid pool.\n", path, lineno);
+                goto end;
+            }
+            for (size_t i = 0; i < npools; i++) {
+                if (!strcmp(pools[i].name, pools[npools].name)) {
+                    ERROR("error: %s:%d: pool %s is already defined.\n",
+                          path, lineno, pools[i].name);
+                    goto end;
+                }
+            }
+            npools++;
+        } else {
+            ERROR("error: %s:%d: unknown directive %s.\n", path, lineno, directive);
+            goto end;
+        }
+    }
+
+    if (npools == 0) {
+        ERROR("error: no pools in %s.\n", path);
+        goto end;
+    }
+    for (size_t i = 0; i < npools; i++)
+        pools[i].args[0] = voidnsrun_bin;
+    ok = true;
+
+end:
+    close(fd);
+    return ok;
+}
+
+/* Creates BROKER_DIR/<name>. Anyone can connect, the requests are run with
+ * the client's credentials anyway. */
+static bool pool_listen(struct pool *pool)
+{
+    struct sockaddr_un addr = {0};
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", BROKER_DIR, pool->name);
+    if (unlink(addr.sun_path) == -1 && errno != ENOENT) {
+        ERROR("error: failed to remove %s: %s.\n", addr.sun_path, strerror(errno));
+        return false;
+    }
+
+    pool->sock_fd = server_listen(&addr);
+    if (pool->sock_fd == -1)
+        return false;
+    if (chmod(addr.sun_path, 0666) == -1) {
+        ERROR("chmod(%s): %s\n", addr.sun_path, strerror(errno));
+        return false;
+    }
+    return epoll_add(pool->sock_fd, pool);
+}
+
+/* Waits before the next build, longer after every failure in a row, so that
+ * a broken configuration doesn't keep the broker busy. */
+static void pool_backoff(struct pool *pool)
+{
+    int shift = pool->failures < 6 ? pool->failures : 6;
+    pool->failures++;
+    pool->retry_at = monotonic_sec() + ((time_t)BROKER_RETRY << shift);
+}
+
+/* Starts voidnsrun to build one more namespace for the pool. */
+static void pool_build(struct pool *pool)
+{
+    struct builder *b;
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1) {
+        ERROR("socketpair: %s\n", strerror(errno));
+        pool_backoff(pool);
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        /* dup2() leaves the new fd open across exec. */
+        if (dup2(sv[1], 3) == -1)
+            _exit(126);
+        if (chdir("/") == -1)
+            _exit(126);
+        execv(pool->args[0], pool->args);
+        ERROR("execv(%s): %s\n", pool->args[0], strerror(errno));
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        ERROR("fork: %s\n", strerror(errno));
+        close(sv[0]);
+        pool_backoff(pool);
+        return;
+    }
+
+    b = malloc(sizeof(*b));
+    if (b == NULL || !epoll_add(sv[0], b)) {
+        free(b);
+        close(sv[0]);
+        pool_backoff(pool);
+        return;
+    }
+    b->tag = TAG_BUILDER;
+    b->fd = sv[0];
+    b->pid = pid;
+    b->pool = pool;
+    pool->building++;
+    DEBUG("%s: %s: building with %d\n", __func__, pool->name, (int)pid);
+}
+
+/* Keeps the pool full, unless it's waiting after a failure. */
+static void pool_refill(struct pool *pool)
+{
+    while (pool->retry_at == 0 && pool->nready + pool->building < pool->size)
+        pool_build(pool);
+}
+
+/* Stops or resumes accepting connections on all the pools' sockets. */
+static void set_accepting(bool on)
+{
+    struct epoll_event ev = {0};
+
+    if (accepting == on)
+        return;
+    for (size_t i = 0; i < npools; i++) {
+        if (pools[i].sock_fd == -1)
+            continue;
+        ev.events = on ? EPOLLIN|EPOLLRDHUP : 0;
+        ev.data.ptr = &pools[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pools[i].sock_fd, &ev) == -1)
+            ERROR("epoll_ctl: %s\n", strerror(errno));
+    }
+    accepting = on;
+}
+
+static void conn_close(struct conn *conn)
+{
+    struct conn **p;
+
+    for (p = &conns; *p != NULL; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    if (conn->req != NULL) {
+        for (p = &conn->pool->queue; *p != NULL; p = &(*p)->next_queued) {
+            if (*p == conn) {
+                *p = conn->next_queued;
+                break;
+            }
+        }
+        for (int i = 0; i < SPAWN_FDS; i++)
+            close(conn->fds[i]);
+        free(conn->req);
+    }
+    close(conn->fd);
+    free(conn);
+    nconns--;
+    set_accepting(true);
+}
+
+/* Starts the program of a request in the namespace of nsfd, with the
+ * credentials of the client. Returns false if the connection can be closed. */
+static bool conn_spawn(struct conn *conn, char *buf, size_t len,
+                       const int *fds, int nsfd)
+{
+    gid_t groups[NGROUPS_MAX];
+    socklen_t groups_len = sizeof(groups);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    struct spawn s;
+    pid_t pid;
+    int pidfd;
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1
+            || getsockopt(conn->fd, SOL_SOCKET, SO_PEERGROUPS, groups, &groups_len) == -1) {
+        proto_send(conn->fd, PROTO_ERROR, errno, NULL, 0, NULL, 0);
+        return false;
+    }
+
+    if (!spawn_parse(buf, len, &s)) {
+        proto_send(conn->fd, PROTO_ERROR, EINVAL, NULL, 0, NULL, 0);
+        return false;
+    }
+    s.req.uid = cred.uid;
+    s.req.gid = cred.gid;
+    s.req.ngroups = groups_len / sizeof(gid_t);
+    s.groups = groups;
+
+    pid = spawn_start(&s, nsfd, -1, fds, NULL);
+    spawn_free(&s);
+    if (pid == -1) {
+        ERROR("fork: %s\n", strerror(errno));
+        proto_send(conn->fd, PROTO_ERROR, errno, NULL, 0, NULL, 0);
+        return false;
+    }
+    DEBUG("%s: %s: spawned %d for uid %u\n", __func__, conn->pool->name,
+          (int)pid, (unsigned)cred.uid);
+
+    /* Without pidfd (Linux < 5.3), the client falls back to kill(). */
+    pidfd = sys_pidfd_open(pid, 0);
+    proto_send(conn->fd, PROTO_PID, pid, NULL, 0, &pidfd, pidfd != -1 ? 1 : 0);
+    if (pidfd != -1)
+        close(pidfd);
+    conn->pid = pid;
+    return true;
+}
+
+/* Takes a namespace for the next request in the queue, or puts it into the
+ * pool if nobody is waiting. */
+static void pool_add(struct pool *pool, int nsfd)
+{
+    struct conn *conn = pool->queue;
+
+    if (conn == NULL) {
+        pool->ready[pool->nready++] = nsfd;
+        return;
+    }
+
+    pool->queue = conn->next_queued;
+    conn_spawn(conn, conn->req, conn->len, conn->fds, nsfd);
+    close(nsfd);
+    for (int i = 0; i < SPAWN_FDS; i++)
+        close(conn->fds[i]);
+    free(conn->req);
+    conn->req = NULL;
+    if (conn->pid == 0)
+        conn_close(conn);
+    pool_refill(pool);
+}
+
+/* Fails the requests in the queue, when there's no namespace coming for
+ * them. */
+static void pool_fail(struct pool *pool)
+{
+    while (pool->queue != NULL) {
+        struct conn *conn = pool->queue;
+        proto_send(conn->fd, PROTO_ERROR, EAGAIN, NULL, 0, NULL, 0);
+        conn_close(conn);
+    }
+}
+
+/* Handles the request of a connection, or puts it into the queue of the pool
+ * if there's no namespace ready. Returns false if the connection can be
+ * closed. */
+static bool conn_request(struct conn *conn)
+{
+    struct pool *pool = conn->pool;
+    struct proto_hdr hdr;
+    int fds[PROTO_MAX_FDS];
+    int nfds;
+    ssize_t len;
+    bool keep = false;
+
+    len = proto_recv(conn->fd, &hdr, msg_buf, sizeof(msg_buf), fds, &nfds, MSG_DONTWAIT);
+    if (len == -1) {
+        if (errno == EAGAIN)
+            return true;
+        DEBUG("%s: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    if (hdr.type != PROTO_SPAWN || nfds != SPAWN_FDS) {
+        proto_send(conn->fd, PROTO_ERROR, EINVAL, NULL, 0, NULL, 0);
+        goto end;
+    }
+
+    if (pool->nready > 0) {
+        int nsfd = pool->ready[--pool->nready];
+        keep = conn_spawn(conn, msg_buf, len, fds, nsfd);
+        close(nsfd);
+        pool_refill(pool);
+        goto end;
+    }
+
+    /* Wait for the next namespace, at the end of the queue, unless it's
+     * full. */
+    struct conn **p = &pool->queue;
+    int queued = 0;
+    while (*p != NULL) {
+        p = &(*p)->next_queued;
+        queued++;
+    }
+    if (queued == BROKER_QUEUE_MAX) {
+        DEBUG("%s: %s: queue is full\n", __func__, pool->name);
+        proto_send(conn->fd, PROTO_ERROR, EAGAIN, NULL, 0, NULL, 0);
+        goto end;
+    }
+
+    DEBUG("%s: %s: no namespace ready, queueing\n", __func__, pool->name);
+    conn->req = malloc(len);
+    if (conn->req == NULL) {
+        proto_send(conn->fd, PROTO_ERROR, ENOMEM, NULL, 0, NULL, 0);
+        goto end;
+    }
+    memcpy(conn->req, msg_buf, len);
+    conn->len = len;
+    memcpy(conn->fds, fds, sizeof(conn->fds));
+    nfds = 0;
+
+    *p = conn;
+    conn->next_queued = NULL;
+    keep = true;
+
+    /* Don't let the request wait for the backoff. If the build fails again,
+     * it gets an error instead. */
+    if (pool->building == 0) {
+        pool->retry_at = 0;
+        pool_refill(pool);
+    }
+
+end:
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    return keep;
+}
+
+/* Returns the number of connections of the user. */
+static int uid_conns(uid_t uid)
+{
+    int n = 0;
+
+    for (struct conn *conn = conns; conn != NULL; conn = conn->next)
+        n += conn->uid == uid;
+    return n;
+}
+
+/* Accepts everything that is waiting in the backlog, while there's room. */
+static void pool_accept(struct pool *pool)
+{
+    struct ucred cred;
+    socklen_t cred_len;
+    struct conn *conn;
+    int fd;
+
+    while (accepting) {
+        fd = accept4(pool->sock_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* Out of fds. The connection would stay in the backlog and epoll
+             * would keep reporting it, so use the reserved fd to accept and
+             * drop it. accept() fails like this even if there's nothing to
+             * accept, so stop when the backlog is empty. */
+            if ((errno == EMFILE || errno == ENFILE) && reserve_fd != -1) {
+                ERROR("accept: %s\n", strerror(errno));
+                close(reserve_fd);
+                fd = accept(pool->sock_fd, NULL, NULL);
+                if (fd != -1)
+                    close(fd);
+                reserve_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+                if (fd == -1)
+                    return;
+                continue;
+            }
+
+            if (errno != EAGAIN)
+                ERROR("accept: %s\n", strerror(errno));
+            return;
+        }
+
+        cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+            close(fd);
+            continue;
+        }
+        if (uid_conns(cred.uid) >= BROKER_UID_CONNS) {
+            DEBUG("%s: too many connections of uid %u\n", __func__, (unsigned)cred.uid);
+            proto_send(fd, PROTO_ERROR, EAGAIN, NULL, 0, NULL, 0);
+            close(fd);
+            continue;
+        }
+
+        conn = calloc(1, sizeof(*conn));
+        if (conn == NULL || !epoll_add(fd, conn)) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->tag = TAG_CONN;
+        conn->fd = fd;
+        conn->uid = cred.uid;
+        conn->pool = pool;
+        conn->next = conns;
+        conns = conn;
+        if (++nconns == BROKER_MAX_CONNS)
+            set_accepting(false);
+
+        if (!conn_request(conn))
+            conn_close(conn);
+    }
+}
+
+static void conn_event(struct conn *conn)
+{
+    /* A client that waits for a program or a namespace can only hang up. */
+    if (conn->pid > 0 || conn->req != NULL || !conn_request(conn))
+        conn_close(conn);
+}
+
+/* Receives the namespace from voidnsrun --export-ns. */
+static void builder_event(struct builder *b)
+{
+    struct pool *pool = b->pool;
+    struct proto_hdr hdr;
+    int fds[PROTO_MAX_FDS];
+    int nfds;
+    bool ok = false;
+
+    if (proto_recv(b->fd, &hdr, NULL, 0, fds, &nfds, MSG_DONTWAIT) == -1) {
+        if (errno == EAGAIN)
+            return;
+    } else if (hdr.type == PROTO_NSFD && nfds == 1) {
+        ok = true;
+    } else {
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+    }
+
+    pool->building--;
+    close(b->fd);
+    free(b);
+
+    if (ok) {
+        DEBUG("%s: %s: namespace is ready\n", __func__, pool->name);
+        pool->failures = 0;
+        pool_add(pool, fds[0]);
+        return;
+    }
+
+    /* voidnsrun has reported what went wrong already. */
+    ERROR("error: failed to build a namespace for pool %s.\n", pool->name);
+    pool_backoff(pool);
+    if (pool->building == 0 && pool->nready == 0)
+        pool_fail(pool);
+}
+
+/* Reaps builders and spawned programs, and reports the exit status of the
+ * latter. */
+static void reap(void)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (struct conn *conn = conns; conn != NULL; conn = conn->next) {
+            if (conn->pid == pid) {
+                DEBUG("%s: %d exited with status %d\n", __func__, (int)pid, status);
+                proto_send(conn->fd, PROTO_EXIT, status, NULL, 0, NULL, 0);
+                conn_close(conn);
+                break;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event events[BROKER_MAX_EVENTS];
+    struct signalfd_siginfo si;
+    const char *config = BROKER_CONF;
+    int signal_tag = TAG_SIGNAL;
+    int signal_fd = -1;
+    int exit_code = 1;
+    struct stat st;
+    sigset_t mask;
+    int c;
+
+    while ((c = getopt(argc, argv, "vhc:V")) != -1) {
+        switch (c) {
+        case 'v':
+            printf("%s\n", PROG_VERSION);
+            return 0;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        case 'c':
+            config = optarg;
+            break;
+        case 'V':
+            g_verbose = true;
+            break;
+        case '?':
+            return 1;
+        }
+    }
+
+    if (getuid() != 0 || geteuid() != 0)
+        ERROR_EXIT("error: voidnsrund must be run as root.\n");
+
+    if (!load_config(config))
+        goto end;
+
+    if (mkdir(BROKER_DIR, 0755) == -1 && errno != EEXIST)
+        ERROR_EXIT("error: failed to create %s: %s.\n", BROKER_DIR, strerror(errno));
+    if (lstat(BROKER_DIR, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != 0
+            || (st.st_mode & 022) != 0)
+        ERROR_EXIT("error: %s must be owned by root and not writable by others.\n",
+                   BROKER_DIR);
+
+    /* Programs are started with a clean mask by spawn_start(). */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        ERROR_EXIT("sigprocmask: %s\n", strerror(errno));
+    signal(SIGPIPE, SIG_IGN);
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if (signal_fd == -1)
+        ERROR_EXIT("signalfd: %s\n", strerror(errno));
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        ERROR_EXIT("epoll_create1: %s\n", strerror(errno));
+    if (!epoll_add(signal_fd, &signal_tag))
+        goto end;
+
+    /* Keep one fd in reserve for the case we run out of them. */
+    reserve_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+
+    for (size_t i = 0; i < npools; i++) {
+        if (!pool_listen(&pools[i]))
+            goto end;
+        pool_refill(&pools[i]);
+    }
+
+    for (;;) {
+        /* Wake up once a second while some pool waits to retry a build. */
+        int timeout = -1;
+        for (size_t i = 0; i < npools; i++) {
+            if (pools[i].retry_at != 0)
+                timeout = 1000;
+        }
+
+        int n = epoll_wait(epoll_fd, events, BROKER_MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR)
+            ERROR_EXIT("epoll_wait: %s\n", strerror(errno));
+
+        for (int i = 0; i < n; i++) {
+            int *tag = events[i].data.ptr;
+            switch (*tag) {
+            case TAG_SIGNAL:
+                while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+                    if (si.ssi_signo == SIGCHLD)
+                        continue;
+                    DEBUG("got signal %u\n", si.ssi_signo);
+                    exit_code = 0;
+                    goto end;
+                }
+                reap();
+                break;
+            case TAG_POOL:
+                pool_accept((struct pool *)tag);
+                break;
+            case TAG_BUILDER:
+                builder_event((struct builder *)tag);
+                break;
+            case TAG_CONN:
+                conn_event((struct conn *)tag);
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < npools; i++) {
+            if (pools[i].retry_at != 0 && monotonic_sec() >= pools[i].retry_at) {
+                pools[i].retry_at = 0;
+                pool_refill(&pools[i]);
+            }
+        }
+    }
+
+end:
+    /* The namespaces in the pools go away with their fds. Programs that
+     * are still running are not affected. */
+    for (size_t i = 0; i < npools; i++) {
+        char path[sizeof(BROKER_DIR) + SESSION_NAME_MAX + 2];
+        for (int j = 0; j < pools[i].nready; j++)
+            close(pools[i].ready[j]);
+        if (pools[i].sock_fd != -1) {
+            close(pools[i].sock_fd);
+            pools[i].sock_fd = -1;
+            snprintf(path, sizeof(path), "%s/%s", BROKER_DIR, pools[i].name);
+            unlink(path);
+        }
+    }
+    while (conns != NULL)
+        conn_close(conns);
+    if (reserve_fd != -1)
+        close(reserve_fd);
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    if (signal_fd != -1)
+        close(signal_fd);
+    return exit_code;
+}
@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sched.h>
 #include <sys/socket.h>
@@ -16,6 +17,10 @@
 #include "config.h"
 #include "utils.h"
 #include "macros.h"
+#include "trace.h"
+#include "proto.h"
+#include "spawn.h"
+#include "origin.h"
 
 bool g_verbose = false;
 
@@ -24,16 +29,28 @@ void usage(const char *progname)
     printf("Usage: %s [OPTIONS] PROGRAM [ARGS]\n", progname);
     printf("\n"
            "Options:\n"
+           "    -S:  Ask the voidnsrun server to start PROGRAM, instead of\n"
+           "         entering the original namespace and starting it here.\n"
+           "         Set " SPAWN_VAR "=1 to do that in bind mode.\n"
            "    -V:  Enable verbose output.\n"
+           "    -T:  Write timing of startup phases to stderr as JSON lines.\n"
+           "         Set " TRACE_VAR "=<fd> to write them to another fd.\n"
            "    -h:  Print this help.\n"
            "    -v:  Print version.\n");
 }
 
 int main(int argc, char **argv)
 {
+    uint64_t t_start = trace_now();
+    uint64_t t;
+    bool trace = false;
+    bool spawn = false;
     bool binded = strcmp(basename(argv[0]), VOIDNSUNDO_NAME) != 0;
     int c;
     int sock_fd = -1;
+    int cwd_fd = -1;
+    int nsfd = -1;
+    int rootfd = -1;
     int exit_code = 1;
     char realpath_buf[PATH_MAX];
     char cwd[PATH_MAX];
@@ -43,7 +60,7 @@ int main(int argc, char **argv)
             return 0;
         }
 
-        while ((c = getopt(argc, argv, "vhs:V")) != -1) {
+        while ((c = getopt(argc, argv, "vhs:VTS")) != -1) {
             switch (c) {
             case 'v':
                 printf("%s\n", PROG_VERSION);
@@ -54,6 +71,12 @@ int main(int argc, char **argv)
             case 'V':
                 g_verbose = true;
                 break;
+            case 'T':
+                trace = true;
+                break;
+            case 'S':
+                spawn = true;
+                break;
             case '?':
                 return 1;
             }
@@ -64,39 +87,121 @@ int main(int argc, char **argv)
             return 1;
         }
     } else {
-        int bytes = readlink("/proc/self/exe", realpath_buf, PATH_MAX);
+        int bytes = readlink("/proc/self/exe", realpath_buf, PATH_MAX - 1);
+        if (bytes == -1)
+            ERROR_EXIT("readlink: %s\n", strerror(errno));
         realpath_buf[bytes] = '\0';
         /* DEBUG("/proc/self/exe points to %s\n", realpath_buf); */
+
+        /* Called through a symlink (a voidnsrun --auto-undo shim), not
+         * through a bind mount. The program is then the one with the same
+         * name in the host's PATH. */
+        if (!strcmp(basename(realpath_buf), VOIDNSUNDO_NAME))
+            snprintf(realpath_buf, PATH_MAX, "%s", basename(argv[0]));
     }
 
-    /* Get current working directory. */
-    getcwd(cwd, PATH_MAX);
+    trace_setup("voidnsundo", trace);
+    trace_phase("options", t_start, NULL);
+
+    const char *spawn_env = getenv(SPAWN_VAR);
+    if (spawn_env != NULL && !strcmp(spawn_env, "1"))
+        spawn = true;
+
+    int argind = binded ? 0 : optind;
+    if (binded)
+        argv[0] = realpath_buf;
+
+    /* Get current working directory. The fd is what it's restored from, the
+     * path is only preferred if it leads to the same directory. */
+    if (getcwd(cwd, PATH_MAX) == NULL)
+        cwd[0] = '\0';
+    cwd_fd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
     DEBUG("cwd=%s\n", cwd);
 
-    /* Get namespace's fd. */
-    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    /* If voidnsrun was started with --no-server, there's no socket, and the
+     * namespace is entered through the process it has recorded. */
+    char origin[128];
+    if (!ns_file_path(origin, sizeof(origin), "/proc/self/ns/mnt", "origin"))
+        ERROR_EXIT("error: failed to get origin path.\n");
+    t = trace_now();
+    if (origin_enter(origin) == 0) {
+        trace_phase("setns", t, "origin");
+        if (spawn)
+            DEBUG("no server to spawn the program, running it here\n");
+        goto entered;
+    }
+    if (errno != ENOENT)
+        goto end;
+
+    t = trace_now();
+    sock_fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
     if (sock_fd == -1)
         ERROR_EXIT("socket: %s.\n", strerror(errno));
 
+    /* Every namespace has its own socket, named after the namespace. */
     struct sockaddr_un sock_addr = {0};
     sock_addr.sun_family  = AF_UNIX;
-
-    /* The size of sun_path is 108 bytes, our SOCK_PATH is definitely
-     * smaller. */
-    strcpy(sock_addr.sun_path, SOCK_PATH);
+    if (!sock_path(sock_addr.sun_path, sizeof(sock_addr.sun_path), "/proc/self/ns/mnt"))
+        ERROR_EXIT("error: failed to get socket path.\n");
 
     if (connect(sock_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) == -1)
-        ERROR_EXIT("connect: %s\n", strerror(errno));
+        ERROR_EXIT("connect(%s): %s\n", sock_addr.sun_path, strerror(errno));
+    trace_phase("connect", t, sock_addr.sun_path);
+
+    /* In spawn mode, the server starts the program for us and we only wait
+     * for it to exit. If the request is too big for a message, fall back to
+     * the normal mode. */
+    if (spawn) {
+        t = trace_now();
+        if (spawn_send(sock_fd, argv+argind, environ) != -1) {
+            trace_phase("spawn", t, argv[argind]);
+
+            if (setreuid(getuid(), getuid()) == -1)
+                ERROR_EXIT("setreuid: %s\n", strerror(errno));
+            if (setregid(getgid(), getgid()) == -1)
+                ERROR_EXIT("setregid: %s\n", strerror(errno));
+
+            exit_code = spawn_wait(sock_fd);
+            goto end;
+        }
+        if (errno != EMSGSIZE)
+            ERROR_EXIT("error: failed to send spawn request: %s.\n", strerror(errno));
+        DEBUG("spawn request is too big, falling back to setns\n");
+    }
 
-    int nsfd = recv_fd(sock_fd);
-    if (!nsfd)
-        ERROR_EXIT("error: failed to get nsfd.\n");
+    /* Get namespace's fd, and the root directory if the server has it, in
+     * one round trip. */
+    t = trace_now();
+    struct proto_hdr hdr;
+    int fds[PROTO_MAX_FDS];
+    int nfds;
+    if (proto_send(sock_fd, PROTO_NSFD, 0, NULL, 0, NULL, 0) == -1
+            || proto_recv(sock_fd, &hdr, NULL, 0, fds, &nfds, 0) == -1)
+        ERROR_EXIT("error: failed to get nsfd: %s.\n", proto_strerror(errno));
+    if (hdr.type == PROTO_ERROR)
+        ERROR_EXIT("error: failed to get nsfd: %s.\n", proto_strerror(hdr.value));
+    if (nfds > 0)
+        nsfd = fds[0];
+    if (nfds > 1 && (hdr.value & PROTO_NSFD_ROOT))
+        rootfd = fds[1];
+    if (hdr.type != PROTO_NSFD || nfds != 1 + ((hdr.value & PROTO_NSFD_ROOT) != 0)) {
+        for (int i = rootfd != -1 ? 2 : 1; i < nfds; i++)
+            close(fds[i]);
+        ERROR_EXIT("error: failed to get nsfd: unexpected reply from the server.\n");
+    }
+    trace_phase("recv_fd", t, NULL);
 
     /* Change namespace. */
+    t = trace_now();
     if (setns(nsfd, CLONE_NEWNS) == -1)
         ERROR_EXIT("setns: %s.\n", strerror(errno));
+    if (rootfd != -1 && !enter_root(rootfd))
+        ERROR_EXIT("error: failed to change root: %s.\n", strerror(errno));
+    trace_phase("setns", t, NULL);
 
+entered:
     /* Drop root. */
+    t = trace_now();
     uid_t uid = getuid();
     gid_t gid = getgid();
 
@@ -105,15 +210,13 @@ int main(int argc, char **argv)
 
     if (setregid(gid, gid) == -1)
         ERROR_EXIT("setregid: %s\n", strerror(errno));
+    trace_phase("drop_privileges", t, NULL);
 
     /* Restore working directory. */
-    if (chdir(cwd) == -1)
-        DEBUG("chdir: %s\n", strerror(errno));
+    enter_cwd(cwd, cwd_fd);
 
     /* Launch program. */
-    int argind = binded ? 0 : optind;
-    if (binded)
-        argv[0] = realpath_buf;
+    trace_phase("exec", trace_now(), argv[argind]);
     if (execvp(argv[argind], (char *const *)argv+argind) == -1)
         ERROR_EXIT("execvp(%s): %s\n", argv[argind], strerror(errno));
 
@@ -123,5 +226,14 @@ end:
     if (sock_fd != -1)
         close(sock_fd);
 
+    if (nsfd != -1)
+        close(nsfd);
+
+    if (rootfd != -1)
+        close(rootfd);
+
+    if (cwd_fd != -1)
+        close(cwd_fd);
+
     return exit_code;
 }
\ No newline at end of file